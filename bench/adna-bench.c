@@ -0,0 +1,632 @@
+/** @file: adna-bench.c
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * Benchmarks of the discovery and monitoring paths, run against simulated
+ * sysfs trees built by adnacom-sim
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/*
+ * The benchmark is built from adna.c itself, so the static functions of
+ * the hot paths are called directly, on the same state the daemon keeps.
+ * Every benchmark has an untimed setup step that puts that state back to
+ * where the measured step starts from.
+ *
+ * For each tree size, adnacom-sim -g builds BENCH_ADAPTERS adapters with
+ * BENCH_PORTS ports each and fills up the rest with background functions.
+ * Each benchmark then runs for about -t milliseconds, setup included, and
+ * reports
+ * - ns/op: wall clock time per operation;
+ * - sys/op: calls to libc's system call wrappers made by the daemon and
+ *   libpci, which are linked with --wrap; stdio and directory streams
+ *   count once per open, read or close call, not per system call made
+ *   underneath;
+ * - allocs/op: calls to malloc(), calloc() and realloc() anywhere in
+ *   the process.
+ *
+ * The tick is timed three ways: with link registers read from BAR0 (what
+ * the daemon does on a PLX switch), from config space through sysfs, and
+ * from config space through the ECAM method on a file snapshot of the
+ * tree's config space. The last two also time the config space reads of
+ * the tick on their own.
+ */
+
+#define _GNU_SOURCE
+#include "../src/adna.c"
+
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define BENCH_ADAPTERS    2
+#define BENCH_PORTS       3
+#define BENCH_BUDGET_MS   200     /* Default time spent on each benchmark */
+#define BENCH_MIN_ITERS   5
+#define BENCH_MAX_ITERS   100000
+#define BENCH_READS       1000    /* Register reads per plx_bar_read32 iteration */
+
+static const int bench_sizes[] = { 50, 500, 5000 };
+
+static bool counting;             /* Set while the measured step runs */
+static unsigned long sys_calls, allocs;
+
+/*** Counting ***/
+
+/* Every allocation in the process, libc's own included, comes through here */
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+  if (counting)
+    allocs++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  if (counting)
+    allocs++;
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  if (counting)
+    allocs++;
+  return __libc_realloc(ptr, size);
+}
+
+/* The wrapped calls are listed in BENCH_WRAP in the Makefile */
+int __real_open(const char *path, int flags, ...);
+int __real_openat(int dirfd, const char *path, int flags, ...);
+int __real_close(int fd);
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+ssize_t __real_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t __real_pwrite(int fd, const void *buf, size_t count, off_t offset);
+void *__real_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+int __real_munmap(void *addr, size_t length);
+int __real_fstat(int fd, struct stat *st);
+ssize_t __real_readlink(const char *path, char *buf, size_t size);
+int __real_access(const char *path, int mode);
+DIR *__real_opendir(const char *name);
+struct dirent *__real_readdir(DIR *dir);
+int __real_closedir(DIR *dir);
+FILE *__real_fopen(const char *path, const char *mode);
+int __real_fclose(FILE *f);
+char *__real_fgets(char *s, int size, FILE *f);
+long __real_syscall(long number, ...);
+
+int __wrap_open(const char *path, int flags, ...);
+int __wrap_openat(int dirfd, const char *path, int flags, ...);
+int __wrap_close(int fd);
+ssize_t __wrap_read(int fd, void *buf, size_t count);
+ssize_t __wrap_write(int fd, const void *buf, size_t count);
+ssize_t __wrap_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t __wrap_pwrite(int fd, const void *buf, size_t count, off_t offset);
+void *__wrap_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+int __wrap_munmap(void *addr, size_t length);
+int __wrap_fstat(int fd, struct stat *st);
+ssize_t __wrap_readlink(const char *path, char *buf, size_t size);
+int __wrap_access(const char *path, int mode);
+DIR *__wrap_opendir(const char *name);
+struct dirent *__wrap_readdir(DIR *dir);
+int __wrap_closedir(DIR *dir);
+FILE *__wrap_fopen(const char *path, const char *mode);
+int __wrap_fclose(FILE *f);
+char *__wrap_fgets(char *s, int size, FILE *f);
+long __wrap_syscall(long number, ...);
+
+#define SYS_COUNT() do { if (counting) sys_calls++; } while (0)
+
+int __wrap_open(const char *path, int flags, ...)
+{
+  mode_t mode = 0;
+  va_list args;
+
+  if (flags & O_CREAT) {
+    va_start(args, flags);
+    mode = va_arg(args, int);
+    va_end(args);
+  }
+  SYS_COUNT();
+  return __real_open(path, flags, mode);
+}
+
+int __wrap_openat(int dirfd, const char *path, int flags, ...)
+{
+  mode_t mode = 0;
+  va_list args;
+
+  if (flags & O_CREAT) {
+    va_start(args, flags);
+    mode = va_arg(args, int);
+    va_end(args);
+  }
+  SYS_COUNT();
+  return __real_openat(dirfd, path, flags, mode);
+}
+
+int __wrap_close(int fd)
+{
+  SYS_COUNT();
+  return __real_close(fd);
+}
+
+ssize_t __wrap_read(int fd, void *buf, size_t count)
+{
+  SYS_COUNT();
+  return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count)
+{
+  SYS_COUNT();
+  return __real_write(fd, buf, count);
+}
+
+ssize_t __wrap_pread(int fd, void *buf, size_t count, off_t offset)
+{
+  SYS_COUNT();
+  return __real_pread(fd, buf, count, offset);
+}
+
+ssize_t __wrap_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+  SYS_COUNT();
+  return __real_pwrite(fd, buf, count, offset);
+}
+
+void *__wrap_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+  SYS_COUNT();
+  return __real_mmap(addr, length, prot, flags, fd, offset);
+}
+
+int __wrap_munmap(void *addr, size_t length)
+{
+  SYS_COUNT();
+  return __real_munmap(addr, length);
+}
+
+int __wrap_fstat(int fd, struct stat *st)
+{
+  SYS_COUNT();
+  return __real_fstat(fd, st);
+}
+
+ssize_t __wrap_readlink(const char *path, char *buf, size_t size)
+{
+  SYS_COUNT();
+  return __real_readlink(path, buf, size);
+}
+
+int __wrap_access(const char *path, int mode)
+{
+  SYS_COUNT();
+  return __real_access(path, mode);
+}
+
+DIR *__wrap_opendir(const char *name)
+{
+  SYS_COUNT();
+  return __real_opendir(name);
+}
+
+struct dirent *__wrap_readdir(DIR *dir)
+{
+  SYS_COUNT();
+  return __real_readdir(dir);
+}
+
+int __wrap_closedir(DIR *dir)
+{
+  SYS_COUNT();
+  return __real_closedir(dir);
+}
+
+FILE *__wrap_fopen(const char *path, const char *mode)
+{
+  SYS_COUNT();
+  return __real_fopen(path, mode);
+}
+
+int __wrap_fclose(FILE *f)
+{
+  SYS_COUNT();
+  return __real_fclose(f);
+}
+
+char *__wrap_fgets(char *s, int size, FILE *f)
+{
+  SYS_COUNT();
+  return __real_fgets(s, size, f);
+}
+
+/* Only used for io_uring, whose calls take at most six arguments */
+long __wrap_syscall(long number, ...)
+{
+  long arg[6];
+  va_list args;
+  int i;
+
+  va_start(args, number);
+  for (i = 0; i < 6; i++)
+    arg[i] = va_arg(args, long);
+  va_end(args);
+  SYS_COUNT();
+  return __real_syscall(number, arg[0], arg[1], arg[2], arg[3], arg[4], arg[5]);
+}
+
+/*** Simulated trees ***/
+
+static const char *sim_path = "./adnacom-sim";
+static char base[] = "/tmp/adnacom-bench.XXXXXX"; /* Scratch directory of the current size */
+static char tree[sizeof(base) + 4];       /* Simulated sysfs root inside it */
+static char ecam_file[sizeof(base) + 5];  /* Config space snapshot for the ECAM method */
+
+/*! @brief Builds a tree of about @fns functions; returns how many it has, -1 on failure */
+static int tree_build(int fns)
+{
+  int bg = fns - BENCH_ADAPTERS * (2 + 2 * BENCH_PORTS);
+  char a[16], p[16], k[16], path[PATH_MAX];
+  struct dirent *e;
+  int status, n = 0;
+  pid_t pid;
+  DIR *dir;
+
+  snprintf(a, sizeof(a), "%d", BENCH_ADAPTERS);
+  snprintf(p, sizeof(p), "%d", BENCH_PORTS);
+  snprintf(k, sizeof(k), "%d", bg > 0 ? bg : 0);
+  if ((pid = fork()) < 0)
+    return -1;
+  if (pid == 0) {
+    execl(sim_path, sim_path, "-g", "-a", a, "-p", p, "-k", k, tree, (char *)NULL);
+    fprintf(stderr, "adnacom-bench: %s: %s\n", sim_path, strerror(errno));
+    _exit(127);
+  }
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+    return -1;
+
+  snprintf(path, sizeof(path), "%s/bus/pci/devices", tree);
+  if ((dir = opendir(path)) == NULL)
+    return -1;
+  while ((e = readdir(dir)) != NULL)
+    if (e->d_name[0] != '.')
+      n++;
+  closedir(dir);
+  return n;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+  (void)(st); (void)(flag); (void)(ftw);
+  remove(path);
+  return 0;
+}
+
+static void tree_remove(void)
+{
+  nftw(base, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/*! @brief Copies the config space of every scanned function into an ECAM layout file */
+static void ecam_build(void)
+{
+  char path[PATH_MAX], buf[4096];
+  unsigned int max_bus = 0;
+  struct pci_dev *p;
+  ssize_t len;
+  int fd, in;
+
+  if ((fd = open(ecam_file, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+    die("%s: %s", ecam_file, strerror(errno));
+  for (p = pacc->devices; p; p = p->next) {
+    snprintf(path, sizeof(path), "%s/bus/pci/devices/%04x:%02x:%02x.%d/config",
+             tree, p->domain, p->bus, p->dev, p->func);
+    if ((in = open(path, O_RDONLY)) < 0)
+      continue;
+    len = read(in, buf, sizeof(buf));
+    close(in);
+    if (len > 0 && pwrite(fd, buf, len, (off_t)p->bus << 20 | p->dev << 15 | p->func << 12) != len)
+      die("%s: %s", ecam_file, strerror(errno));
+    if (p->bus > max_bus)
+      max_bus = p->bus;
+  }
+  if (ftruncate(fd, (off_t)(max_bus + 1) << 20) < 0)
+    die("%s: %s", ecam_file, strerror(errno));
+  close(fd);
+}
+
+/*** Benchmarks ***/
+
+static struct adna_adapter *bench_ad;   /* Adapter the per-adapter benchmarks use */
+static struct adna_device *bench_port;  /* One of its downstream ports */
+static struct pci_dev *bench_us;        /* Its upstream port */
+static uint32_t sink;
+
+struct bench {
+  const char *name;
+  void (*init)(void);         /* Untimed, once before the first iteration */
+  void (*setup)(void);        /* Untimed, before every iteration */
+  void (*run)(void);          /* The measured step */
+  void (*done)(void);         /* Untimed, once after the last iteration */
+  int ops;                    /* Operations per call of run() */
+};
+
+/*! @brief Rebuilds the forest and rebinds the ports, as after a topology change */
+static void rebind(void)
+{
+  struct adna_device *a;
+  struct device *d;
+
+  topology_stale = true;
+  adna_pci_refresh();
+
+  bench_ad = NULL;
+  for (bench_ad = first_adapter; bench_ad && !bench_ad->us; bench_ad = bench_ad->next)
+    ;
+  if (!bench_ad || (d = find_device(bench_ad->us)) == NULL)
+    die("No Adnacom switch found in %s", tree);
+  bench_us = d->dev;
+  bench_port = NULL;
+  for (a = first_adna; a; a = a->next)
+    if (a->adapter == bench_ad && a->dev && (!bench_port || a->mmio_lnk))
+      bench_port = a;
+  if (!bench_port)
+    die("No downstream port found in %s", tree);
+}
+
+static void teardown(void)
+{
+  adna_delete_list();
+}
+
+static void drop_forest(void)
+{
+  free_devices();
+  release_pci_devices();
+}
+
+static void run_process(void)
+{
+  adna_pci_process();
+}
+
+static void setup_sort(void)
+{
+  drop_forest();
+  scan_devices();
+}
+
+static void setup_grow(void)
+{
+  drop_forest();
+  scan_devices();
+  sort_them();
+}
+
+/* The full config refresh the tick did per port before the link data was cached */
+static int refresh_device_cache(struct pci_dev *pdev)
+{
+  /* let's refresh the pcidev details */
+  if (!pdev->cache) {
+    u8 *cache;
+    if ((cache = calloc(1, 256)) == NULL) {
+      adna_log(LOG_CRIT, "error allocating pci device config cache!");
+      exit(-1);
+    }
+    pci_setup_cache(pdev, cache, 256);
+  }
+
+  /* refresh the config block */
+  if (!pci_read_block(pdev, 0, pdev->cache, 256)) {
+    adna_log(LOG_ERR, "error reading pci device config!");
+    return -1;
+  }
+  return 0;
+}
+
+static void run_refresh_cache(void)
+{
+  refresh_device_cache(bench_us);
+}
+
+static void setup_bar_map(void)
+{
+  plx_bar_unmap(&bench_ad->bar0);
+}
+
+static void run_bar_map(void)
+{
+  adapter_map(bench_ad);
+}
+
+static void init_bar_read(void)
+{
+  if (!bench_port->mmio_lnk)
+    fprintf(stderr, "adnacom-bench: %02x:%02x.%d has no link registers in BAR0\n",
+            bench_port->this->bus, bench_port->this->slot, bench_port->this->func);
+}
+
+static void run_bar_read(void)
+{
+  uint32_t reg = bench_port->mmio_lnk;
+  int i;
+
+  if (!plx_bar_valid(&bench_ad->bar0, reg))
+    return;
+  for (i = 0; i < BENCH_READS; i++)
+    sink += plx_bar_read32(&bench_ad->bar0, reg);
+}
+
+static void run_tick(void)
+{
+  adna_monitor_tick(&bench_ad->tick, bench_ad);
+}
+
+static void run_sample(void)
+{
+  adna_sample_ports(bench_ad);
+}
+
+/*! @brief Sends link register reads to config space, as on a switch without the BAR0 mirror */
+static void init_config_space(void)
+{
+  struct adna_device *a;
+
+  for (a = first_adna; a; a = a->next)
+    a->mmio_lnk = 0;
+}
+
+static void init_ecam(void)
+{
+  struct adna_device *a;
+  int found = 0;
+
+  init_config_space();
+  ecam_build();
+  strcpy(AdnaOptions.EcamPath, ecam_file);
+  ecam_open();
+  for (a = first_adna; a; a = a->next)
+    if (a->ecam)
+      found++;
+  if (!found)
+    fprintf(stderr, "adnacom-bench: no port matched in %s\n", ecam_file);
+}
+
+static void done_ecam(void)
+{
+  ecam_close();
+  AdnaOptions.EcamPath[0] = 0;
+  rebind();
+}
+
+static const struct bench benches[] = {
+  { "adna_pci_process",     NULL, teardown, run_process, rebind, 1 },
+  { "scan_devices",         NULL, drop_forest, scan_devices, rebind, 1 },
+  { "sort_them",            NULL, setup_sort, sort_them, rebind, 1 },
+  { "grow_tree",            NULL, setup_grow, grow_tree, rebind, 1 },
+  { "refresh_device_cache", NULL, NULL, run_refresh_cache, NULL, 1 },
+  { "adapter_map",          NULL, setup_bar_map, run_bar_map, NULL, 1 },
+  { "plx_bar_read32",       init_bar_read, NULL, run_bar_read, NULL, BENCH_READS },
+  { "tick/bar0",            NULL, NULL, run_tick, NULL, 1 },
+  { "tick/sysfs",           init_config_space, NULL, run_tick, NULL, 1 },
+  { "adna_sample_ports/sysfs", NULL, NULL, run_sample, rebind, 1 },
+  { "tick/ecam",            init_ecam, NULL, run_tick, NULL, 1 },
+  { "adna_sample_ports/ecam", NULL, NULL, run_sample, done_ecam, 1 },
+};
+
+static FILE *out;                 /* Results; the daemon's own output goes to /dev/null */
+static unsigned int budget_ms = BENCH_BUDGET_MS;
+
+static void bench_run(const struct bench *b, int fns)
+{
+  uint64_t start, total = 0, end = ev_now() + (uint64_t)budget_ms * NSEC_PER_MSEC;
+  unsigned long iters = 0, sys = 0, mem = 0;
+  double ops;
+
+  if (b->init)
+    b->init();
+  /* The budget covers the setup too, which may well be the slow part */
+  while (iters < BENCH_MIN_ITERS || (ev_now() < end && iters < BENCH_MAX_ITERS)) {
+    if (b->setup)
+      b->setup();
+    sys_calls = allocs = 0;
+    counting = true;
+    start = ev_now();
+    b->run();
+    total += ev_now() - start;
+    counting = false;
+    sys += sys_calls;
+    mem += allocs;
+    iters++;
+  }
+  if (b->done)
+    b->done();
+
+  ops = (double)iters * b->ops;
+  fprintf(out, "%6d  %-24s %8lu %12.1f %10.2f %10.2f\n", fns, b->name, iters,
+          total / ops, sys / ops, mem / ops);
+  fflush(out);
+}
+
+static void usage(FILE *f)
+{
+  fprintf(f,
+          "Usage: adnacom-bench [options] [FUNCTIONS...]\n"
+          "Times the daemon's discovery and monitoring paths on simulated trees of\n"
+          "about FUNCTIONS PCI functions each (default 50 500 5000).\n"
+          "  -s FILE    Simulator to build the trees with (default ./adnacom-sim)\n"
+          "  -t MS      Time to spend on each benchmark (default %d)\n"
+          "  -h         Show this help\n", BENCH_BUDGET_MS);
+}
+
+int main(int argc, char **argv)
+{
+  int opt, i, fns, n, nsizes = sizeof(bench_sizes) / sizeof(bench_sizes[0]);
+  char *end;
+
+  while ((opt = getopt(argc, argv, "s:t:h")) != -1) {
+    switch (opt) {
+    case 's':
+      sim_path = optarg;
+      break;
+    case 't':
+      budget_ms = strtoul(optarg, &end, 10);
+      if (*end || !budget_ms) {
+        usage(stderr);
+        return 1;
+      }
+      break;
+    case 'h':
+      usage(stdout);
+      return 0;
+    default:
+      usage(stderr);
+      return 1;
+    }
+  }
+  for (i = optind; i < argc; i++)
+    if (atoi(argv[i]) <= 0) {
+      usage(stderr);
+      return 1;
+    }
+  if (optind < argc)
+    nsizes = argc - optind;
+
+  if ((out = fdopen(dup(STDOUT_FILENO), "w")) == NULL || !freopen("/dev/null", "w", stdout))
+    die("Unable to redirect stdout: %s", strerror(errno));
+  fprintf(out, "%6s  %-24s %8s %12s %10s %10s\n",
+          "fns", "benchmark", "iters", "ns/op", "sys/op", "allocs/op");
+
+  for (i = 0; i < nsizes; i++) {
+    fns = optind < argc ? atoi(argv[optind + i]) : bench_sizes[i];
+    strcpy(base, "/tmp/adnacom-bench.XXXXXX");
+    if (!mkdtemp(base))
+      die("%s: %s", base, strerror(errno));
+    snprintf(tree, sizeof(tree), "%s/sys", base);
+    snprintf(ecam_file, sizeof(ecam_file), "%s/ecam", base);
+    strcpy(AdnaOptions.SysfsRoot, tree);
+    if ((n = tree_build(fns)) < 0) {
+      tree_remove();
+      die("Unable to build a tree of %d functions with %s", fns, sim_path);
+    }
+    for (opt = 0; opt < (int)(sizeof(benches) / sizeof(benches[0])); opt++)
+      bench_run(&benches[opt], n);
+    adna_delete_list();
+    tree_remove();
+  }
+  return 0;
+}
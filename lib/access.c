@@ -130,6 +130,44 @@ pci_read_block(struct pci_dev *d, int pos, byte *buf, int len)
   return d->methods->read(d, pos, buf, len);
 }
 
+/*
+ *  Reads all requests, serving what it can from the devices' caches.
+ *  Backends with a read_batch method get the rest in one call, which
+ *  lets them overlap the reads. Returns the number of successful reads.
+ */
+int
+pci_read_batch(struct pci_access *a, struct pci_read_req *reqs, int n)
+{
+  struct pci_read_req *r;
+  int i, pending = 0, ok = 0;
+
+  for (i = 0; i < n; i++)
+    {
+      r = &reqs[i];
+      if (r->pos + r->len <= r->dev->cache_len)
+	{
+	  memcpy(r->buf, r->dev->cache + r->pos, r->len);
+	  r->result = 1;
+	}
+      else
+	{
+	  r->result = -1;
+	  pending++;
+	}
+    }
+
+  if (pending && a->methods->read_batch)
+    a->methods->read_batch(a, reqs, n);
+  for (i = 0; i < n; i++)
+    {
+      r = &reqs[i];
+      if (r->result < 0)
+	r->result = r->dev->methods->read(r->dev, r->pos, r->buf, r->len);
+      ok += r->result;
+    }
+  return ok;
+}
+
 int
 pci_read_vpd(struct pci_dev *d, int pos, byte *buf, int len)
 {
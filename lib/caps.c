@@ -10,10 +10,36 @@
 
 #include "internal.h"
 
+/*
+ *  Besides the list, the first capability of each id is kept in a table,
+ *  so pci_find_cap() is a lookup once the list has been scanned. Like the
+ *  list, the table lives until the device is rescanned (PCI_FILL_RESCAN)
+ *  or freed.
+ */
+
+#define PCI_CAP_TABLE_NORMAL 32
+#define PCI_CAP_TABLE_EXT 64
+
+struct pci_cap_table {
+  struct pci_cap *normal[PCI_CAP_TABLE_NORMAL];
+  struct pci_cap *ext[PCI_CAP_TABLE_EXT];
+};
+
+static struct pci_cap **
+pci_cap_slot(struct pci_cap_table *t, unsigned int id, unsigned int type)
+{
+  if (type == PCI_CAP_NORMAL && id < PCI_CAP_TABLE_NORMAL)
+    return &t->normal[id];
+  if (type == PCI_CAP_EXTENDED && id < PCI_CAP_TABLE_EXT)
+    return &t->ext[id];
+  return NULL;
+}
+
 static void
 pci_add_cap(struct pci_dev *d, unsigned int addr, unsigned int id, unsigned int type)
 {
   struct pci_cap *cap = pci_malloc(d->access, sizeof(*cap));
+  struct pci_cap **slot;
 
   if (d->last_cap)
     d->last_cap->next = cap;
@@ -24,14 +50,47 @@ pci_add_cap(struct pci_dev *d, unsigned int addr, unsigned int id, unsigned int
   cap->addr = addr;
   cap->id = id;
   cap->type = type;
+  if (!d->cap_table)
+    {
+      d->cap_table = pci_malloc(d->access, sizeof(struct pci_cap_table));
+      memset(d->cap_table, 0, sizeof(struct pci_cap_table));
+    }
+  slot = pci_cap_slot(d->cap_table, id, type);
+  if (slot && !*slot)
+    *slot = cap;
   d->access->debug("%04x:%02x:%02x.%d: Found capability %04x of type %d at %04x\n",
     d->domain, d->bus, d->dev, d->func, id, type, addr);
 }
 
+/*
+ *  The chains are walked in a copy of config space read in one go, cfg_len
+ *  bytes of it. Anything beyond that is read register by register.
+ */
+
+static inline byte
+cfg_byte(struct pci_dev *d, byte *cfg, int cfg_len, int pos)
+{
+  return pos < cfg_len ? cfg[pos] : pci_read_byte(d, pos);
+}
+
+static inline word
+cfg_word(struct pci_dev *d, byte *cfg, int cfg_len, int pos)
+{
+  return pos + 2 <= cfg_len ? (cfg[pos] | cfg[pos+1] << 8) : pci_read_word(d, pos);
+}
+
+static inline u32
+cfg_long(struct pci_dev *d, byte *cfg, int cfg_len, int pos)
+{
+  return pos + 4 <= cfg_len ?
+    (cfg[pos] | cfg[pos+1] << 8 | cfg[pos+2] << 16 | (u32) cfg[pos+3] << 24) :
+    pci_read_long(d, pos);
+}
+
 static void
-pci_scan_trad_caps(struct pci_dev *d)
+pci_scan_trad_caps(struct pci_dev *d, byte *cfg, int cfg_len)
 {
-  word status = pci_read_word(d, PCI_STATUS);
+  word status = cfg_word(d, cfg, cfg_len, PCI_STATUS);
   byte been_there[256];
   int where;
 
@@ -39,11 +98,11 @@ pci_scan_trad_caps(struct pci_dev *d)
     return;
 
   memset(been_there, 0, 256);
-  where = pci_read_byte(d, PCI_CAPABILITY_LIST) & ~3;
+  where = cfg_byte(d, cfg, cfg_len, PCI_CAPABILITY_LIST) & ~3;
   while (where)
     {
-      byte id = pci_read_byte(d, where + PCI_CAP_LIST_ID);
-      byte next = pci_read_byte(d, where + PCI_CAP_LIST_NEXT) & ~3;
+      byte id = cfg_byte(d, cfg, cfg_len, where + PCI_CAP_LIST_ID);
+      byte next = cfg_byte(d, cfg, cfg_len, where + PCI_CAP_LIST_NEXT) & ~3;
       if (been_there[where]++)
 	break;
       if (id == 0xff)
@@ -54,12 +113,13 @@ pci_scan_trad_caps(struct pci_dev *d)
 }
 
 static void
-pci_scan_ext_caps(struct pci_dev *d)
+pci_scan_ext_caps(struct pci_dev *d, byte *cfg, int cfg_len)
 {
   byte been_there[0x1000];
   int where = 0x100;
 
-  if (!pci_find_cap(d, PCI_CAP_ID_EXP, PCI_CAP_NORMAL))
+  /* Not pci_find_cap(), the traditional list may still be being filled */
+  if (!d->cap_table || !d->cap_table->normal[PCI_CAP_ID_EXP])
     return;
 
   memset(been_there, 0, 0x1000);
@@ -68,7 +128,7 @@ pci_scan_ext_caps(struct pci_dev *d)
       u32 header;
       int id;
 
-      header = pci_read_long(d, where);
+      header = cfg_long(d, cfg, cfg_len, where);
       if (!header || header == 0xffffffff)
 	break;
       id = header & 0xffff;
@@ -83,13 +143,31 @@ pci_scan_ext_caps(struct pci_dev *d)
 unsigned int
 pci_scan_caps(struct pci_dev *d, unsigned int want_fields)
 {
+  byte *cfg = NULL;
+  int cfg_len = 0;
+
   if ((want_fields & PCI_FILL_EXT_CAPS) && !(d->known_fields & PCI_FILL_CAPS))
     want_fields |= PCI_FILL_CAPS;
 
+  /* One bulk read instead of a few small ones per capability */
+  if (want_fields & (PCI_FILL_CAPS | PCI_FILL_EXT_CAPS))
+    {
+      cfg = pci_malloc(d->access, 4096);
+      if (pci_read_block(d, 0, cfg, 256))
+	cfg_len = 256;
+    }
+
   if (want_fields & PCI_FILL_CAPS)
-    pci_scan_trad_caps(d);
+    pci_scan_trad_caps(d, cfg, cfg_len);
   if (want_fields & PCI_FILL_EXT_CAPS)
-    pci_scan_ext_caps(d);
+    {
+      /* Only PCIe devices have an extended space worth reading */
+      if (cfg_len == 256 && d->cap_table && d->cap_table->normal[PCI_CAP_ID_EXP] &&
+	  pci_read_block(d, 256, cfg + 256, 4096 - 256))
+	cfg_len = 4096;
+      pci_scan_ext_caps(d, cfg, cfg_len);
+    }
+  pci_mfree(cfg);
   return want_fields;
 }
 
@@ -103,11 +181,21 @@ pci_free_caps(struct pci_dev *d)
       d->first_cap = cap->next;
       pci_mfree(cap);
     }
+  d->last_cap = NULL;
+  pci_mfree(d->cap_table);
+  d->cap_table = NULL;
 }
 
 struct pci_cap *
 pci_find_cap(struct pci_dev *d, unsigned int id, unsigned int type)
 {
+  struct pci_cap **slot;
+
+  pci_fill_info_v35(d, ((type == PCI_CAP_NORMAL) ? PCI_FILL_CAPS : PCI_FILL_EXT_CAPS));
+  if (!d->cap_table)
+    return NULL;
+  if (slot = pci_cap_slot(d->cap_table, id, type))
+    return *slot;
   return pci_find_cap_nr(d, id, type, NULL);
 }
 
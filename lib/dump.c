@@ -186,5 +186,6 @@ struct pci_methods pm_dump = {
   dump_write,
   NULL,					/* read_vpd */
   NULL,					/* init_dev */
-  dump_cleanup_dev
+  dump_cleanup_dev,
+  NULL					/* read_batch */
 };
@@ -0,0 +1,330 @@
+/*
+ *	The PCI Library -- Memory-Mapped Configuration Space (ECAM)
+ *
+ *	Copyright (c) 2023 Adnacom Inc
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/*
+ *  Maps the ECAM windows listed in the ACPI MCFG table from /dev/mem, so
+ *  that config space reads are plain loads with no system call. Access
+ *  is read-only.
+ *
+ *  ecam.path can also name a regular file standing in for the region.
+ *  With ecam.mcfg set to "", the file is taken as the window of domain 0
+ *  starting at bus 0, covering as many buses as the file holds.
+ *
+ *  A missing MCFG table or an unreadable ecam.path is only a warning:
+ *  the method then has no windows and every read fails, so callers can
+ *  fall back to another method device by device.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "internal.h"
+
+#define ECAM_BUS_SIZE (1 << 20)
+#define ECAM_MAX_WINDOWS 16
+
+/* ACPI table header and reserved field before the allocation entries */
+#define MCFG_ENTRIES 44
+#define MCFG_ENTRY_SIZE 16
+
+struct ecam_window {
+  int domain;
+  int start_bus, end_bus;
+  volatile byte *map;
+  size_t len;
+};
+
+struct ecam_data {
+  int nwindows;
+  struct ecam_window windows[ECAM_MAX_WINDOWS];
+};
+
+static void
+ecam_config(struct pci_access *a)
+{
+  pci_define_param(a, "ecam.mcfg", "/sys/firmware/acpi/tables/MCFG", "ACPI MCFG table describing the ECAM windows (empty: single window at offset 0)");
+  pci_define_param(a, "ecam.path", "/dev/mem", "Physical memory device, or a file standing in for the ECAM region");
+}
+
+static int
+ecam_detect(struct pci_access *a)
+{
+  char *mcfg = pci_get_param(a, "ecam.mcfg");
+  char *path = pci_get_param(a, "ecam.path");
+
+  if (mcfg[0] && access(mcfg, R_OK))
+    {
+      a->debug("...cannot open %s", mcfg);
+      return 0;
+    }
+  if (access(path, R_OK))
+    {
+      a->debug("...cannot open %s", path);
+      return 0;
+    }
+  a->debug("...using %s", path);
+  return 1;
+}
+
+static u64
+get_le(byte *p, int len)
+{
+  u64 x = 0;
+
+  while (len--)
+    x = (x << 8) | p[len];
+  return x;
+}
+
+/* Fills the window list from the MCFG table and the window bases into bases[] */
+static int
+ecam_read_mcfg(struct pci_access *a, char *name, struct ecam_data *e, u64 *bases)
+{
+  byte buf[MCFG_ENTRIES + ECAM_MAX_WINDOWS * MCFG_ENTRY_SIZE];
+  struct ecam_window *w;
+  byte *p;
+  int fd, len;
+
+  fd = open(name, O_RDONLY);
+  if (fd < 0)
+    {
+      a->warning("Cannot open %s: %s", name, strerror(errno));
+      return 0;
+    }
+  len = read(fd, buf, sizeof(buf));
+  close(fd);
+  if (len < MCFG_ENTRIES || memcmp(buf, "MCFG", 4))
+    {
+      a->warning("%s is not an MCFG table", name);
+      return 0;
+    }
+  if (len > (int) get_le(buf + 4, 4))
+    len = get_le(buf + 4, 4);
+
+  for (p = buf + MCFG_ENTRIES; p + MCFG_ENTRY_SIZE <= buf + len; p += MCFG_ENTRY_SIZE)
+    {
+      w = &e->windows[e->nwindows];
+      bases[e->nwindows++] = get_le(p, 8);
+      w->domain = get_le(p + 8, 2);
+      w->start_bus = p[10];
+      w->end_bus = p[11];
+    }
+  return e->nwindows;
+}
+
+static void
+ecam_init(struct pci_access *a)
+{
+  char *mcfg = pci_get_param(a, "ecam.mcfg");
+  char *path = pci_get_param(a, "ecam.path");
+  u64 bases[ECAM_MAX_WINDOWS];
+  struct ecam_data *e;
+  struct ecam_window *w;
+  struct stat st;
+  u64 offset;
+  int fd, i, buses;
+
+  e = pci_malloc(a, sizeof(*e));
+  memset(e, 0, sizeof(*e));
+  a->backend_data = e;
+
+  if (mcfg[0])
+    {
+      if (!ecam_read_mcfg(a, mcfg, e, bases))
+	{
+	  a->warning("No ECAM windows found in %s", mcfg);
+	  return;
+	}
+    }
+  else
+    {
+      e->nwindows = 1;
+      bases[0] = 0;
+      e->windows[0].end_bus = 255;
+    }
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0)
+    {
+      a->warning("Cannot open %s: %s", path, strerror(errno));
+      if (fd >= 0)
+	close(fd);
+      e->nwindows = 0;
+      return;
+    }
+
+  for (i = 0; i < e->nwindows; i++)
+    {
+      w = &e->windows[i];
+      /* MCFG bases are for bus 0 even if the window starts later */
+      offset = bases[i] + (u64) w->start_bus * ECAM_BUS_SIZE;
+      if (S_ISREG(st.st_mode))
+	{
+	  /* Mapping past the end of a file would fault on access */
+	  buses = (u64) st.st_size > offset ? (st.st_size - offset) / ECAM_BUS_SIZE : 0;
+	  if (w->start_bus + buses - 1 < w->end_bus)
+	    w->end_bus = w->start_bus + buses - 1;
+	}
+      if (w->end_bus < w->start_bus)
+	continue;
+      w->len = (size_t)(w->end_bus - w->start_bus + 1) * ECAM_BUS_SIZE;
+      w->map = mmap(NULL, w->len, PROT_READ, MAP_SHARED, fd, offset);
+      if (w->map == MAP_FAILED)
+	{
+	  a->warning("Cannot map ECAM window of %04x:%02x-%02x: %s", w->domain, w->start_bus, w->end_bus, strerror(errno));
+	  w->map = NULL;
+	  continue;
+	}
+      a->debug("...%04x:%02x-%02x at 0x%llx\n", w->domain, w->start_bus, w->end_bus, (unsigned long long) offset);
+    }
+  close(fd);
+}
+
+static void
+ecam_cleanup(struct pci_access *a)
+{
+  struct ecam_data *e = a->backend_data;
+  int i;
+
+  if (!e)
+    return;
+  for (i = 0; i < e->nwindows; i++)
+    if (e->windows[i].map)
+      munmap((void *) e->windows[i].map, e->windows[i].len);
+  pci_mfree(e);
+  a->backend_data = NULL;
+}
+
+/* Returns the config space of the function, or NULL if no window covers it */
+static volatile byte *
+ecam_config_space(struct pci_access *a, int domain, int bus, int dev, int func)
+{
+  struct ecam_data *e = a->backend_data;
+  struct ecam_window *w;
+  int i;
+
+  for (i = 0; i < e->nwindows; i++)
+    {
+      w = &e->windows[i];
+      if (w->map && w->domain == domain && bus >= w->start_bus && bus <= w->end_bus)
+	return w->map + ((bus - w->start_bus) << 20 | dev << 15 | func << 12);
+    }
+  return NULL;
+}
+
+/* Copies config space using the widest naturally aligned loads */
+static void
+ecam_copy(volatile byte *cfg, int pos, byte *buf, int len)
+{
+  u32 l;
+  u16 w;
+
+  while (len > 0)
+    {
+      if (!(pos & 3) && len >= 4)
+	{
+	  l = *(volatile u32 *)(cfg + pos);
+	  memcpy(buf, &l, 4);
+	  pos += 4, buf += 4, len -= 4;
+	}
+      else if (!(pos & 1) && len >= 2)
+	{
+	  w = *(volatile u16 *)(cfg + pos);
+	  memcpy(buf, &w, 2);
+	  pos += 2, buf += 2, len -= 2;
+	}
+      else
+	{
+	  *buf++ = cfg[pos++];
+	  len--;
+	}
+    }
+}
+
+static void
+ecam_scan(struct pci_access *a)
+{
+  struct ecam_data *e = a->backend_data;
+  struct ecam_window *w;
+  volatile byte *cfg;
+  struct pci_dev *d;
+  int i, bus, dev, func, multi;
+  u32 vd;
+
+  for (i = 0; i < e->nwindows; i++)
+    {
+      w = &e->windows[i];
+      if (!w->map)
+	continue;
+      for (bus = w->start_bus; bus <= w->end_bus; bus++)
+	for (dev = 0; dev < 32; dev++)
+	  for (func = 0, multi = 1; func < 8 && multi; func++)
+	    {
+	      cfg = ecam_config_space(a, w->domain, bus, dev, func);
+	      vd = *(volatile u32 *)cfg;
+	      if (!func)
+		multi = cfg[PCI_HEADER_TYPE] & 0x80;
+	      if (vd == 0xffffffff || vd == 0 || (vd & 0xffff) == 0xffff)
+		{
+		  if (!func)
+		    break;
+		  continue;
+		}
+	      d = pci_alloc_dev(a);
+	      d->domain = w->domain;
+	      d->bus = bus;
+	      d->dev = dev;
+	      d->func = func;
+	      d->vendor_id = le32_to_cpu(vd) & 0xffff;
+	      d->device_id = le32_to_cpu(vd) >> 16;
+	      d->known_fields = PCI_FILL_IDENT;
+	      d->hdrtype = cfg[PCI_HEADER_TYPE] & 0x7f;
+	      pci_link_dev(a, d);
+	    }
+    }
+}
+
+static int
+ecam_read(struct pci_dev *d, int pos, byte *buf, int len)
+{
+  volatile byte *cfg = ecam_config_space(d->access, d->domain, d->bus, d->dev, d->func);
+
+  if (!cfg || pos + len > 4096)
+    return 0;
+  ecam_copy(cfg, pos, buf, len);
+  return 1;
+}
+
+static int
+ecam_write(struct pci_dev *d, int UNUSED pos, byte UNUSED *buf, int UNUSED len)
+{
+  d->access->debug("ecam: writes are not supported\n");
+  return 0;
+}
+
+struct pci_methods pm_ecam = {
+  "ecam",
+  "Memory-mapped config space (read-only)",
+  ecam_config,
+  ecam_detect,
+  ecam_init,
+  ecam_cleanup,
+  ecam_scan,
+  pci_generic_fill_info,
+  ecam_read,
+  ecam_write,
+  NULL,					/* read_vpd */
+  NULL,					/* init_dev */
+  NULL,					/* cleanup_dev */
+  NULL					/* read_batch */
+};
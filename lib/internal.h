@@ -47,6 +47,7 @@ struct pci_methods {
   int (*read_vpd)(struct pci_dev *, int pos, byte *buf, int len);
   void (*init_dev)(struct pci_dev *);
   void (*cleanup_dev)(struct pci_dev *);
+  void (*read_batch)(struct pci_access *, struct pci_read_req *reqs, int n);
 };
 
 /* generic.c */
@@ -83,6 +84,13 @@ struct pci_property {
 
 char *pci_set_property(struct pci_dev *d, u32 key, char *value);
 
+/* uring.c */
+struct pci_uring;
+struct pci_uring *pci_uring_open(struct pci_access *a, unsigned int entries);
+void pci_uring_close(struct pci_uring *r);
+unsigned int pci_uring_entries(struct pci_uring *r);
+int pci_uring_read(struct pci_uring *r, int *fds, struct pci_read_req *reqs, int n);
+
 /* params.c */
 void pci_define_param(struct pci_access *acc, char *param, char *val, char *help);
 int pci_set_param_internal(struct pci_access *acc, char *param, char *val, int copy);
@@ -94,4 +102,5 @@ void pci_free_caps(struct pci_dev *);
 
 extern struct pci_methods pm_intel_conf1, pm_intel_conf2, pm_linux_proc,
 	pm_fbsd_device, pm_aix_device, pm_nbsd_libpci, pm_obsd_device,
-	pm_dump, pm_linux_sysfs, pm_darwin, pm_sylixos_device, pm_hurd;
+	pm_dump, pm_linux_sysfs, pm_darwin, pm_sylixos_device, pm_hurd,
+	pm_ecam;
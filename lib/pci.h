@@ -43,9 +43,19 @@ enum pci_access_type {
   PCI_ACCESS_DARWIN,			/* Darwin */
   PCI_ACCESS_SYLIXOS_DEVICE,		/* SylixOS pci */
   PCI_ACCESS_HURD,			/* GNU/Hurd */
+  PCI_ACCESS_ECAM,			/* Memory-mapped config space (read-only) */
   PCI_ACCESS_MAX
 };
 
+/* Entry of a scan allowlist, terminated by vendor_id 0 */
+struct pci_id_match {
+  u16 vendor_id;
+  u16 device_id;			/* PCI_ID_ANY matches all */
+  u16 device_class;			/* PCI_ID_ANY matches all */
+};
+
+#define PCI_ID_ANY 0xffff
+
 struct pci_access {
   /* Options you can change: */
   unsigned int method;			/* Access method */
@@ -61,6 +71,15 @@ struct pci_access {
 
   int debugging;			/* Turn on debugging messages */
 
+  struct pci_id_match *scan_ids;	/* sys: scan only these functions and the bridges above them, NULL for all */
+
+  /* Statistics (read only): */
+  struct pci_fd_stats {
+    unsigned long hits;			/* sys: config/vpd accesses served by an open fd */
+    unsigned long misses;		/* sys: accesses that had to open the file */
+    unsigned long evictions;		/* sys: fds closed to make room */
+  } fd_stats;
+
   /* Functions you can override: */
   void (*error)(char *msg, ...) PCI_PRINTF(1,2);	/* Write error message and quit */
   void (*warning)(char *msg, ...) PCI_PRINTF(1,2);	/* Write a warning message */
@@ -82,6 +101,8 @@ struct pci_access {
   int fd_pos;				/* proc/sys: current position */
   int fd_vpd;				/* sys: fd for VPD */
   struct pci_dev *cached_dev;		/* proc/sys: device the fds are for */
+  struct sysfs_fd_cache *fd_cache;	/* sys: LRU of open config/vpd fds */
+  void *backend_data;			/* Private data of the access method */
 };
 
 /* Initialize PCI access */
@@ -152,6 +173,7 @@ struct pci_dev {
   void *aux;				/* Auxiliary data for use by the back-end */
   struct pci_property *properties;	/* A linked list of extra properties */
   struct pci_cap *last_cap;		/* Last capability in the list */
+  struct pci_cap_table *cap_table;	/* First capability of each id, see caps.c */
 };
 
 #define PCI_ADDR_IO_MASK (~(pciaddr_t) 0x3)
@@ -168,6 +190,16 @@ int pci_write_word(struct pci_dev *, int pos, u16 data) PCI_ABI;
 int pci_write_long(struct pci_dev *, int pos, u32 data) PCI_ABI;
 int pci_write_block(struct pci_dev *, int pos, u8 *buf, int len) PCI_ABI;
 
+/* One read of a batch; result is set to 1 on success, 0 on failure */
+struct pci_read_req {
+  struct pci_dev *dev;
+  int pos, len;
+  u8 *buf;
+  int result;
+};
+
+int pci_read_batch(struct pci_access *, struct pci_read_req *reqs, int n) PCI_ABI;
+
 /*
  * Most device properties take some effort to obtain, so libpci does not
  * initialize them during default bus scan. Instead, you have to call
@@ -208,5 +208,6 @@ struct pci_methods pm_linux_proc = {
   proc_write,
   NULL,					/* read_vpd */
   NULL,					/* init_dev */
-  proc_cleanup_dev
+  proc_cleanup_dev,
+  NULL					/* read_batch */
 };
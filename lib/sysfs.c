@@ -22,10 +22,40 @@
 #include "internal.h"
 #include "pread.h"
 
+/*
+ *  Open config and vpd files are kept in a small LRU per pci_access, so
+ *  that accesses alternating between a few devices do not reopen them.
+ *  Read-only and read-write handles of a device are separate entries.
+ */
+
+enum sysfs_fd_kind {
+  SYSFS_FD_RO,
+  SYSFS_FD_RW,
+  SYSFS_FD_VPD,
+};
+
+struct sysfs_fd {
+  struct pci_dev *dev;			/* NULL if the entry is free */
+  enum sysfs_fd_kind kind;
+  int fd;
+  unsigned long used;			/* LRU clock at the last access */
+};
+
+struct sysfs_fd_cache {
+  int size;
+  unsigned long clock;
+  struct pci_uring *ring;		/* Opened on the first batch read */
+  int ring_failed;
+  int *batch_fds;
+  struct sysfs_fd fds[];
+};
+
 static void
 sysfs_config(struct pci_access *a)
 {
   pci_define_param(a, "sysfs.path", PCI_PATH_SYS_BUS_PCI, "Path to the sysfs device tree");
+  pci_define_param(a, "sysfs.fds", "8", "Number of config/vpd files kept open");
+  pci_define_param(a, "sysfs.io_uring", "1", "Submit batched reads through io_uring");
 }
 
 static inline char *
@@ -49,30 +79,51 @@ sysfs_detect(struct pci_access *a)
 static void
 sysfs_init(struct pci_access *a)
 {
+  int size = atoi(pci_get_param(a, "sysfs.fds"));
+
+  if (size < 1)
+    size = 1;
+  a->fd_cache = pci_malloc(a, sizeof(struct sysfs_fd_cache) + size * sizeof(struct sysfs_fd));
+  memset(a->fd_cache, 0, sizeof(struct sysfs_fd_cache) + size * sizeof(struct sysfs_fd));
+  a->fd_cache->size = size;
+  a->fd_cache->batch_fds = pci_malloc(a, size * sizeof(int));
   a->fd = -1;
-  a->fd_vpd = -1;
 }
 
 static void
-sysfs_flush_cache(struct pci_access *a)
+sysfs_close_fd(struct sysfs_fd *f)
 {
-  if (a->fd >= 0)
-    {
-      close(a->fd);
-      a->fd = -1;
-    }
-  if (a->fd_vpd >= 0)
-    {
-      close(a->fd_vpd);
-      a->fd_vpd = -1;
-    }
-  a->cached_dev = NULL;
+  close(f->fd);
+  f->dev = NULL;
+  f->fd = -1;
+}
+
+/* Closes the fds of device d, or all of them if d is NULL */
+static void
+sysfs_flush_cache(struct pci_access *a, struct pci_dev *d)
+{
+  struct sysfs_fd_cache *c = a->fd_cache;
+  int i;
+
+  if (!c)
+    return;
+  for (i = 0; i < c->size; i++)
+    if (c->fds[i].dev && (!d || c->fds[i].dev == d))
+      sysfs_close_fd(&c->fds[i]);
+  a->fd = -1;
 }
 
 static void
 sysfs_cleanup(struct pci_access *a)
 {
-  sysfs_flush_cache(a);
+  sysfs_flush_cache(a, NULL);
+  if (a->fd_cache)
+    {
+      pci_uring_close(a->fd_cache->ring);
+      pci_mfree(a->fd_cache->batch_fds);
+    }
+  pci_mfree(a->fd_cache);
+  a->fd_cache = NULL;
 }
 
 #define OBJNAMELEN 1024
@@ -189,11 +240,158 @@ sysfs_get_resources(struct pci_dev *d)
   fclose(file);
 }
 
+static int
+sysfs_read_id(int dirfd, char *name, char *object, unsigned int *val)
+{
+  char path[OBJNAMELEN], buf[32];
+  int fd, n;
+
+  snprintf(path, sizeof(path), "%s/%s", name, object);
+  fd = openat(dirfd, path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return 0;
+  buf[n] = 0;
+  *val = strtoul(buf, NULL, 0);
+  return 1;
+}
+
+/*
+ *  Reads vendor, device and class of a function with one small read of
+ *  its modalias, or from the separate attributes if there is none.
+ */
+static int
+sysfs_read_ids(int dirfd, char *name, struct pci_dev *d)
+{
+  char path[OBJNAMELEN], buf[64];
+  unsigned int vendor, device, base, sub;
+  int fd, n;
+
+  snprintf(path, sizeof(path), "%s/modalias", name);
+  fd = openat(dirfd, path, O_RDONLY);
+  if (fd >= 0)
+    {
+      n = read(fd, buf, sizeof(buf) - 1);
+      close(fd);
+      if (n <= 0)
+	return 0;
+      buf[n] = 0;
+      if (sscanf(buf, "pci:v%8xd%8xsv%*8xsd%*8xbc%2xsc%2x", &vendor, &device, &base, &sub) != 4)
+	return 0;
+      base = base << 8 | sub;
+    }
+  else if (!sysfs_read_id(dirfd, name, "vendor", &vendor) ||
+	   !sysfs_read_id(dirfd, name, "device", &device) ||
+	   !sysfs_read_id(dirfd, name, "class", &base))
+    return 0;
+  else
+    base >>= 8;
+
+  d->vendor_id = vendor;
+  d->device_id = device;
+  d->device_class = base;
+  d->known_fields |= PCI_FILL_IDENT | PCI_FILL_CLASS;
+  return 1;
+}
+
+/*
+ *  With an allowlist in a->scan_ids, decide whether to keep a function
+ *  before allocating anything for it. Foreign functions cost one small
+ *  read. The IDs of kept functions are filled in.
+ */
+static int
+sysfs_scan_wanted(struct pci_access *a, int dirfd, char *name, struct pci_dev *d)
+{
+  struct pci_id_match *m;
+
+  if (!sysfs_read_ids(dirfd, name, d))
+    return 0;
+  for (m = a->scan_ids; m->vendor_id; m++)
+    if (m->vendor_id == d->vendor_id &&
+	(m->device_id == PCI_ID_ANY || m->device_id == d->device_id) &&
+	(m->device_class == PCI_ID_ANY || m->device_class == d->device_class))
+      return 1;
+  return 0;
+}
+
+static int
+sysfs_parse_slot(char *name, unsigned int *dom, unsigned int *bus, unsigned int *dev, unsigned int *func)
+{
+  int n = 0;
+
+  return sscanf(name, "%x:%x:%x.%x%n", dom, bus, dev, func, &n) == 4 && !name[n];
+}
+
+static struct pci_dev *
+sysfs_scan_add(struct pci_access *a, unsigned int dom, unsigned int bus, unsigned int dev, unsigned int func,
+	       struct pci_dev *ids)
+{
+  struct pci_dev *d = pci_alloc_dev(a);
+
+  d->vendor_id = ids->vendor_id;
+  d->device_id = ids->device_id;
+  d->device_class = ids->device_class;
+  d->known_fields = ids->known_fields;
+
+  /* Ensure kernel provided domain that fits in a signed integer */
+  if (dom > 0x7fffffff)
+    a->error("sysfs_scan: Invalid domain %x", dom);
+
+  d->domain = dom;
+  d->bus = bus;
+  d->dev = dev;
+  d->func = func;
+  pci_link_dev(a, d);
+  return d;
+}
+
+static struct pci_dev *
+sysfs_scan_find(struct pci_access *a, unsigned int dom, unsigned int bus, unsigned int dev, unsigned int func)
+{
+  struct pci_dev *d;
+
+  for (d = a->devices; d; d = d->next)
+    if ((unsigned) d->domain == dom && d->bus == bus && d->dev == dev && d->func == func)
+      return d;
+  return NULL;
+}
+
+/*
+ *  Adds the bridges above a kept function, which its entry in devices/
+ *  links to as the directories enclosing its own.
+ */
+static void
+sysfs_scan_ancestors(struct pci_access *a, int dirfd, char *name)
+{
+  char target[OBJNAMELEN], *p, *next;
+  unsigned int dom, bus, dev, func;
+  struct pci_dev ids;
+  int n;
+
+  n = readlinkat(dirfd, name, target, sizeof(target) - 1);
+  if (n <= 0)
+    return;
+  target[n] = 0;
+  for (p = target; (next = strchr(p, '/')) != NULL; p = next + 1)
+    {
+      *next = 0;
+      if (!sysfs_parse_slot(p, &dom, &bus, &dev, &func) || sysfs_scan_find(a, dom, bus, dev, func))
+	continue;
+      memset(&ids, 0, sizeof(ids));
+      if (sysfs_read_ids(dirfd, p, &ids))
+	sysfs_scan_add(a, dom, bus, dev, func, &ids);
+    }
+}
+
 static void sysfs_scan(struct pci_access *a)
 {
   char dirname[1024];
   DIR *dir;
   struct dirent *entry;
+  struct pci_dev ids;
   int n;
 
   n = snprintf(dirname, sizeof(dirname), "%s/devices", sysfs_name(a));
@@ -204,26 +402,25 @@ static void sysfs_scan(struct pci_access *a)
     a->error("Cannot open %s", dirname);
   while ((entry = readdir(dir)))
     {
-      struct pci_dev *d;
       unsigned int dom, bus, dev, func;
 
       /* ".", ".." or a special non-device perhaps */
       if (entry->d_name[0] == '.')
 	continue;
 
-      d = pci_alloc_dev(a);
       if (sscanf(entry->d_name, "%x:%x:%x.%d", &dom, &bus, &dev, &func) < 4)
 	a->error("sysfs_scan: Couldn't parse entry name %s", entry->d_name);
-
-      /* Ensure kernel provided domain that fits in a signed integer */
-      if (dom > 0x7fffffff)
-	a->error("sysfs_scan: Invalid domain %x", dom);
-
-      d->domain = dom;
-      d->bus = bus;
-      d->dev = dev;
-      d->func = func;
-      pci_link_dev(a, d);
+      memset(&ids, 0, sizeof(ids));
+      if (a->scan_ids)
+	{
+	  /* Keep matching functions and, for the topology, the bridges above them */
+	  if (!sysfs_scan_wanted(a, dirfd(dir), entry->d_name, &ids))
+	    continue;
+	  sysfs_scan_ancestors(a, dirfd(dir), entry->d_name);
+	  if (sysfs_scan_find(a, dom, bus, dev, func))
+	    continue;	/* Already added as the ancestor of another one */
+	}
+      sysfs_scan_add(a, dom, bus, dev, func, &ids);
     }
   closedir(dir);
 }
@@ -391,35 +588,67 @@ static int
 sysfs_setup(struct pci_dev *d, int intent)
 {
   struct pci_access *a = d->access;
+  struct sysfs_fd_cache *c = a->fd_cache;
+  struct sysfs_fd *f, *victim = NULL;
+  enum sysfs_fd_kind kind;
   char namebuf[OBJNAMELEN];
-
-  if (a->cached_dev != d || (intent == SETUP_WRITE_CONFIG && !a->fd_rw))
-    {
-      sysfs_flush_cache(a);
-      a->cached_dev = d;
-    }
+  int i, fd;
 
   if (intent == SETUP_READ_VPD)
+    kind = SYSFS_FD_VPD;
+  else if (intent == SETUP_WRITE_CONFIG || a->writeable)
+    kind = SYSFS_FD_RW;
+  else
+    kind = SYSFS_FD_RO;
+
+  for (i = 0; i < c->size; i++)
     {
-      if (a->fd_vpd < 0)
+      f = &c->fds[i];
+      if (f->dev == d && (f->kind == kind || (kind == SYSFS_FD_RO && f->kind == SYSFS_FD_RW)))
 	{
-	  sysfs_obj_name(d, "vpd", namebuf);
-	  a->fd_vpd = open(namebuf, O_RDONLY);
-	  /* No warning on error; vpd may be absent or accessible only to root */
+	  a->fd_stats.hits++;
+	  f->used = ++c->clock;
+	  fd = f->fd;
+	  goto found;
 	}
-      return a->fd_vpd;
+      if (!victim || !f->dev || (victim->dev && f->used < victim->used))
+	victim = f;
     }
 
-  if (a->fd < 0)
+  a->fd_stats.misses++;
+  if (kind == SYSFS_FD_VPD)
+    {
+      sysfs_obj_name(d, "vpd", namebuf);
+      fd = open(namebuf, O_RDONLY);
+      /* No warning on error; vpd may be absent or accessible only to root */
+    }
+  else
     {
       sysfs_obj_name(d, "config", namebuf);
-      a->fd_rw = a->writeable || intent == SETUP_WRITE_CONFIG;
-      a->fd = open(namebuf, a->fd_rw ? O_RDWR : O_RDONLY);
-      if (a->fd < 0)
+      fd = open(namebuf, kind == SYSFS_FD_RW ? O_RDWR : O_RDONLY);
+      if (fd < 0)
 	a->warning("Cannot open %s", namebuf);
-      a->fd_pos = 0;
     }
-  return a->fd;
+  if (fd < 0)
+    return fd;
+  if (victim->dev)
+    {
+      a->fd_stats.evictions++;
+      sysfs_close_fd(victim);
+    }
+  victim->dev = d;
+  victim->kind = kind;
+  victim->fd = fd;
+  victim->used = ++c->clock;
+
+found:
+  if (kind != SYSFS_FD_VPD && fd != a->fd)
+    {
+      /* Position tracking of the lseek fallback in pread.h */
+      a->fd = fd;
+      a->fd_pos = -1;
+    }
+  return fd;
 }
 
 static int sysfs_read(struct pci_dev *d, int pos, byte *buf, int len)
@@ -470,6 +699,11 @@ static int sysfs_read_vpd(struct pci_dev *d, int pos, byte *buf, int len)
   return 0;
 }
 
+/* Same problem here; the generic code falls back to single reads. */
+static void sysfs_read_batch(struct pci_access *a, struct pci_read_req *reqs, int n)
+{
+}
+
 #else /* !PCI_HAVE_DO_READ */
 
 static int sysfs_read_vpd(struct pci_dev *d, int pos, byte *buf, int len)
@@ -490,14 +724,77 @@ static int sysfs_read_vpd(struct pci_dev *d, int pos, byte *buf, int len)
   return 1;
 }
 
+/*
+ *  Reads the pending requests in chunks no larger than the fd cache, so
+ *  that setting up the fds of one chunk never evicts one it still needs.
+ *  Each chunk goes to the kernel in one io_uring_enter(); if io_uring
+ *  is disabled or unavailable, or failed on this chunk, the requests are
+ *  read one by one.
+ */
+static void sysfs_read_batch(struct pci_access *a, struct pci_read_req *reqs, int n)
+{
+  struct sysfs_fd_cache *c = a->fd_cache;
+  int *fds = c->batch_fds;
+  int start, cnt, i, chunk = c->size, res, err;
+  struct pci_read_req *r;
+
+  if (!c->ring && !c->ring_failed)
+    {
+      if (atoi(pci_get_param(a, "sysfs.io_uring")))
+	c->ring = pci_uring_open(a, c->size);
+      c->ring_failed = !c->ring;
+    }
+  if (c->ring && (int) pci_uring_entries(c->ring) < chunk)
+    chunk = pci_uring_entries(c->ring);
+
+  for (start = 0; start < n; start += cnt)
+    {
+      cnt = n - start;
+      if (cnt > chunk)
+	cnt = chunk;
+      for (i = 0; i < cnt; i++)
+	{
+	  r = &reqs[start + i];
+	  fds[i] = -1;
+	  if (r->result >= 0)
+	    continue;
+	  fds[i] = sysfs_setup(r->dev, SETUP_READ_CONFIG);
+	  if (fds[i] < 0)
+	    r->result = 0;
+	}
+
+      if (c->ring)
+	{
+	  if ((err = pci_uring_read(c->ring, fds, reqs + start, cnt)) == 0)
+	    continue;
+	  /* Only a ring the kernel cannot use is given up; a busy one gets the next chunk */
+	  if (err == -ENOSYS || err == -EINVAL || err == -EOPNOTSUPP || err == -EPERM || err == -EBADF)
+	    {
+	      a->debug("io_uring read failed (%s), falling back to pread", strerror(-err));
+	      pci_uring_close(c->ring);
+	      c->ring = NULL;
+	      c->ring_failed = 1;
+	    }
+	  else
+	    a->debug("io_uring read failed (%s), reading this chunk with pread", strerror(-err));
+	}
+
+      for (i = 0; i < cnt; i++)
+	{
+	  r = &reqs[start + i];
+	  if (fds[i] < 0 || r->result >= 0)
+	    continue;
+	  res = pread(fds[i], r->buf, r->len, r->pos);
+	  r->result = (res == r->len);
+	}
+    }
+}
+
 #endif /* PCI_HAVE_DO_READ */
 
 static void sysfs_cleanup_dev(struct pci_dev *d)
 {
-  struct pci_access *a = d->access;
-
-  if (a->cached_dev == d)
-    sysfs_flush_cache(a);
+  sysfs_flush_cache(d->access, d);
 }
 
 struct pci_methods pm_linux_sysfs = {
@@ -513,5 +810,6 @@ struct pci_methods pm_linux_sysfs = {
   sysfs_write,
   sysfs_read_vpd,
   NULL,					/* init_dev */
-  sysfs_cleanup_dev
+  sysfs_cleanup_dev,
+  sysfs_read_batch
 };
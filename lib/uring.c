@@ -0,0 +1,221 @@
+/*
+ *	The PCI Library -- Batched Reads via io_uring
+ *
+ *	Copyright (c) 2023 Adnacom Inc
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/*
+ *  Talks to the kernel with raw system calls, so there is no dependency
+ *  on liburing. Callers fall back to plain reads whenever this fails.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "internal.h"
+
+/* How often a busy ring (EAGAIN, EBUSY) is entered again before giving up */
+#define PCI_URING_TRIES 3
+
+struct pci_uring {
+  int fd;
+  unsigned int entries;
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_len, cq_len, sqes_len;
+  struct iovec *iov;
+};
+
+static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/* Whether a failed io_uring_enter() is worth another go; @tries counts the busy ones */
+static int
+uring_retry(int *tries)
+{
+  if (errno == EINTR)
+    return 1;
+  return (errno == EAGAIN || errno == EBUSY) && ++*tries < PCI_URING_TRIES;
+}
+
+struct pci_uring *
+pci_uring_open(struct pci_access *a, unsigned int entries)
+{
+  struct io_uring_params p;
+  struct pci_uring *r;
+
+  memset(&p, 0, sizeof(p));
+  r = pci_malloc(a, sizeof(*r));
+  memset(r, 0, sizeof(*r));
+  r->sq_ring = r->cq_ring = r->sqes = MAP_FAILED;
+  r->fd = sys_io_uring_setup(entries, &p);
+  if (r->fd < 0)
+    {
+      a->debug("io_uring unavailable: %s", strerror(errno));
+      pci_mfree(r);
+      return NULL;
+    }
+  r->entries = p.sq_entries;
+  r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (r->cq_len > r->sq_len)
+	r->sq_len = r->cq_len;
+      r->cq_len = 0;
+    }
+  r->sq_ring = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED)
+    goto fail;
+  if (r->cq_len)
+    {
+      r->cq_ring = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+      if (r->cq_ring == MAP_FAILED)
+	goto fail;
+    }
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+    goto fail;
+
+  r->sq_head = (unsigned int *)((char *)r->sq_ring + p.sq_off.head);
+  r->sq_tail = (unsigned int *)((char *)r->sq_ring + p.sq_off.tail);
+  r->sq_mask = (unsigned int *)((char *)r->sq_ring + p.sq_off.ring_mask);
+  r->sq_array = (unsigned int *)((char *)r->sq_ring + p.sq_off.array);
+  {
+    char *cq = r->cq_len ? r->cq_ring : r->sq_ring;
+    r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  }
+  r->iov = pci_malloc(a, r->entries * sizeof(struct iovec));
+  return r;
+
+fail:
+  a->debug("io_uring mmap failed: %s", strerror(errno));
+  pci_uring_close(r);
+  return NULL;
+}
+
+void
+pci_uring_close(struct pci_uring *r)
+{
+  if (!r)
+    return;
+  if (r->sqes != MAP_FAILED)
+    munmap(r->sqes, r->sqes_len);
+  if (r->cq_ring != MAP_FAILED && r->cq_len)
+    munmap(r->cq_ring, r->cq_len);
+  if (r->sq_ring != MAP_FAILED)
+    munmap(r->sq_ring, r->sq_len);
+  if (r->fd >= 0)
+    close(r->fd);
+  pci_mfree(r->iov);
+  pci_mfree(r);
+}
+
+unsigned int
+pci_uring_entries(struct pci_uring *r)
+{
+  return r->entries;
+}
+
+/*
+ *  Reads reqs[i] from fds[i] for all i < n (n <= pci_uring_entries())
+ *  with a single io_uring_enter() and waits for all of them. Entries with
+ *  a negative fd are skipped. Interrupted and busy calls are retried.
+ *  Returns 0, or -errno if the ring failed and the caller should read the
+ *  requests it still has no result for itself; -EAGAIN and -EBUSY mean
+ *  the ring is still usable for the next batch.
+ */
+int
+pci_uring_read(struct pci_uring *r, int *fds, struct pci_read_req *reqs, int n)
+{
+  unsigned int tail, head, mask, idx;
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  int i, queued = 0, submitted = 0, done = 0, res, err = 0, tries = 0;
+
+  tail = *r->sq_tail;
+  mask = *r->sq_mask;
+  for (i = 0; i < n; i++)
+    {
+      if (fds[i] < 0)
+	continue;
+      r->iov[i].iov_base = reqs[i].buf;
+      r->iov[i].iov_len = reqs[i].len;
+      idx = tail & mask;
+      sqe = &r->sqes[idx];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_READV;
+      sqe->fd = fds[i];
+      sqe->addr = (unsigned long) &r->iov[i];
+      sqe->len = 1;
+      sqe->off = reqs[i].pos;
+      sqe->user_data = i;
+      r->sq_array[idx] = idx;
+      tail++;
+      queued++;
+    }
+  if (!queued)
+    return 0;
+  __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+  /* The kernel may take fewer entries than offered, so offer the rest again */
+  while (submitted < queued)
+    {
+      res = sys_io_uring_enter(r->fd, queued - submitted, queued - submitted, IORING_ENTER_GETEVENTS);
+      if (res < 0 && uring_retry(&tries))
+	continue;
+      if (res <= 0)
+	{
+	  /* Nothing taken: give back what is left */
+	  err = res < 0 ? -errno : -EAGAIN;
+	  __atomic_store_n(r->sq_tail, tail - (queued - submitted), __ATOMIC_RELEASE);
+	  break;
+	}
+      submitted += res;
+    }
+
+  /* Whatever was submitted owns its buffer until it completes */
+  while (done < submitted)
+    {
+      head = *r->cq_head;
+      while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+	{
+	  cqe = &r->cqes[head & *r->cq_mask];
+	  i = cqe->user_data;
+	  reqs[i].result = (cqe->res == reqs[i].len);
+	  head++;
+	  done++;
+	}
+      __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+      tries = 0;
+      if (done < submitted &&
+	  sys_io_uring_enter(r->fd, 0, submitted - done, IORING_ENTER_GETEVENTS) < 0 &&
+	  !uring_retry(&tries))
+	return -errno;
+    }
+  return err;
+}
@@ -0,0 +1,741 @@
+/** @file: adnacom-sim.c
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * Simulated adapters: builds a fake sysfs tree with Adnacom switches,
+ * the devices behind their ports and background functions, then plays
+ * the kernel's and the hardware's part for `adnacom-hp --sysfs=DIR`
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/*
+ * The tree has the layout the daemon and libpci expect under /sys:
+ * devices/pci0000:00/... holds one directory per function, nested below
+ * its bridge, and bus/pci/devices/ links to all of them. Every function
+ * has vendor, device, class, irq, resource, config and remove files;
+ * bridges also have rescan, and each upstream switch port a resource0
+ * which mirrors every switch port's config space at port * 0x1000, as the
+ * real BAR0 does.
+ *
+ * While running, the simulator
+ * - answers writes to remove and rescan files like the kernel does:
+ *   removing a function drops it and everything behind it, and a rescan
+ *   brings back whatever is physically there (a device behind a port
+ *   whose link is down is not);
+ * - emulates SLTSTA's write-1-to-clear latches, by clearing them when a
+ *   port's config file is written (the daemon writes nothing else);
+ * - plays a script of link events.
+ *
+ * Config files are updated through shared mappings, which readers see
+ * immediately and which, unlike write(), raise no inotify events, so any
+ * event on a watched file comes from someone else.
+ *
+ * Script lines are "<ms> <verb> <adapter> <port> [gen width]", at times
+ * relative to the start (or to the previous pass, with -l):
+ *   down     link goes down and the device behind the port is unplugged
+ *   up       link comes up (optionally at a lower speed and width) and
+ *            the device is there again, to be found by the next rescan
+ *   bounce   link goes down and up between two samples
+ *   add/del  the kernel enumerates/removes the device behind the port
+ *            on its own, as pciehp would
+ * Blank lines and lines starting with # are ignored.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "header.h"
+
+#define SIM_CONF_SIZE   4096
+#define SIM_BAR_SIZE    0x20000     /* PEX8608 BAR0 */
+#define SIM_PORT_STRIDE 0x1000      /* Port n's registers are at n * this in BAR0 */
+#define SIM_BAR_BASE    0xf0000000ULL
+#define SIM_EXP_CAP     0x68        /* Where the PCIe capability goes */
+#define SIM_MAX_ADAPTERS 16
+#define SIM_MAX_PORTS   7           /* Downstream ports of a PEX8608 */
+#define SIM_BG_FIRST_DEV 0x11       /* Background bridges sit on bus 0 from here */
+#define SIM_SLTSTA_LATCHES (PCI_EXP_SLTSTA_PRSD | PCI_EXP_SLTSTA_LLCHG)
+
+enum sim_role {
+  SIM_ROOT_PORT,
+  SIM_UPSTREAM,
+  SIM_DOWNSTREAM,
+  SIM_HUB,
+  SIM_BG_BRIDGE,
+  SIM_BG,
+};
+
+struct sim_fn {
+  enum sim_role role;
+  int parent;               /* Index of the bridge above, -1 on bus 0 */
+  int adapter, port;        /* For switch ports and hubs */
+  unsigned int bus, dev, func;
+  char name[16];            /* 0000:bb:dd.f */
+  char dir[PATH_MAX];       /* Its directory under devices/ */
+  uint8_t conf[SIM_CONF_SIZE]; /* Config space, kept while it is out of sysfs */
+  bool present;             /* Physically there, a rescan would find it */
+  bool in_sysfs;
+  uint8_t *map;             /* Its config file while in sysfs */
+  int conf_wd, remove_wd, rescan_wd;
+};
+
+struct sim_event {
+  unsigned long ms;
+  char verb[8];
+  int adapter, port;
+  int speed, width;         /* For up, 0 to restore LNKCAP's */
+};
+
+static struct sim_fn *fns;
+static int nfns;
+static char root[PATH_MAX - 128];
+static int inotify_fd = -1;
+static int bus_rescan_wd = -1;
+static uint8_t *bars[SIM_MAX_ADAPTERS]; /* resource0 of each upstream port, mapped */
+static uint64_t start_ns;
+static volatile sig_atomic_t stop;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void note(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void note(const char *fmt, ...)
+{
+  uint64_t t = now_ns() - start_ns;
+  va_list args;
+
+  printf("[%6llu.%03llu] ", (unsigned long long)(t / 1000000),
+         (unsigned long long)(t / 1000 % 1000));
+  va_start(args, fmt);
+  vprintf(fmt, args);
+  va_end(args);
+  putchar('\n');
+  fflush(stdout);
+}
+
+static void die(const char *fmt, ...) __attribute__((format(printf, 1, 2), noreturn));
+static void die(const char *fmt, ...)
+{
+  va_list args;
+
+  fputs("adnacom-sim: ", stderr);
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  fputc('\n', stderr);
+  exit(1);
+}
+
+static void put16(uint8_t *c, int pos, uint16_t v)
+{
+  c[pos] = v;
+  c[pos + 1] = v >> 8;
+}
+
+static void put32(uint8_t *c, int pos, uint32_t v)
+{
+  put16(c, pos, v);
+  put16(c, pos + 2, v >> 16);
+}
+
+static uint16_t get16(const uint8_t *c, int pos)
+{
+  return c[pos] | c[pos + 1] << 8;
+}
+
+static uint32_t get32(const uint8_t *c, int pos)
+{
+  return get16(c, pos) | (uint32_t)get16(c, pos + 2) << 16;
+}
+
+/*! @brief Adds a function, with a config space that has just what the daemon looks at */
+static int fn_add(enum sim_role role, int parent, unsigned int bus, unsigned int dev, unsigned int func,
+                  uint16_t vendor, uint16_t device, uint32_t class, int devtype)
+{
+  struct sim_fn *f;
+  uint8_t *c;
+
+  if (!(nfns & (nfns - 1)) && (fns = realloc(fns, (nfns ? 2 * nfns : 64) * sizeof(*fns))) == NULL)
+    die("Out of memory");
+  f = &fns[nfns];
+  memset(f, 0, sizeof(*f));
+  f->role = role;
+  f->parent = parent;
+  f->adapter = f->port = -1;
+  f->bus = bus;
+  f->dev = dev;
+  f->func = func;
+  f->present = true;
+  f->conf_wd = f->remove_wd = f->rescan_wd = -1;
+  snprintf(f->name, sizeof(f->name), "0000:%02x:%02x.%d", bus, dev, func);
+
+  c = f->conf;
+  put16(c, PCI_VENDOR_ID, vendor);
+  put16(c, PCI_DEVICE_ID, device);
+  put16(c, PCI_COMMAND, PCI_COMMAND_IO | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+  put16(c, PCI_STATUS, PCI_STATUS_CAP_LIST);
+  put32(c, PCI_CLASS_REVISION, class << 8);
+  c[PCI_HEADER_TYPE] = (class >> 8) == PCI_CLASS_BRIDGE_PCI ? PCI_HEADER_TYPE_BRIDGE : PCI_HEADER_TYPE_NORMAL;
+  if (role == SIM_BG_BRIDGE || role == SIM_BG)
+    c[PCI_HEADER_TYPE] |= 0x80;
+  c[PCI_CAPABILITY_LIST] = SIM_EXP_CAP;
+  c[SIM_EXP_CAP + PCI_CAP_LIST_ID] = PCI_CAP_ID_EXP;
+  put16(c, SIM_EXP_CAP + PCI_EXP_FLAGS, 2 | devtype << 4);
+  /* Gen3 x4, with Data Link Layer Link Active reporting */
+  put32(c, SIM_EXP_CAP + PCI_EXP_LNKCAP, 3 | 4 << 4 | PCI_EXP_LNKCAP_DLLA);
+  put16(c, SIM_EXP_CAP + PCI_EXP_LNKSTA, 3 | 4 << 4 | PCI_EXP_LNKSTA_DL_ACT);
+  return nfns++;
+}
+
+static void fn_bridge(int i, unsigned int secondary, unsigned int subordinate)
+{
+  fns[i].conf[PCI_PRIMARY_BUS] = fns[i].bus;
+  fns[i].conf[PCI_SECONDARY_BUS] = secondary;
+  fns[i].conf[PCI_SUBORDINATE_BUS] = subordinate;
+}
+
+/*! @brief Lays out @adapters switches with @ports ports each, then @bg background functions */
+static void topology_build(int adapters, int ports, int bg)
+{
+  unsigned int bus = 1, us_bus, ds_bus;
+  int a, p, rp, us, ds, hub, b, br, n;
+
+  for (a = 0; a < adapters; a++) {
+    us_bus = bus++;
+    ds_bus = bus++;
+    rp = fn_add(SIM_ROOT_PORT, -1, 0, 1 + a, 0, 0x8086, 0x1901, PCI_CLASS_BRIDGE_PCI << 8, PCI_EXP_TYPE_ROOT_PORT);
+    us = fn_add(SIM_UPSTREAM, rp, us_bus, 0, 0, 0x10b5, 0x8608, PCI_CLASS_BRIDGE_PCI << 8, PCI_EXP_TYPE_UPSTREAM);
+    fns[us].adapter = a;
+    fns[us].port = 0;
+    put32(fns[us].conf, PCI_BASE_ADDRESS_0, SIM_BAR_BASE + a * SIM_BAR_SIZE);
+    for (p = 0; p < ports; p++) {
+      ds = fn_add(SIM_DOWNSTREAM, us, ds_bus, 1 + p, 0, 0x10b5, 0x8608, PCI_CLASS_BRIDGE_PCI << 8,
+                  PCI_EXP_TYPE_DOWNSTREAM);
+      fns[ds].adapter = a;
+      fns[ds].port = 1 + p;
+      put16(fns[ds].conf, SIM_EXP_CAP + PCI_EXP_FLAGS, 2 | PCI_EXP_TYPE_DOWNSTREAM << 4 | PCI_EXP_FLAGS_SLOT);
+      put32(fns[ds].conf, SIM_EXP_CAP + PCI_EXP_LNKCAP,
+            get32(fns[ds].conf, SIM_EXP_CAP + PCI_EXP_LNKCAP) | (uint32_t)(1 + p) << 24);
+      fn_bridge(ds, bus, bus);
+      hub = fn_add(SIM_HUB, ds, bus++, 0, 0, 0x104c, 0x8241, PCI_CLASS_SERIAL_USB << 8 | 0x30,
+                   PCI_EXP_TYPE_ENDPOINT);
+      fns[hub].adapter = a;
+      fns[hub].port = 1 + p;
+    }
+    fn_bridge(rp, us_bus, bus - 1);
+    fn_bridge(us, ds_bus, bus - 1);
+  }
+
+  /* Background functions fill buses of 256 behind bridges of their own */
+  for (b = 0, n = 0; n < bg; b++) {
+    if (SIM_BG_FIRST_DEV + b / 8 > 31 || bus > 255)
+      die("Too many background functions");
+    br = fn_add(SIM_BG_BRIDGE, -1, 0, SIM_BG_FIRST_DEV + b / 8, b % 8, 0x8086, 0x1902,
+                PCI_CLASS_BRIDGE_PCI << 8, PCI_EXP_TYPE_ROOT_PORT);
+    fn_bridge(br, bus, bus);
+    for (; n < bg && n < 256 * (b + 1); n++)
+      fn_add(SIM_BG, br, bus, n % 256 / 8, n % 8, 0x1af4, 0x1041, PCI_CLASS_NETWORK_ETHERNET << 8,
+             PCI_EXP_TYPE_ENDPOINT);
+    bus++;
+  }
+}
+
+static bool fn_is_bridge(const struct sim_fn *f)
+{
+  return (f->conf[PCI_HEADER_TYPE] & 0x7f) == PCI_HEADER_TYPE_BRIDGE;
+}
+
+static bool fn_below(int i, int ancestor)
+{
+  for (i = fns[i].parent; i >= 0; i = fns[i].parent)
+    if (i == ancestor)
+      return true;
+  return false;
+}
+
+static void write_file(const char *dir, const char *name, const void *data, size_t len)
+{
+  char path[PATH_MAX];
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+    die("%s: %s", path, strerror(errno));
+  if (len && write(fd, data, len) != (ssize_t)len)
+    die("%s: %s", path, strerror(errno));
+  close(fd);
+}
+
+static void write_text(const char *dir, const char *name, const char *fmt, ...)
+  __attribute__((format(printf, 3, 4)));
+static void write_text(const char *dir, const char *name, const char *fmt, ...)
+{
+  char buf[512];
+  va_list args;
+
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  write_file(dir, name, buf, strlen(buf));
+}
+
+static void *map_file(const char *dir, const char *name, size_t len)
+{
+  char path[PATH_MAX];
+  void *p;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  if ((fd = open(path, O_RDWR | O_CLOEXEC)) < 0)
+    die("%s: %s", path, strerror(errno));
+  p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    die("%s: %s", path, strerror(errno));
+  return p;
+}
+
+static int watch(const char *dir, const char *name, uint32_t mask)
+{
+  char path[PATH_MAX];
+  int wd;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  if ((wd = inotify_add_watch(inotify_fd, path, mask)) < 0)
+    die("%s: %s", path, strerror(errno));
+  return wd;
+}
+
+/*! @brief Makes the config space of switch port @i visible in sysfs and in its switch's BAR0 */
+static void fn_publish(int i)
+{
+  struct sim_fn *f = &fns[i];
+
+  if (!f->in_sysfs)
+    return;
+  memcpy(f->map, f->conf, SIM_CONF_SIZE);
+  if ((f->role == SIM_UPSTREAM || f->role == SIM_DOWNSTREAM) && bars[f->adapter])
+    memcpy(bars[f->adapter] + f->port * SIM_PORT_STRIDE, f->conf, SIM_PORT_STRIDE);
+}
+
+/*! @brief Creates the sysfs entries of function @i, whose parent must be in sysfs */
+static void fn_create(int i)
+{
+  struct sim_fn *f = &fns[i];
+  char link[PATH_MAX], dir[PATH_MAX];
+  char res[7 * 60] = "";
+  uint64_t bar;
+  int j, len;
+
+  if (f->parent >= 0)
+    len = snprintf(dir, sizeof(dir), "%s/%s", fns[f->parent].dir, f->name);
+  else
+    len = snprintf(dir, sizeof(dir), "%s/devices/pci0000:00/%s", root, f->name);
+  if (len >= (int)sizeof(dir))
+    die("%s: path too long", f->name);
+  strcpy(f->dir, dir);
+  if (mkdir(f->dir, 0755) < 0)
+    die("%s: %s", f->dir, strerror(errno));
+
+  write_text(f->dir, "vendor", "0x%04x\n", get16(f->conf, PCI_VENDOR_ID));
+  write_text(f->dir, "device", "0x%04x\n", get16(f->conf, PCI_DEVICE_ID));
+  write_text(f->dir, "class", "0x%06x\n", get32(f->conf, PCI_CLASS_REVISION) >> 8);
+  write_text(f->dir, "modalias", "pci:v%08Xd%08Xsv%08Xsd%08Xbc%02Xsc%02Xi%02X\n",
+             get16(f->conf, PCI_VENDOR_ID), get16(f->conf, PCI_DEVICE_ID),
+             get16(f->conf, PCI_SUBSYSTEM_VENDOR_ID), get16(f->conf, PCI_SUBSYSTEM_ID),
+             f->conf[PCI_CLASS_DEVICE + 1], f->conf[PCI_CLASS_DEVICE], f->conf[PCI_CLASS_PROG]);
+  write_text(f->dir, "irq", "0\n");
+  for (j = 0; j < 7; j++) {
+    bar = j == 0 && f->role == SIM_UPSTREAM ? get32(f->conf, PCI_BASE_ADDRESS_0) : 0;
+    snprintf(res + strlen(res), sizeof(res) - strlen(res), "0x%016llx 0x%016llx 0x%016llx\n",
+             (unsigned long long)bar, (unsigned long long)(bar ? bar + SIM_BAR_SIZE - 1 : 0),
+             (unsigned long long)(bar ? 0x40200 : 0));
+  }
+  write_text(f->dir, "resource", "%s", res);
+  write_file(f->dir, "config", f->conf, SIM_CONF_SIZE);
+  write_file(f->dir, "remove", NULL, 0);
+  f->map = map_file(f->dir, "config", SIM_CONF_SIZE);
+  f->remove_wd = watch(f->dir, "remove", IN_CLOSE_WRITE);
+  if (fn_is_bridge(f)) {
+    write_file(f->dir, "rescan", NULL, 0);
+    f->rescan_wd = watch(f->dir, "rescan", IN_CLOSE_WRITE);
+  }
+  if (f->role == SIM_DOWNSTREAM)
+    f->conf_wd = watch(f->dir, "config", IN_MODIFY);
+  if (f->role == SIM_UPSTREAM) {
+    char *zero = calloc(1, SIM_BAR_SIZE);
+    if (!zero)
+      die("Out of memory");
+    write_file(f->dir, "resource0", zero, SIM_BAR_SIZE);
+    free(zero);
+    bars[f->adapter] = map_file(f->dir, "resource0", SIM_BAR_SIZE);
+    for (j = 0; j < nfns; j++)
+      if (fns[j].role == SIM_DOWNSTREAM && fns[j].adapter == f->adapter)
+        memcpy(bars[f->adapter] + fns[j].port * SIM_PORT_STRIDE, fns[j].conf, SIM_PORT_STRIDE);
+  }
+
+  snprintf(link, sizeof(link), "%s/bus/pci/devices/%s", root, f->name);
+  if (symlink(f->dir, link) < 0)
+    die("%s: %s", link, strerror(errno));
+  f->in_sysfs = true;
+  fn_publish(i);
+}
+
+static void unlink_in(const char *dir, const char *name)
+{
+  char path[PATH_MAX];
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  unlink(path);
+}
+
+/*! @brief Removes the sysfs entries of function @i; everything behind it must be gone already */
+static void fn_destroy(int i)
+{
+  struct sim_fn *f = &fns[i];
+  static const char * const files[] = {
+    "vendor", "device", "class", "modalias", "irq", "resource", "config", "remove", "rescan", "resource0",
+  };
+  char link[PATH_MAX];
+  unsigned int j;
+
+  if (f->role == SIM_UPSTREAM && bars[f->adapter]) {
+    munmap(bars[f->adapter], SIM_BAR_SIZE);
+    bars[f->adapter] = NULL;
+  }
+  munmap(f->map, SIM_CONF_SIZE);
+  f->map = NULL;
+  /* Their watches go away with the files */
+  f->conf_wd = f->remove_wd = f->rescan_wd = -1;
+  for (j = 0; j < sizeof(files) / sizeof(files[0]); j++)
+    unlink_in(f->dir, files[j]);
+  if (rmdir(f->dir) < 0)
+    die("%s: %s", f->dir, strerror(errno));
+  snprintf(link, sizeof(link), "%s/bus/pci/devices/%s", root, f->name);
+  unlink(link);
+  f->in_sysfs = false;
+}
+
+/*! @brief Drops function @i and everything behind it from sysfs, as writing its remove file does */
+static void sysfs_remove(int i)
+{
+  int j;
+
+  for (j = nfns - 1; j > i; j--)
+    if (fns[j].in_sysfs && fn_below(j, i))
+      fn_destroy(j);
+  if (fns[i].in_sysfs)
+    fn_destroy(i);
+}
+
+/*! @brief Adds what is physically present behind bridge @i (everywhere if -1) but not in sysfs */
+static int sysfs_rescan(int i)
+{
+  int j, found = 0;
+
+  /* Functions are numbered parents first */
+  for (j = 0; j < nfns; j++) {
+    if (fns[j].in_sysfs || !fns[j].present || (i >= 0 && !fn_below(j, i)))
+      continue;
+    if (fns[j].parent >= 0 && !fns[fns[j].parent].in_sysfs)
+      continue;
+    fn_create(j);
+    found++;
+  }
+  return found;
+}
+
+static int find_port(enum sim_role role, int adapter, int port)
+{
+  int i;
+
+  for (i = 0; i < nfns; i++)
+    if (fns[i].role == role && fns[i].adapter == adapter && fns[i].port == port)
+      return i;
+  return -1;
+}
+
+/*! @brief Changes the link state of downstream port @ds, latching the change in SLTSTA */
+static void port_link(int ds, bool up, int speed, int width)
+{
+  uint8_t *c = fns[ds].conf;
+  uint32_t lnkcap = get32(c, SIM_EXP_CAP + PCI_EXP_LNKCAP);
+  uint16_t lnksta = 0;
+
+  if (up)
+    lnksta = (speed ? speed : (int)(lnkcap & PCI_EXP_LNKCAP_SPEED)) |
+             (width ? width : (int)(lnkcap & PCI_EXP_LNKCAP_WIDTH) >> 4) << 4 |
+             PCI_EXP_LNKSTA_DL_ACT;
+  put16(c, SIM_EXP_CAP + PCI_EXP_LNKSTA, lnksta);
+  put16(c, SIM_EXP_CAP + PCI_EXP_SLTSTA, get16(c, SIM_EXP_CAP + PCI_EXP_SLTSTA) | PCI_EXP_SLTSTA_LLCHG);
+  fn_publish(ds);
+}
+
+static void event_run(const struct sim_event *ev)
+{
+  int ds = find_port(SIM_DOWNSTREAM, ev->adapter, ev->port + 1);
+  int hub = find_port(SIM_HUB, ev->adapter, ev->port + 1);
+
+  if (ds < 0 || hub < 0) {
+    note("%s %d %d: no such port", ev->verb, ev->adapter, ev->port);
+    return;
+  }
+  if (!strcmp(ev->verb, "down")) {
+    port_link(ds, false, 0, 0);
+    fns[hub].present = false;
+  } else if (!strcmp(ev->verb, "up")) {
+    port_link(ds, true, ev->speed, ev->width);
+    fns[hub].present = true;
+  } else if (!strcmp(ev->verb, "bounce")) {
+    port_link(ds, true, 0, 0);
+  } else if (!strcmp(ev->verb, "add")) {
+    if (fns[ds].in_sysfs && fns[hub].present && !fns[hub].in_sysfs)
+      fn_create(hub);
+  } else if (!strcmp(ev->verb, "del")) {
+    sysfs_remove(hub);
+  }
+  note("%s %s (port %d/%d)", ev->verb, fns[ds].name, ev->adapter, ev->port);
+}
+
+static int fn_by_wd(int wd, int *what)
+{
+  int i;
+
+  for (i = 0; i < nfns; i++) {
+    if (!fns[i].in_sysfs)
+      continue;
+    if (wd == fns[i].remove_wd || wd == fns[i].rescan_wd || wd == fns[i].conf_wd) {
+      *what = wd;
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*! @brief Acts on writes to the tree's remove, rescan and config files */
+static void inotify_handle(void)
+{
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  ssize_t len;
+  char *p;
+  int i, wd, found;
+
+  while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+    for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+      ev = (const struct inotify_event *)p;
+      if (ev->mask & IN_IGNORED)
+        continue;
+      if (ev->wd == bus_rescan_wd) {
+        found = sysfs_rescan(-1);
+        note("rescan: %d function(s) added", found);
+        continue;
+      }
+      if ((i = fn_by_wd(ev->wd, &wd)) < 0)
+        continue; /* Removed while the event was queued */
+      if (wd == fns[i].conf_wd) {
+        /* Only SLTSTA is ever written: clear the latches, they are W1C */
+        put16(fns[i].conf, SIM_EXP_CAP + PCI_EXP_SLTSTA,
+              get16(fns[i].conf, SIM_EXP_CAP + PCI_EXP_SLTSTA) & ~SIM_SLTSTA_LATCHES);
+        fn_publish(i);
+      } else if (wd == fns[i].remove_wd) {
+        note("remove %s", fns[i].name);
+        sysfs_remove(i);
+      } else {
+        found = sysfs_rescan(i);
+        note("rescan %s: %d function(s) added", fns[i].name, found);
+      }
+    }
+  }
+}
+
+static int script_load(const char *path, struct sim_event **out)
+{
+  struct sim_event *evs = NULL, ev;
+  char line[256];
+  int n = 0, lineno = 0, k;
+  FILE *f;
+
+  if ((f = fopen(path, "r")) == NULL)
+    die("%s: %s", path, strerror(errno));
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+    memset(&ev, 0, sizeof(ev));
+    if ((k = sscanf(line, "%lu %7s %d %d %d %d", &ev.ms, ev.verb, &ev.adapter, &ev.port,
+                    &ev.speed, &ev.width)) <= 0 || line[strspn(line, " \t")] == '#')
+      continue;
+    if (k < 4 || (strcmp(ev.verb, "down") && strcmp(ev.verb, "up") && strcmp(ev.verb, "bounce") &&
+                  strcmp(ev.verb, "add") && strcmp(ev.verb, "del")))
+      die("%s:%d: expected <ms> down|up|bounce|add|del <adapter> <port> [gen width]", path, lineno);
+    if (n && ev.ms < evs[n - 1].ms)
+      die("%s:%d: events must be in time order", path, lineno);
+    if ((evs = realloc(evs, (n + 1) * sizeof(*evs))) == NULL)
+      die("Out of memory");
+    evs[n++] = ev;
+  }
+  fclose(f);
+  *out = evs;
+  return n;
+}
+
+static void on_signal(int signo)
+{
+  (void)(signo);
+  stop = 1;
+}
+
+static void usage(FILE *f)
+{
+  fprintf(f,
+          "Usage: adnacom-sim [options] DIR\n"
+          "Builds a simulated sysfs tree in DIR (which must be empty or missing) and\n"
+          "keeps it behaving like the kernel's, for adnacom-hp --sysfs=DIR.\n"
+          "  -a N       Adapters (default 1, at most 16)\n"
+          "  -p N       Downstream ports per adapter (default 2, at most 7)\n"
+          "  -k N       Background functions (default 0)\n"
+          "  -s FILE    Script of link events, \"<ms> down|up|bounce|add|del <adapter> <port>\"\n"
+          "  -l         Repeat the script until stopped\n"
+          "  -g         Only build the tree and exit\n"
+          "  -h         Show this help\n");
+}
+
+int main(int argc, char **argv)
+{
+  int adapters = 1, ports = 2, bg = 0, opt, i, nev = 0, next = 0;
+  bool loop = false, generate_only = false;
+  struct sim_event *evs = NULL;
+  uint64_t pass_start;
+  struct pollfd pfd;
+  char path[PATH_MAX];
+  long timeout;
+
+  while ((opt = getopt(argc, argv, "a:p:k:s:lgh")) != -1) {
+    switch (opt) {
+    case 'a':
+      adapters = atoi(optarg);
+      break;
+    case 'p':
+      ports = atoi(optarg);
+      break;
+    case 'k':
+      bg = atoi(optarg);
+      break;
+    case 's':
+      nev = script_load(optarg, &evs);
+      break;
+    case 'l':
+      loop = true;
+      break;
+    case 'g':
+      generate_only = true;
+      break;
+    case 'h':
+      usage(stdout);
+      return 0;
+    default:
+      usage(stderr);
+      return 1;
+    }
+  }
+  if (optind != argc - 1 || adapters < 1 || adapters > SIM_MAX_ADAPTERS ||
+      ports < 1 || ports > SIM_MAX_PORTS || bg < 0) {
+    usage(stderr);
+    return 1;
+  }
+  if (strlen(argv[optind]) >= sizeof(root))
+    die("%s: path too long", argv[optind]);
+  strcpy(root, argv[optind]);
+
+  start_ns = now_ns();
+  topology_build(adapters, ports, bg);
+  if ((inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+    die("inotify: %s", strerror(errno));
+  mkdir(root, 0755);
+  snprintf(path, sizeof(path), "%s/devices", root);
+  if (mkdir(path, 0755) < 0)
+    die("%s: %s", path, strerror(errno));
+  snprintf(path, sizeof(path), "%s/devices/pci0000:00", root);
+  mkdir(path, 0755);
+  snprintf(path, sizeof(path), "%s/bus", root);
+  mkdir(path, 0755);
+  snprintf(path, sizeof(path), "%s/bus/pci", root);
+  mkdir(path, 0755);
+  snprintf(path, sizeof(path), "%s/bus/pci/devices", root);
+  if (mkdir(path, 0755) < 0)
+    die("%s: %s", path, strerror(errno));
+  snprintf(path, sizeof(path), "%s/bus/pci", root);
+  write_file(path, "rescan", NULL, 0);
+  bus_rescan_wd = watch(path, "rescan", IN_CLOSE_WRITE);
+  sysfs_rescan(-1);
+  note("%d function(s) in %s: %d adapter(s) with %d port(s), %d background",
+       nfns, root, adapters, ports, bg);
+  if (generate_only)
+    return 0;
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  pfd.fd = inotify_fd;
+  pfd.events = POLLIN;
+  pass_start = now_ns();
+  while (!stop) {
+    timeout = -1;
+    if (next < nev) {
+      uint64_t due = pass_start + evs[next].ms * 1000000ULL, now = now_ns();
+      timeout = due > now ? (long)((due - now + 999999) / 1000000) : 0;
+    }
+    if (poll(&pfd, 1, timeout) > 0)
+      inotify_handle();
+    while (next < nev && now_ns() >= pass_start + evs[next].ms * 1000000ULL)
+      event_run(&evs[next++]);
+    if (next == nev && nev && loop) {
+      pass_start = now_ns();
+      next = 0;
+    }
+  }
+
+  /* Leave DIR as we found it */
+  for (i = 0; i < nfns; i++)
+    if (fns[i].in_sysfs && fns[i].parent < 0)
+      sysfs_remove(i);
+  snprintf(path, sizeof(path), "%s/bus/pci", root);
+  unlink_in(path, "rescan");
+  snprintf(path, sizeof(path), "%s/bus/pci/devices", root);
+  rmdir(path);
+  snprintf(path, sizeof(path), "%s/bus/pci", root);
+  rmdir(path);
+  snprintf(path, sizeof(path), "%s/bus", root);
+  rmdir(path);
+  snprintf(path, sizeof(path), "%s/devices/pci0000:00", root);
+  rmdir(path);
+  snprintf(path, sizeof(path), "%s/devices", root);
+  rmdir(path);
+  free(evs);
+  free(fns);
+  return 0;
+}
@@ -36,17 +36,23 @@
 #include <unistd.h>
 #include <termios.h>
 #include <ctype.h>
-#include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
-#include <signal.h>
-
-#include <time.h>
-#include <sys/time.h>
+#include <dirent.h>
+#include <sys/epoll.h>
 
 #include "adna.h"
 #include "setpci.h"
 #include "ls-caps.h"
+#include "plxmem.h"
+#include "evloop.h"
+#include "uevent.h"
+#include "workq.h"
+#include "arena.h"
+#include "devindex.h"
+#include "log.h"
+#include "metrics.h"
+#include "status.h"
 
 #define PLX_VENDOR_ID       (0x10B5)
 #define PLX_H1A_DEVICE_ID   (0x8608)
@@ -61,10 +67,41 @@
 #define TI_DEVICE_ID        (0x8241)
 
 #define H1A_DISABLE_PORT1_OFFSET    (0x0234)
+#define H1A_DISABLE_PORT_STRIDE     (0x0004)
 #define H1A_DS_PORT1_OFFSET (0x1000)
 #define LINK_OFFSET         (0x0078)
 #define H1A_DS_LINK_OFFSET  ((H1A_DS_PORT1_OFFSET) + (LINK_OFFSET))
 
+#define ADNA_FIRST_TICK_MS  (1000)
+#define ADNA_TICK_MS        (100)   /* Base sampling interval */
+#define ADNA_SLOW_MS        (1000)  /* Interval a stable adapter backs off to */
+#define ADNA_BURST_MS       (2)     /* Interval right after a state change */
+#define ADNA_BURST_WINDOW_MS (500)  /* How long to keep sampling at the burst rate */
+#define ADNA_DOWN_RESET_MS  (1000)  /* Port down this long gets disabled/enabled */
+#define ADNA_RESET_HOLD_MS  (10)    /* How long a reset keeps the link disabled */
+
+#define ADNA_RESCAN_TIMEOUT_MS  (1000)  /* Wait for a rescan to produce the expected device */
+#define ADNA_RESCAN_POLL_MS     (5)
+#define ADNA_TRAIN_MS           (50)    /* Link must stay Up this long before it is rescanned */
+#define ADNA_SETTLE_MS          (20)    /* Port events of an adapter this close share one rescan */
+/* Flap damping, as for BGP routes (RFC 2439) */
+#define ADNA_FLAP_PENALTY       (1000)  /* Added on every Up -> Down transition or bounce */
+#define ADNA_FLAP_HALF_LIFE_MS  (10000) /* Penalty halves this often */
+#define ADNA_FLAP_SUPPRESS      (3000)  /* Recovery stops above this ... */
+#define ADNA_FLAP_REUSE         (750)   /* ... and resumes below this */
+#define ADNA_FLAP_MAX_HALVINGS  (4)     /* Penalty is capped so that damping ends 4 half-lives after the last flap */
+#define ADNA_RESCAN_BURST       (4)     /* Rescans that may run back to back ... */
+#define ADNA_RESCAN_PER_MIN     (60)    /* ... then this many per minute, over all ports */
+#define ADNA_STEP_TRIES         (3)     /* Attempts at one sysfs write within a recovery job */
+#define ADNA_STEP_RETRY_MS      (1)     /* First pause between them, doubled each time */
+#define ADNA_RETRY_MIN_MS       (10)    /* Backoff after a failed recovery, doubled each time */
+#define ADNA_RETRY_MAX_MS       (2000)  /* ... up to this */
+#define ADNA_WORKERS            (2)     /* Recovery threads */
+#define ADNA_WORKER_DEPTH       (32)    /* Jobs queued per recovery thread */
+#define ADNA_ARENA_CHUNK        (64 * 1024)
+#define ADNA_SUMMARY_MS         (300000) /* Port state summary in the log */
+#define ADNA_SYSFS_FDS          "32"    /* Config fds kept open: ports, parents, hubs */
+
 #define foreach_pci_device(acc, p) \
   for ((p) = (acc)->devices; (p) != NULL; (p) = (p)->next)
 
@@ -86,12 +123,19 @@ struct adna_options AdnaOptions;
 
 /*** Our view of the PCI bus ***/
 
-struct pci_access *pacc;
+__thread struct pci_access *pacc; /* Each recovery worker has its own */
 struct device *first_dev;
 static struct adna_device *first_adna = NULL;
 static int seen_errors;
 static int need_topology;
 static bool is_initialized = false;
+static unsigned int scan_gen;       /* Bumped on every full re-enumeration */
+static bool topology_stale = false; /* Forces re-enumeration on the next refresh */
+static bool topology_check = false; /* Without uevents: a sample changed, probe sysfs */
+static uint64_t topology_checked_at;
+static int uevent_fd = -1;          /* Kernel uevents; -1 means poll sysfs instead */
+static struct arena topo_arena;     /* Device forest of the current scan_gen */
+static struct dev_index topo_index; /* BDF lookup into that forest */
 
 struct adnatool_pci_device {
         u16 vid;
@@ -104,30 +148,197 @@ struct adnatool_pci_device {
         {0}, /* sentinel */
 };
 
+/* adnatool_pci_devtbl in the form libpci's prefiltering scan takes it */
+static struct pci_id_match adna_scan_ids[sizeof(adnatool_pci_devtbl) / sizeof(adnatool_pci_devtbl[0])];
+
+/* One per upstream switch port, shared by all of its downstream ports */
+struct adna_adapter {
+  struct adna_adapter *next;
+  int id;                 /* Selects the recovery worker */
+  struct pci_filter *us;  /* Upstream port */
+  struct plx_bar bar0;    /* Switch registers, mapped once at discovery */
+  struct ev_timer tick;   /* Samples the adapter's ports, see adapter_schedule() */
+  uint64_t interval;      /* Current sampling interval in ns */
+  uint64_t burst_until;   /* Sample at the burst rate until this time */
+  uint64_t settle_until;  /* Queued port actions are flushed at this time, 0 if none */
+};
+
+static struct adna_adapter *first_adapter = NULL;
+static int adapter_count;
+
+/* Where a port is in its recovery, decided on every sample */
+enum port_state {
+  PORT_ST_DOWN,       /* Link down; stale devices are removed, a long outage resets the port */
+  PORT_ST_TRAINING,   /* Link up, waiting for it to settle before enumerating behind it */
+  PORT_ST_UP,         /* Link up and devices enumerated behind it */
+  PORT_ST_RECOVERING, /* A recovery job for the port is queued or in flight */
+  PORT_ST_DAMPED,     /* Flapping; left alone until its penalty decays */
+};
+
+static const char * const port_state_names[] = {
+  "Down", "Training", "Up", "Recovering", "Damped",
+};
+
+/* Recovery actions, run on a worker so that sampling never blocks */
+enum adna_action {
+  ADNA_ACT_RESCAN,    /* Link Up, nothing behind it: rescan, wait, dump the port */
+  ADNA_ACT_REENUM,    /* Link bounced: remove what is behind it, then as above */
+  ADNA_ACT_RESTORE,   /* Link Down, stale devices behind it: remove and rescan */
+  ADNA_ACT_RESET,     /* Down for too long: disable/enable the port in the switch */
+};
+
+/*
+ * Everything in here belongs to the sampler (event loop) thread. A recovery
+ * worker only reads the filters, which never change after discovery.
+ */
 struct adna_device {
   struct adna_device *next;
+  struct adna_adapter *adapter;
   struct pci_filter *this, *parent, *hub;
   bool bIsD3; /* Power state */
   int devnum;         /* Assigned NumDevice */
-  int link_down_cnt, hub_down_cnt, link_bad_cnt; /* Error counters */
+  /* Monotonic counters, exported by adna_metrics_render() */
+  unsigned long link_up_cnt, link_down_cnt; /* Link transitions seen between samples */
+  unsigned long bounce_cnt;   /* Down and back Up between two samples */
+  unsigned long degraded_cnt; /* Link came up or changed to below LNKCAP speed/width */
+  unsigned long hub_down_cnt; /* Devices behind the port disappeared */
+  unsigned long recover_cnt[ADNA_ACT_RESET + 1]; /* Recoveries completed, by action */
+  unsigned long rescan_cnt;   /* Rescans run for the port */
+  struct device *dev; /* Node in the device forest, valid for scan_gen */
+  int sysfs_state;    /* PORT_* flags seen at the last refresh */
+  unsigned int domain, secondary, subordinate; /* Bus range behind the port */
+  int children;       /* PCI functions enumerated in that range */
+  /* Static link data cached at discovery, see port_cache_link_info() */
+  int exp_cap;        /* PCIe capability offset, 0 if unknown */
+  bool unmonitored;   /* Enumerated without a PCIe capability, reported once */
+  int devtype;        /* PCI_EXP_TYPE_* */
+  u32 lnkcap;
+  uint32_t mmio_lnk;  /* LNKCTL/LNKSTA dword in the adapter's BAR0, 0 if unusable */
+  bool no_reset;      /* No disable register to reset the port with, reported once */
+  bool has_slot;      /* SLTSTA is implemented */
+  int dllsc_cnt, pdc_cnt; /* Latched Data Link Layer / Presence Detect changes */
+  /* LNKCTL..SLTSTA as read by the tick's batch, see adna_sample_ports() */
+  u8 sample[PCI_EXP_SLTSTA + 2 - PCI_EXP_LNKCTL];
+  bool sampled;
+  struct pci_dev *ecam; /* The port in ecam_pacc, NULL if not reachable there */
+  /* Failed recoveries are retried with exponential backoff */
+  int io_err_cnt;     /* sysfs/BAR accesses that failed during recovery */
+  int fail_cnt;       /* Recovery jobs that failed */
+  unsigned int backoff_ms; /* Wait before the next attempt, 0 after a success */
+  uint64_t retry_at;  /* No recovery is started before this */
+  /* State machine, see adna_check_port() */
+  enum port_state state;
+  uint64_t state_since;
+  bool need_reenum;   /* The link bounced under enumerated devices */
+  unsigned int penalty; /* Flap damping penalty as of penalty_at */
+  uint64_t penalty_at;
+  bool damped;
+  int flap_cnt, throttled_cnt;
+  /* State reported at the last sample */
+  bool seen, was_linkup, was_hubup;
+  int was_quality;
+  uint64_t sampled_at;  /* Time of the last sample */
+  uint16_t lnksta;      /* LNKSTA at the last sample, 0 if not read */
+  struct status_port *status; /* The port's record in the status page, NULL if none */
+  uint64_t up_lost_at;  /* When the port last left Up, 0 while Up */
+  uint64_t down_since; /* When link and hub were first both seen down, 0 if not */
+  bool busy;          /* A recovery job for the port is queued or in flight */
+  bool queued;        /* Waiting in the adapter's settle window, see adapter_flush() */
+  enum adna_action queued_action;
+};
+
+/* One port's part in a recovery job */
+struct adna_job_port {
+  struct adna_device *a;
+  enum adna_action action;
+  bool ok;
+  int err;                /* First error that made the recovery fail, 0 if none */
+  int io_errors;          /* Failed accesses, including ones a retry got past */
+};
+
+/*
+ * A reset is a job of its own. Rescanning actions of the ports of one
+ * adapter that come up within ADNA_SETTLE_MS of each other share a job
+ * and a single rescan, see adapter_flush().
+ */
+struct adna_job {
+  struct wq_job wq;       /* Must be first */
+  struct plx_bar *bar;    /* ADNA_ACT_RESET: switch registers, resolved by the sampler */
+  uint32_t reg;           /* ADNA_ACT_RESET: the port's disable register in @bar */
+  struct pci_filter *ancestor; /* Bridge above all ports of the job, NULL if none */
+  int count;
+  struct adna_job_port ports[];
 };
 
+static struct wq_pool recovery;
+static bool recovery_running;
+static int jobs_inflight;   /* Re-enumeration waits until this drops to 0 */
+static struct pci_access *ecam_pacc; /* Read-only mapped config space, see ecam_open() */
+
+/* Latencies since start, exported by adna_metrics_render() */
+static struct hdr_hist tick_hist;    /* Duration of one adapter tick */
+static struct hdr_hist detect_hist;  /* Upper bound on how long a link change went unseen */
+static struct hdr_hist recover_hist; /* From a port leaving Up to it being Up again */
+static unsigned long rescans_total;  /* Rescans run, one per recovery job */
+
+static struct status_page *status_page; /* Shared with other processes, see status.h */
+
+/* Events since the last periodic summary, see adna_log_summary() */
+static struct {
+  struct ev_timer timer;
+  unsigned int flaps;
+  unsigned int recoveries;
+  unsigned int failures;
+} summary;
+
+/* Port state as seen directly in sysfs */
+#define PORT_PRESENT    0x1
+#define PORT_HAS_CHILD  0x2
+
 int pci_get_devtype(struct pci_dev *pdev);
 bool pci_is_upstream(struct pci_dev *pdev);
 bool pcidev_is_adnacom(struct pci_dev *p);
-bool pci_dl_active(struct pci_dev *pdev);
 bool pci_is_hub_alive(struct device *d);
 bool pci_is_downstream(struct pci_dev *pdev);
-int pci_check_link_cap(struct pci_dev *pdev);
 
-static void stoptimer(void);
-static void settimer100ms(void);
+/*! @brief Where sysfs is mounted: /sys, or a simulated tree given with --sysfs */
+static const char *sysfs_root(void)
+{
+  return AdnaOptions.SysfsRoot[0] ? AdnaOptions.SysfsRoot : "/sys";
+}
 
 static void pci_get_res0(struct pci_filter *f, char *path, size_t pathlen)
 {
   snprintf(path, 
           pathlen,
-          "/sys/bus/pci/devices/%04x:%02x:%02x.%d/resource0",
+          "%s/bus/pci/devices/%04x:%02x:%02x.%d/resource0",
+          sysfs_root(),
+          f->domain,
+          f->bus,
+          f->slot,
+          f->func);
+  return;
+}
+
+static void pci_get_devdir(struct pci_filter *f, char *path, size_t pathlen)
+{
+  snprintf(path, 
+          pathlen,
+          "%s/bus/pci/devices/%04x:%02x:%02x.%d",
+          sysfs_root(),
+          f->domain,
+          f->bus,
+          f->slot,
+          f->func);
+  return;
+}
+
+static void pci_get_rescan(struct pci_filter *f, char *path, size_t pathlen)
+{
+  snprintf(path, 
+          pathlen,
+          "%s/bus/pci/devices/%04x:%02x:%02x.%d/rescan",
+          sysfs_root(),
           f->domain,
           f->bus,
           f->slot,
@@ -139,7 +350,8 @@ static void pci_get_remove(struct pci_filter *f, char *path, size_t pathlen)
 {
   snprintf(path, 
           pathlen,
-          "/sys/bus/pci/devices/%04x:%02x:%02x.%d/remove",
+          "%s/bus/pci/devices/%04x:%02x:%02x.%d/remove",
+          sysfs_root(),
           f->domain,
           f->bus,
           f->slot,
@@ -147,95 +359,234 @@ static void pci_get_remove(struct pci_filter *f, char *path, size_t pathlen)
   return;
 }
 
-static uint32_t pcimem(int access, struct pci_filter *f, uint32_t reg, uint32_t data)
+/*! @brief Reads the address of BAR0 from the function's sysfs resource file
+ *
+ * Unlike pci_fill_info(), whose error hook exits, this fails quietly if
+ * the function was removed in the meantime. Returns 0 or -errno.
+ */
+static int pci_get_bar0(struct pci_filter *f, uint64_t *phys)
 {
-  int fd;
-  void *map_base, *virt_addr;
-  uint64_t read_result, writeval, prev_read_result = 0;
-  off_t target, target_base;
-  int items_count = 1;
-  int read_result_dupped = 0;
-  int type_width = 4;
-  int i;
-  int map_size = 4096UL;
+  unsigned long long start;
+  char path[256];
+  FILE *file;
+  int n;
+
+  pci_get_devdir(f, path, sizeof(path));
+  if (strlen(path) + sizeof("/resource") > sizeof(path))
+    return -ENAMETOOLONG;
+  strcat(path, "/resource");
+  if ((file = fopen(path, "r")) == NULL)
+    return -errno;
+  n = fscanf(file, "%llx", &start);
+  fclose(file);
+  if (n != 1)
+    return -EIO;
+  *phys = start & PCI_ADDR_MEM_MASK;
+  return 0;
+}
+
+static struct device *find_device(struct pci_filter *f)
+{
+  struct dev_index_entry *e;
+  struct device *d;
+
+  if (dev_index_covers(&topo_index, f))
+    return (e = dev_index_find_filter(&topo_index, f)) ? e->dev : NULL;
+  for (d=first_dev; d; d=d->next)
+    if (pci_filter_match(f, d->dev))
+      return d;
+  return NULL;
+}
 
+/*! @brief (Re)maps BAR0 of the adapter's upstream port */
+static int adapter_map(struct adna_adapter *ad)
+{
   char filename[256] = "\0";
-  pci_get_res0(f, filename, sizeof(filename));
-  target = (off_t)reg;
+  uint64_t phys;
+  int err;
+
+  /* A port gone since the last enumeration has no BAR; use config space */
+  if (!ad->us || find_device(ad->us) == NULL ||
+      pci_get_bar0(ad->us, &phys) < 0) {
+    plx_bar_unmap(&ad->bar0);
+    return -ENODEV;
+  }
+  if (plx_bar_mapped(&ad->bar0) && ad->bar0.phys == phys)
+    return 0;
 
-  if ((fd = open(filename, O_RDWR | O_SYNC)) == -1)
-    PRINT_ERROR;
-  if (AdnaOptions.bVerbose) {
-    printf("\n%s opened.\n", filename);
-    printf("Target offset is 0x%x, page size is %ld\n", (int)target, sysconf(_SC_PAGE_SIZE));
+  pci_get_res0(ad->us, filename, sizeof(filename));
+  if ((err = plx_bar_map(&ad->bar0, filename, phys)) < 0) {
+    adna_log(LOG_ERR, "Unable to map %s (%s)", filename, strerror(-err));
+    return err;
   }
-  fflush(stdout);
+  adna_log(LOG_DEBUG, "%s mapped, %zu bytes at 0x%08lx", filename, ad->bar0.size,
+           (unsigned long)ad->bar0.base);
+  return 0;
+}
+
+/*! @brief Returns the adapter's BAR0 if @reg lies inside it, NULL with errno set otherwise */
+static struct plx_bar *adapter_bar(struct adna_adapter *ad, uint32_t reg)
+{
+  int err;
 
-  target_base = target & ~(sysconf(_SC_PAGE_SIZE) - 1);
-  if (target + items_count * type_width - target_base > map_size)
-    map_size = target + items_count * type_width - target_base;
+  if (!ad) {
+    errno = ENODEV;
+    return NULL;
+  }
+  if (!plx_bar_mapped(&ad->bar0) && (err = adapter_map(ad)) < 0) {
+    errno = -err;
+    return NULL;
+  }
+  if (!plx_bar_valid(&ad->bar0, reg)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return &ad->bar0;
+}
 
-  /* Map one page */
-  if (AdnaOptions.bVerbose)
-    printf("mmap(%d, %d, 0x%x, 0x%x, %d, 0x%x)\n", 0, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (int)target);
+/*! @brief Finds or creates the adapter owning the upstream port @us
+ *
+ * Ports without an upstream switch port (@us NULL) share one adapter that
+ * has no BAR, so that every port is sampled by some adapter's timer.
+ */
+static struct adna_adapter *get_adapter(struct device *us)
+{
+  struct adna_adapter *ad;
+  char bdf_str[17];
 
-  map_base = mmap(0, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, target_base);
-  if (map_base == (void *)-1)
-    PRINT_ERROR;
-  if (AdnaOptions.bVerbose)
-    printf("PCI Memory mapped to address 0x%08lx.\n", (unsigned long)map_base);
-  fflush(stdout);
+  for (ad = first_adapter; ad; ad = ad->next)
+    if (us ? (ad->us && pci_filter_match(ad->us, us->dev)) : !ad->us)
+      return ad;
+
+  ad = xmalloc(sizeof(struct adna_adapter));
+  memset(ad, 0, sizeof(*ad));
+  ad->tick.fd = -1;
+  ad->id = adapter_count++;
+  plx_bar_init(&ad->bar0);
+  if (us) {
+    ad->us = xmalloc(sizeof(struct pci_filter));
+    pci_filter_init(NULL, ad->us);
+    snprintf(bdf_str, sizeof(bdf_str), "%04x:%02x:%02x.%d",
+             us->dev->domain, us->dev->bus, us->dev->dev, us->dev->func);
+    pci_filter_parse_slot(ad->us, bdf_str);
+    adapter_map(ad);
+  }
 
-  for (i = 0; i < items_count; i++) {
-    virt_addr = map_base + target + i * type_width - target_base;
-    read_result = *((uint32_t *)virt_addr);
+  ad->next = first_adapter;
+  first_adapter = ad;
+  return ad;
+}
 
-    if (read_result != prev_read_result || i == 0) {
-      if (AdnaOptions.bVerbose)
-        printf("Reg 0x%04X: 0x%0*lX\n", (int)(target + i * type_width), type_width * 2, read_result);
-      read_result_dupped = 0;
-    } else {
-      if (!read_result_dupped)
-        printf("...\n");
-      read_result_dupped = 1;
-    }
+/*! @brief Drops mappings whose upstream port went away or was re-enumerated */
+static void revalidate_adapters(void)
+{
+  struct adna_adapter *ad;
+
+  for (ad = first_adapter; ad; ad = ad->next)
+    if (plx_bar_mapped(&ad->bar0))
+      adapter_map(ad);
+}
 
-    prev_read_result = read_result;
+static void free_adapters(void)
+{
+  struct adna_adapter *ad, *next;
+
+  for (ad = first_adapter; ad; ad = next) {
+    next = ad->next;
+    plx_bar_unmap(&ad->bar0);
+    if (ad->tick.fd >= 0)
+      close(ad->tick.fd);
+    free(ad->us);
+    free(ad);
   }
+  first_adapter = NULL;
+  adapter_count = 0;
+}
 
-  fflush(stdout);
+static uint64_t opt_ms(unsigned int value, unsigned int dflt)
+{
+  return (value ? value : dflt) * NSEC_PER_MSEC;
+}
 
-  if (REG_WRITE == access) {
-    writeval = (uint64_t)data;
-    *((uint32_t *)virt_addr) = writeval;
-    read_result = *((uint32_t *)virt_addr);
-      
-    if (AdnaOptions.bVerbose)
-      printf("Written 0x%0*lX; readback 0x%0*lX\n", type_width,
-            writeval, type_width, read_result);
-    fflush(stdout);
+static unsigned int opt_uint(unsigned int opt, unsigned int def)
+{
+  return opt ? opt : def;
+}
+
+/*! @brief Rejects sampling options that would not satisfy burst <= tick <= slow,
+ *  and flap damping thresholds that would not satisfy reuse < suppress */
+int adna_check_intervals(void)
+{
+  uint64_t tick = opt_ms(AdnaOptions.TickMs, ADNA_TICK_MS);
+  uint64_t slow = opt_ms(AdnaOptions.SlowMs, ADNA_SLOW_MS);
+  uint64_t burst = opt_ms(AdnaOptions.BurstMs, ADNA_BURST_MS);
+  unsigned int suppress = opt_uint(AdnaOptions.FlapSuppress, ADNA_FLAP_SUPPRESS);
+  unsigned int reuse = opt_uint(AdnaOptions.FlapReuse, ADNA_FLAP_REUSE);
+
+  if (burst > tick || tick > slow) {
+    fprintf(stderr, "adna: Sampling intervals must satisfy burst (%llu) <= tick (%llu) <= slow (%llu) ms\n",
+            (unsigned long long)(burst / NSEC_PER_MSEC), (unsigned long long)(tick / NSEC_PER_MSEC),
+            (unsigned long long)(slow / NSEC_PER_MSEC));
+    return -EINVAL;
   }
+  if (reuse >= suppress) {
+    fprintf(stderr, "adna: Flap damping needs reuse (%u) < suppress (%u)\n", reuse, suppress);
+    return -EINVAL;
+  }
+  return 0;
+}
 
-  if (munmap(map_base, map_size) == -1)
-    PRINT_ERROR;
-  close(fd);
-  return (access ? 0 : (uint32_t)read_result);
+/*! @brief Picks the adapter's next sampling interval
+ *
+ * A change (or a kernel event on one of its ports) puts the adapter into a
+ * burst window sampled every BurstMs, so link training and enumeration are
+ * followed closely. Once the window closes the adapter drops back to TickMs
+ * and then doubles the interval on every quiet sample up to SlowMs.
+ */
+static void adapter_schedule(struct adna_adapter *ad, bool changed)
+{
+  uint64_t now = ev_now();
+  uint64_t base = opt_ms(AdnaOptions.TickMs, ADNA_TICK_MS);
+  uint64_t interval;
+
+  if (changed)
+    ad->burst_until = now + opt_ms(AdnaOptions.BurstWindowMs, ADNA_BURST_WINDOW_MS);
+
+  if (now < ad->burst_until)
+    interval = opt_ms(AdnaOptions.BurstMs, ADNA_BURST_MS);
+  else if (ad->interval < base)
+    interval = base;
+  else
+    interval = ad->interval * 2;
+  if (interval > opt_ms(AdnaOptions.SlowMs, ADNA_SLOW_MS))
+    interval = opt_ms(AdnaOptions.SlowMs, ADNA_SLOW_MS);
+
+  if (interval != ad->interval && ad->tick.fd >= 0) {
+    ad->interval = interval;
+    ev_timer_set_interval(&ad->tick, interval);
+  }
 }
 
-/*! @brief Disables H1A downstream port in PCIe switch register */
-static void disable_port(struct adna_device *a)
+/*! @brief Disables H1A downstream port in PCIe switch register @reg; false if it did not take */
+static bool disable_port(struct plx_bar *bar, uint32_t reg)
 {
-  int ptControl = pcimem(REG_READ, a->parent, H1A_DISABLE_PORT1_OFFSET, 0);
-  ptControl |= 1;
-  pcimem(REG_WRITE, a->parent, H1A_DISABLE_PORT1_OFFSET, ptControl);
+  uint32_t ptControl;
+
+  ptControl = plx_bar_rmw32(bar, reg, 0, 1);
+  adna_log(LOG_DEBUG, "Reg 0x%04X: written 0x%08X", reg, ptControl);
+  ptControl = plx_bar_read32(bar, reg);
+  return ptControl != 0xffffffff && (ptControl & 1);
 }
 
-/*! @brief Enables H1A downstream port in PCIe switch register */
-static void enable_port(struct adna_device *a)
+/*! @brief Enables H1A downstream port in PCIe switch register @reg; false if it did not take */
+static bool enable_port(struct plx_bar *bar, uint32_t reg)
 {
-  int ptControl = pcimem(REG_READ, a->parent, H1A_DISABLE_PORT1_OFFSET, 0);
-  ptControl &= ~1;
-  pcimem(REG_WRITE, a->parent, H1A_DISABLE_PORT1_OFFSET, ptControl);
+  uint32_t ptControl;
+
+  ptControl = plx_bar_rmw32(bar, reg, 1, 0);
+  adna_log(LOG_DEBUG, "Reg 0x%04X: written 0x%08X", reg, ptControl);
+  ptControl = plx_bar_read32(bar, reg);
+  return ptControl != 0xffffffff && !(ptControl & 1);
 }
 
 static char *link_compare(int sta, int cap)
@@ -247,17 +598,13 @@ static char *link_compare(int sta, int cap)
   return "ok";
 }
 
-int pci_check_link_cap(struct pci_dev *pdev)
+/*! @brief Compares the negotiated link against the port's capabilities */
+static int link_quality(uint32_t linkcap, uint16_t linksta)
 {
-  struct pci_cap *cap;
   int status;
-  uint32_t linkcap, cap_speed, cap_width, sta_speed, sta_width;
-  uint16_t linksta;
-  cap = pci_find_cap(pdev, PCI_CAP_ID_EXP, PCI_CAP_NORMAL);
-  linkcap = pci_read_long(pdev, cap->addr + PCI_EXP_LNKCAP);
+  uint32_t cap_speed, cap_width, sta_speed, sta_width;
   cap_speed = linkcap & PCI_EXP_LNKCAP_SPEED;
   cap_width = (linkcap & PCI_EXP_LNKCAP_WIDTH) >> 4;
-  linksta = pci_read_word(pdev, cap->addr + PCI_EXP_LNKSTA);
   sta_speed = linksta & PCI_EXP_LNKSTA_SPEED;
   sta_width = (linksta & PCI_EXP_LNKSTA_WIDTH) >> 4;
 
@@ -279,17 +626,131 @@ int pci_check_link_cap(struct pci_dev *pdev)
   return status;
 }
 
-bool pci_is_hub_alive(struct device *d)
+/*! @brief Caches the static link data of a monitored port
+ *
+ * Afterwards the libpci config cache of the port is detached, so every
+ * pci_read_word() of LNKSTA is a single 2-byte read from the device
+ * instead of a 256-byte refresh followed by capability list walks.
+ */
+static void port_cache_link_info(struct adna_device *a)
 {
-  return (NULL != d->bridge->first_bus->first_dev);
+  struct pci_dev *p = a->dev->dev;
+  struct pci_cap *cap;
+  word flags;
+
+  a->exp_cap = 0;
+  if ((cap = pci_find_cap(p, PCI_CAP_ID_EXP, PCI_CAP_NORMAL)) == NULL)
+    return;
+  flags = pci_read_word(p, cap->addr + PCI_EXP_FLAGS);
+  a->devtype = (flags & PCI_EXP_FLAGS_TYPE) >> 4;
+  a->lnkcap = pci_read_long(p, cap->addr + PCI_EXP_LNKCAP);
+  a->has_slot = (flags & PCI_EXP_FLAGS_SLOT) != 0;
+  a->exp_cap = cap->addr;
+  pci_setup_cache(p, NULL, 0);
 }
 
-bool pci_dl_active(struct pci_dev *pdev)
+/*! @brief Locates the port's link registers in the switch's BAR0
+ *
+ * The PLX switch mirrors the config space of port N at N * 4 KB in the
+ * upstream port's BAR0 (for port 1 the link registers sit at
+ * H1A_DS_LINK_OFFSET). The window is only used if it carries the port's
+ * own vendor/device ID.
+ */
+static void port_probe_mmio(struct adna_device *a)
 {
-  struct pci_cap *cap;
-  cap = pci_find_cap(pdev, PCI_CAP_ID_EXP, PCI_CAP_NORMAL);
-  int linksta = pci_read_word(pdev, cap->addr + PCI_EXP_LNKSTA);
-  return (linksta & PCI_EXP_LNKSTA_DL_ACT) == PCI_EXP_LNKSTA_DL_ACT;
+  struct pci_dev *p = a->dev->dev;
+  struct plx_bar *bar;
+  uint32_t base, reg;
+
+  a->mmio_lnk = 0;
+  if (!a->exp_cap || !a->adapter || !plx_bar_mapped(&a->adapter->bar0))
+    return;
+  bar = &a->adapter->bar0;
+  base = ((a->lnkcap & PCI_EXP_LNKCAP_PORT) >> 24) * H1A_DS_PORT1_OFFSET;
+  reg = base + a->exp_cap + PCI_EXP_LNKCTL;
+  if (!plx_bar_valid(bar, reg))
+    return;
+  if (plx_bar_read32(bar, base + PCI_VENDOR_ID) != ((uint32_t)p->device_id << 16 | p->vendor_id))
+    return;
+  a->mmio_lnk = reg;
+  adna_log(LOG_DEBUG, "%02x:%02x.%d link status via BAR0+0x%04x", p->bus, p->dev, p->func, reg);
+}
+
+/*! @brief Returns the port's disable register in the switch's BAR0, 0 if it has none
+ *
+ * The switch has one per downstream port, port 1's at H1A_DISABLE_PORT1_OFFSET.
+ */
+static uint32_t port_disable_reg(struct adna_device *a)
+{
+  unsigned int port = (a->lnkcap & PCI_EXP_LNKCAP_PORT) >> 24;
+
+  if (!a->exp_cap || !port)
+    return 0;
+  return H1A_DISABLE_PORT1_OFFSET + (port - 1) * H1A_DISABLE_PORT_STRIDE;
+}
+
+/*! @brief Returns the word at capability offset @pos from the tick's sample */
+static uint16_t port_sample_word(struct adna_device *a, int pos)
+{
+  pos -= PCI_EXP_LNKCTL;
+  return a->sample[pos] | a->sample[pos + 1] << 8;
+}
+
+/*! @brief Reads LNKSTA, from BAR0 or the tick's sample when possible, from config space otherwise */
+static uint16_t port_read_lnksta(struct adna_device *a)
+{
+  uint32_t val;
+
+  if (a->mmio_lnk && plx_bar_mapped(&a->adapter->bar0)) {
+    val = plx_bar_read32(&a->adapter->bar0, a->mmio_lnk);
+    if (val != 0xffffffff)
+      return val >> 16;
+  }
+  if (a->sampled)
+    return port_sample_word(a, PCI_EXP_LNKSTA);
+  return pci_read_word(a->dev->dev, a->exp_cap + PCI_EXP_LNKSTA);
+}
+
+#define SLTSTA_LATCHES  (PCI_EXP_SLTSTA_LLCHG | PCI_EXP_SLTSTA_PRSD)
+
+/*! @brief Reads and clears the port's Data Link Layer / Presence Detect Changed latches
+ *
+ * The bits stay set until written with 1, so a link that drops and comes
+ * back between two samples is still seen here although LNKSTA looks the
+ * same both times. SLTSTA sits in the dword after LNKCTL/LNKSTA and is read
+ * through BAR0 when possible; the clear always goes through config space,
+ * as a dword write in BAR0 would also rewrite SLTCTL.
+ */
+static uint16_t port_read_latches(struct adna_device *a)
+{
+  uint32_t reg = a->mmio_lnk + (PCI_EXP_SLTCTL - PCI_EXP_LNKCTL);
+  uint32_t val;
+  uint16_t sltsta;
+
+  if (!a->has_slot)
+    return 0;
+  if (a->mmio_lnk && plx_bar_mapped(&a->adapter->bar0) &&
+      plx_bar_valid(&a->adapter->bar0, reg) &&
+      (val = plx_bar_read32(&a->adapter->bar0, reg)) != 0xffffffff)
+    sltsta = val >> 16;
+  else if (a->sampled)
+    sltsta = port_sample_word(a, PCI_EXP_SLTSTA);
+  else
+    sltsta = pci_read_word(a->dev->dev, a->exp_cap + PCI_EXP_SLTSTA);
+
+  if (sltsta == 0xffff || !(sltsta & SLTSTA_LATCHES))
+    return 0;
+  pci_write_word(a->dev->dev, a->exp_cap + PCI_EXP_SLTSTA, sltsta & SLTSTA_LATCHES);
+  if (sltsta & PCI_EXP_SLTSTA_LLCHG)
+    a->dllsc_cnt++;
+  if (sltsta & PCI_EXP_SLTSTA_PRSD)
+    a->pdc_cnt++;
+  return sltsta & SLTSTA_LATCHES;
+}
+
+bool pci_is_hub_alive(struct device *d)
+{
+  return (NULL != d->bridge->first_bus->first_dev);
 }
 
 int pci_get_devtype(struct pci_dev *pdev)
@@ -313,7 +774,7 @@ bool pci_is_downstream(struct pci_dev *pdev)
 bool pcidev_is_adnacom(struct pci_dev *p)
 {
   struct adnatool_pci_device *entry;
-  pci_fill_info(p, PCI_FILL_IDENT | PCI_FILL_BASES | PCI_FILL_CLASS);
+  pci_fill_info(p, PCI_FILL_IDENT | PCI_FILL_CLASS);
   for (entry = adnatool_pci_devtbl; entry->vid != 0; entry++) {
     if (p->vendor_id != entry->vid)
       continue;
@@ -326,25 +787,235 @@ bool pcidev_is_adnacom(struct pci_dev *p)
   return false;
 }
 
-/*! @brief Removes the H1A downstream port */
-static void remove_downstream(struct adna_device *a)
+/*! @brief Writes "1" to a sysfs trigger attribute; returns 0 or -errno */
+static int sysfs_trigger(const char *path)
 {
-  char filename[256] = "\0";
-  int dsfd, res;
-  pci_get_remove(a->this, filename, sizeof(filename));
-  if((dsfd = open(filename, O_WRONLY )) == -1) PRINT_ERROR;
-  if((res = write( dsfd, "1", 1 )) == -1) PRINT_ERROR;
-  close(dsfd);
+  int fd, err = 0;
+
+  if ((fd = open(path, O_WRONLY)) == -1)
+    return -errno;
+  if (write(fd, "1", 1) == -1)
+    err = -errno;
+  close(fd);
+  return err;
+}
+
+/*! @brief sysfs_trigger() with a few quick retries, counting failures in @io_errors
+ *
+ * During a hot-remove the kernel briefly rejects writes while it tears the
+ * device down, so a retry a millisecond later usually succeeds. A missing
+ * file is not retried, it will not come back that fast.
+ */
+static int job_trigger(int *io_errors, const char *path)
+{
+  struct timespec ts = { 0, ADNA_STEP_RETRY_MS * NSEC_PER_MSEC };
+  int err, tries = 0;
+
+  while ((err = sysfs_trigger(path)) < 0) {
+    (*io_errors)++;
+    if (err == -ENOENT || ++tries >= ADNA_STEP_TRIES)
+      break;
+    nanosleep(&ts, NULL);
+    ts.tv_nsec *= 2;
+  }
+  if (err < 0)
+    adna_log(LOG_DEBUG, "%s: %s", path, strerror(-err));
+  return err;
+}
+
+/*! @brief Removes the functions behind the H1A downstream port
+ *
+ * The port itself stays, so the rescan that follows does not have to find
+ * it again before it can look behind it. A function already gone counts
+ * as removed, and so does everything behind a port that is gone.
+ */
+static int remove_downstream(struct adna_job_port *p)
+{
+  char path[256] = "\0", filename[256] = "\0";
+  struct pci_filter child;
+  struct dirent *entry;
+  unsigned int dom, bus, dev, func;
+  int err, ret = 0;
+  DIR *dir;
+
+  pci_get_devdir(p->a->this, path, sizeof(path));
+  if ((dir = opendir(path)) == NULL)
+    return 0;
+  while ((entry = readdir(dir)) != NULL) {
+    if (sscanf(entry->d_name, "%x:%x:%x.%x", &dom, &bus, &dev, &func) != 4)
+      continue;
+    pci_filter_init(NULL, &child);
+    child.domain = dom;
+    child.bus = bus;
+    child.slot = dev;
+    child.func = func;
+    pci_get_remove(&child, filename, sizeof(filename));
+    if ((err = job_trigger(&p->io_errors, filename)) < 0 && err != -ENOENT && !ret)
+      ret = err;
+  }
+  closedir(dir);
+  return ret;
 }
 
 /*! @brief Rescan the pci bus */
-static void rescan_pci(void)
+static int rescan_pci(int *io_errors)
+{
+  char filename[256];
+
+  snprintf(filename, sizeof(filename), "%s/bus/pci/rescan", sysfs_root());
+  return job_trigger(io_errors, filename);
+}
+
+/*! @brief Rescans the buses behind bridge @f, or the whole machine if it is NULL or gone */
+static int rescan_bridge(struct pci_filter *f, int *io_errors)
+{
+  char filename[256] = "\0";
+
+  if (f) {
+    pci_get_rescan(f, filename, sizeof(filename));
+    if (job_trigger(io_errors, filename) == 0)
+      return 0;
+  }
+  return rescan_pci(io_errors);
+}
+
+/*! @brief Rescans only the bus behind a downstream port
+ *
+ * Falls back to the port's upstream bridge when the port itself is gone,
+ * and to a machine-wide rescan as a last resort.
+ */
+static int rescan_port(struct adna_job_port *p)
+{
+  char filename[256] = "\0";
+
+  pci_get_rescan(p->a->this, filename, sizeof(filename));
+  if (job_trigger(&p->io_errors, filename) == 0)
+    return 0;
+  return rescan_bridge(p->a->parent, &p->io_errors);
+}
+
+/*! @brief Probes a port in sysfs without touching its config space */
+static int port_sysfs_state(struct pci_filter *f)
+{
+  char path[256] = "\0";
+  unsigned int dom, bus, dev, func;
+  struct dirent *entry;
+  DIR *dir;
+  int state;
+
+  pci_get_devdir(f, path, sizeof(path));
+  if ((dir = opendir(path)) == NULL)
+    return 0;
+  state = PORT_PRESENT;
+  while ((entry = readdir(dir)) != NULL) {
+    if (sscanf(entry->d_name, "%x:%x:%x.%x", &dom, &bus, &dev, &func) == 4) {
+      state |= PORT_HAS_CHILD;
+      break;
+    }
+  }
+  closedir(dir);
+  return state;
+}
+
+static bool port_is_present(struct adna_device *a)
+{
+  return port_sysfs_state(a->this) & PORT_PRESENT;
+}
+
+static bool port_has_hub(struct adna_device *a)
+{
+  char path[256] = "\0";
+
+  if (a->hub) {
+    pci_get_devdir(a->hub, path, sizeof(path));
+    return access(path, F_OK) == 0;
+  }
+  return port_sysfs_state(a->this) & PORT_HAS_CHILD;
+}
+
+/*! @brief Waits for a rescan to complete, i.e. until @done(a) holds
+ *
+ * Runs on a recovery worker and polls sysfs every ADNA_RESCAN_POLL_MS; the
+ * uevent socket belongs to the sampler. Returns false if the timeout
+ * expired first.
+ */
+static bool wait_for_port(struct adna_device *a, bool (*done)(struct adna_device *), int timeout_ms)
+{
+  uint64_t deadline = ev_now() + timeout_ms * NSEC_PER_MSEC;
+  struct timespec ts = { 0, ADNA_RESCAN_POLL_MS * NSEC_PER_MSEC };
+
+  while (!done(a)) {
+    if (ev_now() >= deadline)
+      return false;
+    nanosleep(&ts, NULL);
+  }
+  return true;
+}
+
+/*! @brief Whether the port's link is up again; for wait_for_port() on a worker
+ *
+ * Reads LNKSTA from BAR0 when it is mirrored there, otherwise through the
+ * worker's own pci_access, as the sampler's devices are not for workers.
+ */
+static bool port_link_active(struct adna_device *a)
+{
+  struct pci_dev *p;
+  uint32_t val;
+  uint16_t lnksta;
+
+  if (a->mmio_lnk && plx_bar_mapped(&a->adapter->bar0)) {
+    val = plx_bar_read32(&a->adapter->bar0, a->mmio_lnk);
+    if (val != 0xffffffff)
+      return (val >> 16) & PCI_EXP_LNKSTA_DL_ACT;
+  }
+  if (!a->exp_cap)
+    return port_is_present(a);
+  if ((p = pci_get_dev(pacc, a->this->domain, a->this->bus, a->this->slot, a->this->func)) == NULL)
+    return false;
+  lnksta = pci_read_word(p, a->exp_cap + PCI_EXP_LNKSTA);
+  pci_free_dev(p);
+  return lnksta != 0xffff && (lnksta & PCI_EXP_LNKSTA_DL_ACT);
+}
+
+static bool port_owns_bus(struct adna_device *a, unsigned int domain, unsigned int bus)
+{
+  return domain == a->domain && a->secondary &&
+         bus >= a->secondary && bus <= a->subordinate;
+}
+
+static int count_functions_below(int dirfd)
+{
+  unsigned int dom, bus, dev, func;
+  struct dirent *entry;
+  DIR *dir;
+  int fd, cnt = 0;
+
+  if ((dir = fdopendir(dirfd)) == NULL) {
+    close(dirfd);
+    return 0;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    if (sscanf(entry->d_name, "%x:%x:%x.%x", &dom, &bus, &dev, &func) != 4)
+      continue;
+    cnt++;
+    if ((fd = openat(dirfd, entry->d_name, O_RDONLY | O_DIRECTORY)) >= 0)
+      cnt += count_functions_below(fd);
+  }
+  closedir(dir);
+  return cnt;
+}
+
+/*! @brief Counts the functions the kernel has enumerated behind a port,
+ *  walking only the port's own subtree of sysfs */
+static int port_count_children(struct adna_device *a)
 {
-    int scanfd, res;
-    if((scanfd = open("/sys/bus/pci/rescan", O_WRONLY )) == -1) PRINT_ERROR;
-    if((res = write( scanfd, "1", 1 )) == -1) PRINT_ERROR;
-    close(scanfd);
-    sleep(1);
+  char path[256] = "\0";
+  int fd;
+
+  pci_get_devdir(a->this, path, sizeof(path));
+  if ((fd = open(path, O_RDONLY | O_DIRECTORY)) < 0)
+    return 0;
+  return count_functions_below(fd);
 }
 
 int config_fetch(struct device *d, unsigned int pos, unsigned int len)
@@ -364,8 +1035,18 @@ int config_fetch(struct device *d, unsigned int pos, unsigned int len)
       int orig_size = d->config_bufsize;
       while (end > d->config_bufsize)
         d->config_bufsize *= 2;
-      d->config = xrealloc(d->config, d->config_bufsize);
-      d->present = xrealloc(d->present, d->config_bufsize);
+      if (d->arena)
+        {
+          d->config = arena_realloc(d->arena, d->config, orig_size, d->config_bufsize);
+          d->present = arena_realloc(d->arena, d->present, orig_size, d->config_bufsize);
+          if (!d->config || !d->present)
+            die("Unable to allocate %d bytes of memory", (int) d->config_bufsize);
+        }
+      else
+        {
+          d->config = xrealloc(d->config, d->config_bufsize);
+          d->present = xrealloc(d->present, d->config_bufsize);
+        }
       memset(d->present + orig_size, 0, d->config_bufsize - orig_size);
     }
   result = pci_read_block(d->dev, pos, d->config + pos, len);
@@ -374,6 +1055,16 @@ int config_fetch(struct device *d, unsigned int pos, unsigned int len)
   return result;
 }
 
+/*! @brief Allocates from the topology arena; freed with the whole generation */
+void *topo_alloc(size_t size)
+{
+  void *p = arena_alloc(&topo_arena, size);
+
+  if (!p)
+    die("Unable to allocate %d bytes of memory", (int) size);
+  return p;
+}
+
 struct device *scan_device(struct pci_dev *p)
 {
   struct device *d;
@@ -386,19 +1077,20 @@ struct device *scan_device(struct pci_dev *p)
   if (!pcidev_is_adnacom(p))
     return NULL;
 
-  d = xmalloc(sizeof(struct device));
+  d = topo_alloc(sizeof(struct device));
   memset(d, 0, sizeof(*d));
   d->dev = p;
+  d->arena = &topo_arena;
   d->config_cached = d->config_bufsize = 256;
-  d->config = xmalloc(256);
-  d->present = xmalloc(256);
+  d->config = topo_alloc(256);
+  d->present = topo_alloc(256);
   memset(d->present, 1, 256);
 
   if (!pci_read_block(p, 0, d->config, 256)) {
     fprintf(stderr, "adna: Unable to read the standard configuration space header of device %04x:%02x:%02x.%d\n",
             p->domain, p->bus, p->dev, p->func);
     seen_errors++;
-    return NULL;
+    return NULL; // Given back with the rest of the arena
   }
 
   pci_setup_cache(p, d->config, d->config_cached);
@@ -419,6 +1111,27 @@ static void scan_devices(void)
     }
 }
 
+/*! @brief Drops the device forest of the current generation in one go */
+static void free_devices(void)
+{
+  first_dev = NULL;
+  free_tree();
+  dev_index_clear(&topo_index);
+  arena_reset(&topo_arena);
+}
+
+/*! @brief Drops the libpci device list but keeps pacc itself alive */
+static void release_pci_devices(void)
+{
+  struct pci_dev *p, *next;
+
+  for (p=pacc->devices; p; p=next) {
+    next = p->next;
+    pci_free_dev(p);
+  }
+  pacc->devices = NULL;
+}
+
 /*** Config space accesses ***/
 static void check_conf_range(struct device *d, unsigned int pos, unsigned int len)
 {
@@ -1032,9 +1745,15 @@ static void show(void)
         show_verbose(d);
 }
 
+static int adna_pacc_cleanup(void);
+static void recovery_stop(void);
+static void ecam_close(void);
+
 int adna_delete_list(void)
 {
   struct adna_device *a, *b;
+  recovery_stop(); // Finished jobs still point at the ports
+  ecam_close();
   for (a=first_adna;a;a=b) {
     b=a->next;
     free(a->this);
@@ -1042,7 +1761,13 @@ int adna_delete_list(void)
     free(a->hub);
     free(a);
   }
-  return 0;
+  first_adna = NULL;
+  free_adapters();
+  if (uevent_fd >= 0) {
+    close(uevent_fd);
+    uevent_fd = -1;
+  }
+  return adna_pacc_cleanup();
 }
 
 static int save_to_adna_list(void)
@@ -1068,9 +1793,6 @@ static int save_to_adna_list(void)
       pci_filter_parse_id(f, mfg_str);
       a->this = f;
       a->bIsD3 = false;
-      a->link_down_cnt = 0;
-      a->hub_down_cnt = 0;
-      a->link_bad_cnt = 0;
       a->parent = NULL;
       a->hub = NULL;
       if (d->parent_bus->parent_bridge->br_dev != NULL) {
@@ -1083,6 +1805,9 @@ static int save_to_adna_list(void)
         pci_filter_parse_slot(p, bdf_str);
         pci_filter_parse_id(p, mfg_str);
         a->parent = p;
+        a->adapter = get_adapter(parent);
+      } else {
+        a->adapter = get_adapter(NULL);
       }
       if (d->bridge->first_bus->first_dev != NULL) {
         u = xmalloc(sizeof(struct pci_filter));
@@ -1103,37 +1828,48 @@ static int save_to_adna_list(void)
   return 0;
 }
 
-static int refresh_device_cache(struct pci_dev *pdev)
-{
-  /* let's refresh the pcidev details */
-  if (!pdev->cache) {
-    u8 *cache;
-    if ((cache = calloc(1, 256)) == NULL) {
-      fprintf(stderr, "error allocating pci device config cache!\n");
-      exit(-1);
-    }
-    pci_setup_cache(pdev, cache, 256);
-  }
-
-  /* refresh the config block */
-  if (!pci_read_block(pdev, 0, pdev->cache, 256)) {
-    fprintf(stderr, "error reading pci device config!\n");
-    return -1;
-  }
-  return 0;
-}
-
 static int adna_pacc_cleanup(void)
 {
+  if (!pacc)
+    return 0;
+  free_devices();
+  arena_free(&topo_arena);
   show_kernel_cleanup();
   pci_cleanup(pacc);
+  pacc = NULL;
   return 0;
 }
 
-static int adna_pacc_init(void)
+/*! @brief Points libpci's sysfs method at the tree given with --sysfs, if any */
+static void pacc_set_sysfs(struct pci_access *a)
 {
+  char path[256];
+
+  if (AdnaOptions.SysfsRoot[0]) {
+    snprintf(path, sizeof(path), "%s/bus/pci", AdnaOptions.SysfsRoot);
+    pci_set_param(a, "sysfs.path", path);
+  }
+}
+
+static int adna_pacc_init(void)
+{
+  struct adnatool_pci_device *entry;
+  struct pci_id_match *m = adna_scan_ids;
+
+  /* Only our own functions (and bridges, for the tree) are worth a pci_dev */
+  for (entry = adnatool_pci_devtbl; entry->vid != 0; entry++, m++) {
+    m->vendor_id = entry->vid;
+    m->device_id = entry->did;
+    m->device_class = entry->cls_rev;
+  }
+  m->vendor_id = 0;
+
+  arena_init(&topo_arena, ADNA_ARENA_CHUNK);
   pacc = pci_alloc();
   pacc->error = die;
+  pacc->scan_ids = adna_scan_ids;
+  pci_set_param(pacc, "sysfs.fds", ADNA_SYSFS_FDS);
+  pacc_set_sysfs(pacc);
   pci_filter_init(pacc, &filter);
   pci_init(pacc);
   return 0;
@@ -1149,27 +1885,256 @@ void adna_set_init_flag(bool value)
   is_initialized = value;
 }
 
-int adna_pci_process(void)
+unsigned int adna_scan_generation(void)
+{
+  return scan_gen;
+}
+
+/*! @brief Resident set size in kB, 0 if unknown */
+static unsigned long adna_rss_kb(void)
+{
+  unsigned long size, resident = 0;
+  FILE *f;
+
+  if ((f = fopen("/proc/self/statm", "r")) == NULL)
+    return 0;
+  if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+    resident = 0;
+  fclose(f);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*! @brief Prints memory and scan statistics, on SIGUSR1 */
+void adna_print_stats(void)
+{
+  struct adna_device *a;
+
+  adna_log(LOG_INFO, "Stats: generation %u, %d recovery job(s) in flight, RSS %lu kB",
+           scan_gen, jobs_inflight, adna_rss_kb());
+  adna_log(LOG_INFO, "Stats: topology arena %zu/%zu bytes used (peak %zu), %lu allocations"
+           " (%lu total), %lu chunk mallocs, %lu resets",
+           topo_arena.used, topo_arena.reserved, topo_arena.peak, topo_arena.allocs,
+           topo_arena.total_allocs, topo_arena.chunk_allocs, topo_arena.resets);
+  if (pacc)
+    adna_log(LOG_INFO, "Stats: sysfs config fds %lu hits, %lu misses, %lu evictions",
+             pacc->fd_stats.hits, pacc->fd_stats.misses, pacc->fd_stats.evictions);
+  for (a = first_adna; a; a = a->next)
+    adna_log(LOG_INFO, "Stats: %02x:%02x.%d %s, %d flaps (penalty %u), %d throttled, "
+             "%d failed recoveries, %d I/O errors, backoff %ums",
+             a->this->bus, a->this->slot, a->this->func, port_state_names[a->state],
+             a->flap_cnt, a->penalty, a->throttled_cnt, a->fail_cnt, a->io_err_cnt,
+             a->backoff_ms);
+  adna_log(LOG_INFO, "Stats: tick p50 %lluus p99 %lluus max %lluus, "
+           "time to recover p50 %llums p99 %llums max %llums (%llu recoveries)",
+           (unsigned long long)hdr_quantile(&tick_hist, 0.5) / 1000,
+           (unsigned long long)hdr_quantile(&tick_hist, 0.99) / 1000,
+           (unsigned long long)tick_hist.max / 1000,
+           (unsigned long long)(hdr_quantile(&recover_hist, 0.5) / NSEC_PER_MSEC),
+           (unsigned long long)(hdr_quantile(&recover_hist, 0.99) / NSEC_PER_MSEC),
+           (unsigned long long)(recover_hist.max / NSEC_PER_MSEC),
+           (unsigned long long)recover_hist.count);
+}
+
+/* One labelled sample per port; @v reads the value off the port */
+#define METRICS_PORTS(f, name, fmt, v)                                         \
+  do {                                                                         \
+    struct adna_device *a;                                                     \
+    for (a = first_adna; a; a = a->next)                                       \
+      fprintf(f, "%s{port=\"%04x:%02x:%02x.%d\"} " fmt "\n", name,             \
+              a->this->domain, a->this->bus, a->this->slot, a->this->func, v);  \
+  } while (0)
+
+/*! @brief Writes the daemon's counters and latencies in the Prometheus text format */
+static void adna_metrics_render(FILE *f)
+{
+  static const char * const action_names[] = { "rescan", "reenum", "restore", "reset" };
+  struct adna_adapter *ad;
+  struct adna_device *a;
+  unsigned long missed = 0;
+  int i;
+
+  metrics_family(f, "adnacom_hp_port_state", "gauge", "1 for the state the port is in");
+  for (a = first_adna; a; a = a->next)
+    for (i = PORT_ST_DOWN; i <= PORT_ST_DAMPED; i++)
+      fprintf(f, "adnacom_hp_port_state{port=\"%04x:%02x:%02x.%d\",state=\"%s\"} %d\n",
+              a->this->domain, a->this->bus, a->this->slot, a->this->func,
+              port_state_names[i], a->state == (enum port_state)i);
+
+  metrics_family(f, "adnacom_hp_link_up_total", "counter", "Link Down to Up transitions");
+  METRICS_PORTS(f, "adnacom_hp_link_up_total", "%lu", a->link_up_cnt);
+  metrics_family(f, "adnacom_hp_link_down_total", "counter", "Link Up to Down transitions");
+  METRICS_PORTS(f, "adnacom_hp_link_down_total", "%lu", a->link_down_cnt);
+  metrics_family(f, "adnacom_hp_link_bounces_total", "counter",
+                 "Link went Down and back Up between two samples");
+  METRICS_PORTS(f, "adnacom_hp_link_bounces_total", "%lu", a->bounce_cnt);
+  metrics_family(f, "adnacom_hp_link_degraded_total", "counter",
+                 "Link came up below its capable speed or width");
+  METRICS_PORTS(f, "adnacom_hp_link_degraded_total", "%lu", a->degraded_cnt);
+  metrics_family(f, "adnacom_hp_hub_lost_total", "counter", "Devices behind the port disappeared");
+  METRICS_PORTS(f, "adnacom_hp_hub_lost_total", "%lu", a->hub_down_cnt);
+  metrics_family(f, "adnacom_hp_flaps_total", "counter", "Flaps counted towards damping");
+  METRICS_PORTS(f, "adnacom_hp_flaps_total", "%d", a->flap_cnt);
+
+  metrics_family(f, "adnacom_hp_recoveries_total", "counter", "Successful recoveries, by action");
+  for (a = first_adna; a; a = a->next)
+    for (i = ADNA_ACT_RESCAN; i <= ADNA_ACT_RESET; i++)
+      fprintf(f, "adnacom_hp_recoveries_total{port=\"%04x:%02x:%02x.%d\",action=\"%s\"} %lu\n",
+              a->this->domain, a->this->bus, a->this->slot, a->this->func,
+              action_names[i - ADNA_ACT_RESCAN], a->recover_cnt[i]);
+  metrics_family(f, "adnacom_hp_recovery_failures_total", "counter", "Recoveries that failed");
+  METRICS_PORTS(f, "adnacom_hp_recovery_failures_total", "%d", a->fail_cnt);
+  metrics_family(f, "adnacom_hp_port_rescans_total", "counter", "Rescans run to recover the port");
+  METRICS_PORTS(f, "adnacom_hp_port_rescans_total", "%lu", a->rescan_cnt);
+  metrics_family(f, "adnacom_hp_rescans_throttled_total", "counter",
+                 "Recoveries held back by the rescan budget");
+  METRICS_PORTS(f, "adnacom_hp_rescans_throttled_total", "%d", a->throttled_cnt);
+  metrics_family(f, "adnacom_hp_io_errors_total", "counter",
+                 "Failed sysfs accesses during recovery, including retried ones");
+  METRICS_PORTS(f, "adnacom_hp_io_errors_total", "%d", a->io_err_cnt);
+
+  metrics_family(f, "adnacom_hp_rescans_total", "counter", "Rescans run, each covering one or more ports");
+  fprintf(f, "adnacom_hp_rescans_total %lu\n", rescans_total);
+  for (ad = first_adapter; ad; ad = ad->next)
+    missed += ad->tick.missed;
+  metrics_family(f, "adnacom_hp_ticks_missed_total", "counter", "Ticks skipped because one overran");
+  fprintf(f, "adnacom_hp_ticks_missed_total %lu\n", missed);
+
+  metrics_hist(f, "adnacom_hp_tick_duration_seconds", "Time to sample one adapter", &tick_hist);
+  metrics_hist(f, "adnacom_hp_detection_latency_seconds",
+               "Upper bound on the time a link change went unnoticed", &detect_hist);
+  metrics_hist(f, "adnacom_hp_time_to_recover_seconds",
+               "Time from a port leaving Up to being Up again", &recover_hist);
+}
+
+/*! @brief Full enumeration into the persistent pacc and device forest */
+static void adna_enumerate(void)
 {
-  adna_pacc_init();
   scan_devices();
   sort_them();
   grow_tree();
+  if (dev_index_build(&topo_index, &topo_arena, pacc->devices, first_dev) < 0)
+    die("Unable to allocate the device index");
+  scan_gen++;
+}
+
+static void port_bdf(struct adna_device *a, char *bdf, size_t size)
+{
+  snprintf(bdf, size, "%02x:%02x.%d", a->this->bus, a->this->slot, a->this->func);
+}
+
+/*! @brief Points every monitored port at its node in the current forest */
+static void bind_adna_devices(void)
+{
+  struct adna_device *a;
+  bool no_reset;
+  uint32_t reg;
+  char bdf[10];
+
+  for (a = first_adna; a; a = a->next) {
+    if ((a->dev = find_device(a->this)) != NULL)
+      a->dev->NumDevice = a->devnum;
+    if (a->dev) {
+      port_cache_link_info(a);
+      port_probe_mmio(a);
+      /* Its link cannot be read, so it is left alone rather than recovered */
+      if (!a->exp_cap && !a->unmonitored) {
+        port_bdf(a, bdf, sizeof(bdf));
+        adna_log_port(LOG_WARNING, bdf, "has no PCIe capability, not monitoring it");
+      }
+      a->unmonitored = !a->exp_cap;
+      /* Without the switch's registers a long outage is only waited out */
+      reg = port_disable_reg(a);
+      no_reset = a->exp_cap && (!reg || !a->adapter || !plx_bar_mapped(&a->adapter->bar0) ||
+                                !plx_bar_valid(&a->adapter->bar0, reg));
+      if (no_reset && !a->no_reset) {
+        port_bdf(a, bdf, sizeof(bdf));
+        adna_log_port(LOG_INFO, bdf, "cannot be disabled/enabled without the switch's BAR0, waiting out link outages");
+      }
+      a->no_reset = no_reset;
+    } else {
+      /* Nothing to read the link from until the port is enumerated again */
+      a->exp_cap = 0;
+      a->mmio_lnk = 0;
+      a->sampled = false;
+    }
+    if (a->dev && a->dev->bridge) {
+      a->domain = a->dev->dev->domain;
+      a->secondary = a->dev->bridge->secondary;
+      a->subordinate = a->dev->bridge->subordinate;
+    }
+    /*
+     * A port that is in sysfs but not in the forest was caught half way
+     * through being added; leave it looking absent so the next topology
+     * check sees it appear and enumerates again.
+     */
+    a->sysfs_state = a->dev ? port_sysfs_state(a->this) : 0;
+    if (!a->dev && port_is_present(a))
+      topology_check = true;
+    a->children = port_count_children(a);
+  }
+}
+
+int adna_pci_process(void)
+{
+  if (!pacc)
+    adna_pacc_init();
+  adna_enumerate();
 
   if (is_initialized == false) {
     NumDevices = count_downstream();
     if (NumDevices == 0) {
-      printf("No Adnacom device detected.\n");
+      adna_log(LOG_NOTICE, "No Adnacom device detected.");
       return ENODEV;
     }
     save_to_adna_list();
+    bind_adna_devices();
     show();
-    adna_pacc_cleanup();
   }
 
   return 0;
 }
 
+/*! @brief Brings the persistent device forest up to date
+ *
+ * The pci_access and the device forest live for the whole daemon lifetime.
+ * They are only rebuilt after a remove/rescan, or when a monitored port
+ * appeared, vanished or gained/lost children since the last refresh. With
+ * uevents those changes are pushed by the kernel; without them each port's
+ * sysfs directory is probed instead, but only after a sample saw a change,
+ * and otherwise once every ADNA_SLOW_MS to catch changes made by others.
+ */
+int adna_pci_refresh(void)
+{
+  struct adna_device *a;
+  uint64_t now = ev_now();
+
+  if (!pacc)
+    return adna_pci_process();
+
+  if (!topology_stale && uevent_fd < 0 &&
+      (topology_check || now - topology_checked_at >= ADNA_SLOW_MS * NSEC_PER_MSEC)) {
+    topology_check = false;
+    topology_checked_at = now;
+    for (a = first_adna; a; a = a->next) {
+      if (port_sysfs_state(a->this) != a->sysfs_state) {
+        topology_stale = true;
+        break;
+      }
+    }
+  }
+  if (!topology_stale)
+    return 0;
+
+  free_devices();
+  release_pci_devices();
+  adna_enumerate();
+  revalidate_adapters();
+  bind_adna_devices();
+  topology_stale = false;
+  adna_log(LOG_DEBUG, "Topology changed, re-enumerated (generation %u)", scan_gen);
+  return 0;
+}
+
 void adna_set_d3_flag(int devnum)
 {
   struct adna_device *a;
@@ -1223,107 +2188,974 @@ static int adna_d3_to_d0(void)
   return status;
 }
 #endif
-/*! @brief 100ms timer */
-static void settimer100ms(void)
+
+/*! @brief Verbose dump of a port, read through the calling thread's own pacc */
+static void dump_port(struct pci_filter *f)
+{
+  struct pci_dev *p = pci_get_dev(pacc, f->domain, f->bus, f->slot, f->func);
+  struct device d;
+
+  memset(&d, 0, sizeof(d));
+  d.dev = p;
+  d.config_cached = d.config_bufsize = 256;
+  d.config = xmalloc(256);
+  d.present = xmalloc(256);
+  memset(d.present, 1, 256);
+  if (pci_read_block(p, 0, d.config, 256)) {
+    pci_fill_info(p, PCI_FILL_IDENT | PCI_FILL_CLASS);
+    flockfile(stdout); // Keep the dump in one piece
+    show_verbose(&d);
+    funlockfile(stdout);
+  }
+  free(d.config);
+  free(d.present);
+  pci_free_dev(p);
+}
+
+/*! @brief Runs a recovery job; called on a worker thread
+ *
+ * All ports of the job first have their stale subtrees removed, then one
+ * rescan covers them all, then each port is checked for what it should
+ * have gained. The ports share the rescan timeout.
+ */
+static void adna_job_run(struct wq_job *wq)
+{
+  struct adna_job *j = (struct adna_job *)wq;
+  struct adna_job_port *p;
+  uint64_t deadline, now;
+  int i, err, io_errors = 0;
+  char bdf[10];
+
+  if (j->ports[0].action == ADNA_ACT_RESET) {
+    struct timespec hold = { 0, ADNA_RESET_HOLD_MS * NSEC_PER_MSEC };
+
+    p = &j->ports[0];
+    port_bdf(p->a, bdf, sizeof(bdf));
+    if (!disable_port(j->bar, j->reg)) {
+      p->err = -EIO;
+      p->io_errors++;
+      enable_port(j->bar, j->reg); // Whatever did get written
+      return;
+    }
+    /* The link must see the disable, a back-to-back write could be missed */
+    while (nanosleep(&hold, &hold) < 0 && errno == EINTR)
+      ;
+    if (!enable_port(j->bar, j->reg)) {
+      p->err = -EIO;
+      p->io_errors++;
+      return;
+    }
+    if (!(p->ok = wait_for_port(p->a, port_link_active, ADNA_RESCAN_TIMEOUT_MS)))
+      adna_log_port(LOG_WARNING, bdf, "link did not come back after disabling/enabling the port");
+    return;
+  }
+
+  for (i = 0; i < j->count; i++) {
+    p = &j->ports[i];
+    if (p->action == ADNA_ACT_REENUM || p->action == ADNA_ACT_RESTORE)
+      p->err = remove_downstream(p);
+  }
+
+  /* The ports are kept, so a lone one only needs its own bus rescanned */
+  if (j->count == 1)
+    err = rescan_port(&j->ports[0]);
+  else
+    err = rescan_bridge(j->ancestor, &io_errors);
+
+  deadline = ev_now() + ADNA_RESCAN_TIMEOUT_MS * NSEC_PER_MSEC;
+  for (i = 0; i < j->count; i++) {
+    p = &j->ports[i];
+    p->io_errors += io_errors;
+    if (!p->err)
+      p->err = err;
+    if (p->err)
+      continue;
+    port_bdf(p->a, bdf, sizeof(bdf));
+    now = ev_now();
+    if (p->action == ADNA_ACT_RESTORE) {
+      if (!(p->ok = wait_for_port(p->a, port_is_present, now < deadline ? (deadline - now) / NSEC_PER_MSEC : 0)))
+        adna_log_port(LOG_WARNING, bdf, "did not come back after rescan");
+    } else {
+      if (!(p->ok = wait_for_port(p->a, port_has_hub, now < deadline ? (deadline - now) / NSEC_PER_MSEC : 0)))
+        adna_log_port(LOG_WARNING, bdf, "nothing enumerated behind the port after rescan");
+      else
+        dump_port(p->a->this);
+    }
+  }
+  fflush(stdout);
+}
+
+/*! @brief Accounts for a recovery that ran, pushing the next attempt out if it failed */
+static void adna_job_result(struct adna_job_port *p)
 {
-    struct itimerval new_timer;
-    struct itimerval old_timer;
+  struct adna_device *a = p->a;
+  char bdf[10];
 
-    new_timer.it_value.tv_sec = 1;
-    new_timer.it_value.tv_usec = 0;
-    new_timer.it_interval.tv_sec = 0;
-    new_timer.it_interval.tv_usec = 100 * 1000;
+  a->io_err_cnt += p->io_errors;
+  if (p->action != ADNA_ACT_RESET)
+    a->rescan_cnt++;
+  if (p->ok) {
+    a->recover_cnt[p->action]++;
+    summary.recoveries++;
+    a->backoff_ms = 0;
+    a->retry_at = 0;
+    return;
+  }
+  a->fail_cnt++;
+  if (!a->backoff_ms)
+    a->backoff_ms = ADNA_RETRY_MIN_MS;
+  else if (a->backoff_ms < ADNA_RETRY_MAX_MS / 2)
+    a->backoff_ms *= 2;
+  else
+    a->backoff_ms = ADNA_RETRY_MAX_MS;
+  a->retry_at = ev_now() + (uint64_t)a->backoff_ms * NSEC_PER_MSEC;
+  summary.failures++;
+  port_bdf(a, bdf, sizeof(bdf));
+  adna_log_port(LOG_WARNING, bdf, "recovery failed%s%s, retrying in %ums (%d failures)",
+                p->err ? ": " : "", p->err ? strerror(-p->err) : "", a->backoff_ms, a->fail_cnt);
+}
+
+/*! @brief Back on the sampler: the job's ports may be acted on again */
+static void adna_job_done(struct adna_job *j)
+{
+  struct adna_device *a;
+  int i;
 
-    setitimer(ITIMER_REAL, &new_timer, &old_timer);
-    signal(SIGALRM, adna_timer_callback);
+  jobs_inflight--;
+  for (i = 0; i < j->count; i++) {
+    a = j->ports[i].a;
+    a->busy = false;
+    if (j->wq.status == 0) {
+      adna_job_result(&j->ports[i]);
+      topology_stale = true;
+      adapter_schedule(a->adapter, true);
+    }
+  }
+  free(j);
 }
 
-/*! @brief Stop timer */
-static void stoptimer(void)
+static void adna_recovery_handler(int fd, uint32_t events, void *data)
 {
-    struct itimerval new_timer;
-    struct itimerval old_timer;
+  struct wq_job *wq, *next;
+  (void)(fd);
+  (void)(events);
+  (void)(data);
+
+  for (wq = wq_reap(&recovery); wq; wq = next) {
+    next = wq->next;
+    adna_job_done((struct adna_job *)wq);
+  }
+}
 
-    new_timer.it_value.tv_sec = 0;
-    new_timer.it_value.tv_usec = 0;
-    new_timer.it_interval.tv_sec = 0;
-    new_timer.it_interval.tv_usec = 0;
+/* 2^(-i/16) in 16.16 fixed point, for the fractional part of a decay */
+static const uint32_t decay_frac[16] = {
+  65536, 62757, 60097, 57549, 55109, 52773, 50535, 48393,
+  46341, 44376, 42495, 40693, 38968, 37316, 35734, 34219,
+};
 
-    setitimer(ITIMER_REAL, &new_timer, &old_timer);
+/*! @brief Brings the port's flap penalty up to @now, halving it every half-life */
+static void port_decay_penalty(struct adna_device *a, uint64_t now)
+{
+  uint64_t hl = opt_ms(AdnaOptions.FlapHalfLifeMs, ADNA_FLAP_HALF_LIFE_MS);
+  uint64_t dt = now - a->penalty_at;
+  uint64_t halvings = dt / hl;
+
+  if (!a->penalty || dt < hl / 16) {
+    if (!a->penalty)
+      a->penalty_at = now;
+    return; /* Keep the remainder for the next sample */
+  }
+  if (halvings >= 32) {
+    a->penalty = 0;
+  } else {
+    a->penalty >>= halvings;
+    a->penalty = ((uint64_t)a->penalty * decay_frac[(dt % hl) * 16 / hl]) >> 16;
+  }
+  a->penalty_at = now;
 }
 
-void adna_timer_callback(int signum)
+/*! @brief Charges a flap to the port and updates whether it is damped
+ *
+ * Crossing the suppress threshold damps the port, and it stays damped
+ * until the penalty has decayed below the reuse threshold, so a link
+ * bouncing around the threshold does not toggle between the two.
+ */
+static void port_update_damping(struct adna_device *a, bool flapped, uint64_t now, const char *bdf)
+{
+  unsigned int suppress = opt_uint(AdnaOptions.FlapSuppress, ADNA_FLAP_SUPPRESS);
+  unsigned int reuse = opt_uint(AdnaOptions.FlapReuse, ADNA_FLAP_REUSE);
+  unsigned int ceiling = reuse << ADNA_FLAP_MAX_HALVINGS;
+
+  if (ceiling <= suppress)
+    ceiling = suppress + ADNA_FLAP_PENALTY; /* Still reachable with odd thresholds */
+  port_decay_penalty(a, now);
+  if (flapped) {
+    a->flap_cnt++;
+    summary.flaps++;
+    a->penalty += ADNA_FLAP_PENALTY;
+    if (a->penalty > ceiling)
+      a->penalty = ceiling;
+  }
+  if (!a->damped && a->penalty > suppress) {
+    a->damped = true;
+    adna_log_port(LOG_WARNING, bdf, "is flapping (%d flaps, penalty %u), suspending recovery",
+                  a->flap_cnt, a->penalty);
+  } else if (a->damped && a->penalty < reuse) {
+    a->damped = false;
+    adna_log_port(LOG_NOTICE, bdf, "has calmed down (penalty %u), resuming recovery", a->penalty);
+  }
+}
+
+/* Rescan budget shared by all ports: credit accrues with time, one rescan costs one period */
+static uint64_t rescan_credit, rescan_credit_at;
+
+/*! @brief Takes a rescan token from the global bucket; false if it is empty */
+static bool rescan_token_take(void)
+{
+  uint64_t period = 60000ULL * NSEC_PER_MSEC / opt_uint(AdnaOptions.RescanPerMin, ADNA_RESCAN_PER_MIN);
+  uint64_t cap = period * opt_uint(AdnaOptions.RescanBurst, ADNA_RESCAN_BURST);
+  uint64_t now = ev_now();
+
+  if (!rescan_credit_at)
+    rescan_credit = cap;
+  else
+    rescan_credit += now - rescan_credit_at;
+  if (rescan_credit > cap)
+    rescan_credit = cap;
+  rescan_credit_at = now;
+  if (rescan_credit < period)
+    return false;
+  rescan_credit -= period;
+  return true;
+}
+
+/*! @brief Gives back a token that was not used after all */
+static void rescan_token_return(void)
+{
+  rescan_credit += 60000ULL * NSEC_PER_MSEC / opt_uint(AdnaOptions.RescanPerMin, ADNA_RESCAN_PER_MIN);
+}
+
+static struct adna_job *job_alloc(int count)
+{
+  struct adna_job *j = xmalloc(sizeof(struct adna_job) + count * sizeof(struct adna_job_port));
+
+  memset(j, 0, sizeof(struct adna_job) + count * sizeof(struct adna_job_port));
+  j->count = count;
+  return j;
+}
+
+/*! @brief Hands @j to the worker that owns @ad
+ *
+ * All jobs of an adapter go to the same worker, so actions on one switch
+ * never overlap. Without workers the job runs right here. Returns false
+ * if the worker's queue is full; @j is then still the caller's.
+ */
+static bool adna_submit(struct adna_job *j, struct adna_adapter *ad)
+{
+  jobs_inflight++;
+  if (!recovery_running) {
+    adna_job_run(&j->wq);
+    adna_job_done(j);
+    return true;
+  }
+  if (wq_submit(&recovery, &j->wq, ad->id) < 0) {
+    jobs_inflight--;
+    return false;
+  }
+  return true;
+}
+
+/*! @brief Disables/enables the port in the switch; false if that could not be started */
+static bool adna_reset_port(struct adna_device *a)
+{
+  struct adna_job *j = job_alloc(1);
+
+  j->ports[0].a = a;
+  j->ports[0].action = ADNA_ACT_RESET;
+  j->reg = port_disable_reg(a);
+  if ((j->bar = adapter_bar(a->adapter, j->reg)) == NULL) {
+    /* No switch registers to reset the port with; back off as for a failed job */
+    j->ports[0].err = -errno;
+    j->ports[0].io_errors = 1;
+    adna_job_result(&j->ports[0]);
+    free(j);
+    return false;
+  }
+  a->busy = true;
+  if (!adna_submit(j, a->adapter)) {
+    a->busy = false;
+    free(j);
+    return false;
+  }
+  return true;
+}
+
+/*! @brief Queues a rescanning action for @a in its adapter's settle window
+ *
+ * The first port queued opens the window; whatever else the adapter's
+ * ports need until it closes goes into the same job.
+ */
+static void port_queue(struct adna_device *a, enum adna_action action, uint64_t now)
+{
+  a->busy = true;
+  a->queued = true;
+  a->queued_action = action;
+  if (!a->adapter->settle_until)
+    a->adapter->settle_until = now + ADNA_SETTLE_MS * NSEC_PER_MSEC;
+}
+
+/*! @brief Decides again what a queued port needs, from a fresh look at its link
+ *
+ * A port may wait in the queue for many ticks when the rescan budget is
+ * exhausted, and its link can come back or drop meanwhile. Returns false
+ * if it needs nothing any more; @action is updated otherwise.
+ */
+static bool port_requeue(struct adna_device *a, enum adna_action *action)
+{
+  bool is_linkup, is_hubup = a->children > 0;
+
+  is_linkup = (port_read_lnksta(a) & PCI_EXP_LNKSTA_DL_ACT) == PCI_EXP_LNKSTA_DL_ACT;
+  if (!is_linkup && !is_hubup)
+    return false; // Nothing to rescan, the Down handling takes over
+  if (!is_linkup)
+    *action = ADNA_ACT_RESTORE;
+  else if (!is_hubup)
+    *action = ADNA_ACT_RESCAN;
+  else if (*action == ADNA_ACT_RESCAN)
+    return false; // The kernel found the devices by itself
+  else
+    *action = ADNA_ACT_REENUM; // What was there before the link came back is stale
+  return true;
+}
+
+static bool filter_same_dev(struct pci_filter *x, struct pci_filter *y)
+{
+  return x && y && x->domain == y->domain && x->bus == y->bus &&
+         x->slot == y->slot && x->func == y->func;
+}
+
+/*! @brief Starts one job for all ports of @ad queued in the settle window
+ *
+ * The job rescans below the upstream bridge the ports share (for ports of
+ * one adapter, the switch's upstream port) and needs a single token from
+ * the global rescan bucket. If no token is left or the worker is busy,
+ * the ports stay queued for the next tick. Once there is a token, each
+ * port's action is decided again from its link as it is now.
+ */
+static void adapter_flush(struct adna_adapter *ad, uint64_t now)
 {
-  (void)(signum);
   struct adna_device *a;
+  struct adna_job *j;
+  char bdf[10];
+  int n = 0;
+
+  if (!ad->settle_until || now < ad->settle_until)
+    return;
+  for (a = first_adna; a; a = a->next)
+    if (a->adapter == ad && a->queued)
+      n++;
+  if (!n) {
+    ad->settle_until = 0;
+    return;
+  }
+
+  if (!rescan_token_take()) {
+    for (a = first_adna; a; a = a->next)
+      if (a->adapter == ad && a->queued) {
+        port_bdf(a, bdf, sizeof(bdf));
+        /* Only the first time, then it is in the summary */
+        adna_log_port(a->throttled_cnt++ ? LOG_DEBUG : LOG_WARNING, bdf,
+                      "rescan budget exhausted, waiting");
+      }
+    return;
+  }
+
+  j = job_alloc(n);
+  n = 0;
+  for (a = first_adna; a; a = a->next) {
+    if (a->adapter != ad || !a->queued)
+      continue;
+    /* A port removed while it waited is picked up again by bind_adna_devices() */
+    if (!a->dev || a->unmonitored || !port_requeue(a, &a->queued_action)) {
+      port_bdf(a, bdf, sizeof(bdf));
+      adna_log_port(LOG_INFO, bdf, a->dev ? "no longer needs a rescan" : "is gone, not rescanning it");
+      a->queued = false;
+      a->busy = false;
+      continue;
+    }
+    j->ports[n].a = a;
+    j->ports[n].action = a->queued_action;
+    if (!n)
+      j->ancestor = a->parent;
+    else if (!filter_same_dev(j->ancestor, a->parent))
+      j->ancestor = NULL;
+    n++;
+  }
+  if (!n) {
+    rescan_token_return();
+    free(j);
+    ad->settle_until = 0;
+    return;
+  }
+  j->count = n;
+  if (n > 1)
+    adna_log(LOG_INFO, "Recovering %d ports with one rescan", n);
+
+  if (!adna_submit(j, ad)) {
+    rescan_token_return();
+    free(j);
+    return;
+  }
+  rescans_total++;
+  /* The job owns the ports now; the adapter may open a new window */
+  for (a = first_adna; a; a = a->next)
+    if (a->adapter == ad)
+      a->queued = false;
+  ad->settle_until = 0;
+}
+
+static void adna_worker_init(int id)
+{
+  (void)(id);
+  pacc = pci_alloc();
+  pacc->error = die;
+  pacc_set_sysfs(pacc);
+  pci_init(pacc);
+}
+
+static void adna_worker_fini(int id)
+{
+  (void)(id);
+  pci_cleanup(pacc);
+  pacc = NULL;
+}
+
+/*! @brief Looks up every port in memory-mapped config space
+ *
+ * A port is only read there if its vendor/device ID matches what sysfs
+ * reports, so a window that is missing or mapped wrongly falls back to
+ * sysfs port by port. Writes always go through pacc.
+ */
+static char ecam_problem[128]; /* First warning from the ECAM method */
+
+static void PCI_PRINTF(1,2) ecam_warning(char *msg, ...)
+{
+  va_list args;
+
+  if (ecam_problem[0])
+    return;
+  va_start(args, msg);
+  vsnprintf(ecam_problem, sizeof(ecam_problem), msg, args);
+  va_end(args);
+}
+
+static void ecam_open(void)
+{
+  struct adna_device *a;
+  struct pci_dev *p;
+  int found = 0;
+
+  ecam_problem[0] = 0;
+  ecam_pacc = pci_alloc();
+  ecam_pacc->error = die;
+  ecam_pacc->warning = ecam_warning; // No MCFG or no /dev/mem is not fatal
+  ecam_pacc->method = PCI_ACCESS_ECAM;
+  if (AdnaOptions.EcamPath[0]) {
+    pci_set_param(ecam_pacc, "ecam.path", AdnaOptions.EcamPath);
+    pci_set_param(ecam_pacc, "ecam.mcfg", "");
+  }
+  pci_init(ecam_pacc);
+
+  for (a = first_adna; a; a = a->next) {
+    if (!a->dev)
+      continue;
+    p = pci_get_dev(ecam_pacc, a->this->domain, a->this->bus, a->this->slot, a->this->func);
+    if (pci_read_word(p, PCI_VENDOR_ID) == a->dev->dev->vendor_id &&
+        pci_read_word(p, PCI_DEVICE_ID) == a->dev->dev->device_id) {
+      a->ecam = p;
+      found++;
+    } else {
+      pci_free_dev(p);
+    }
+  }
+  if (!found) {
+    adna_log(LOG_WARNING, "ECAM unusable (%s), sampling through sysfs",
+             ecam_problem[0] ? ecam_problem : "no port found");
+    pci_cleanup(ecam_pacc);
+    ecam_pacc = NULL;
+    return;
+  }
+  if (ecam_problem[0])
+    adna_log(LOG_WARNING, "ECAM: %s", ecam_problem);
+  adna_log(LOG_INFO, "Sampling %d port(s) through ECAM", found);
+}
+
+static void ecam_close(void)
+{
+  struct adna_device *a;
+
+  if (!ecam_pacc)
+    return;
+  for (a = first_adna; a; a = a->next)
+    if (a->ecam) {
+      pci_free_dev(a->ecam);
+      a->ecam = NULL;
+    }
+  pci_cleanup(ecam_pacc);
+  ecam_pacc = NULL;
+}
+
+/*! @brief Joins the workers and drops jobs they did not get to */
+static void recovery_stop(void)
+{
+  struct wq_job *wq, *next;
+
+  if (!recovery_running)
+    return;
+  recovery_running = false;
+  for (wq = wq_pool_stop(&recovery); wq; wq = next) {
+    next = wq->next;
+    adna_job_done((struct adna_job *)wq);
+  }
+}
+
+/*! @brief Moves the port to @st, noting when it got there */
+static void port_set_state(struct adna_device *a, enum port_state st, uint64_t now, const char *bdf)
+{
+  if (a->state == st && a->state_since)
+    return;
+  if (a->state_since)
+    adna_log_port(LOG_INFO, bdf, "%s -> %s", port_state_names[a->state], port_state_names[st]);
+  if (a->state == PORT_ST_UP && st != PORT_ST_UP && !a->up_lost_at)
+    a->up_lost_at = now;
+  if (st == PORT_ST_UP && a->up_lost_at) {
+    hdr_record(&recover_hist, now - a->up_lost_at);
+    a->up_lost_at = 0;
+  }
+  a->state = st;
+  a->state_since = now;
+}
+
+/*! @brief Brings the adapter's records in the status page up to date with the last sample */
+static void status_publish(struct adna_adapter *ad)
+{
+  struct status_adapter *sa;
+  struct status_port *sp;
+  struct adna_device *a;
+  int i;
+
+  if (!status_page || ad->id >= STATUS_MAX_ADAPTERS)
+    return;
+  sa = &status_page->adapters[ad->id];
+  status_write_begin(&sa->seq);
+  sa->interval_us = ad->interval / 1000;
+  status_write_end(&sa->seq);
+
+  for (a = first_adna; a; a = a->next) {
+    if (a->adapter != ad || a->bIsD3 || (sp = a->status) == NULL)
+      continue;
+    status_write_begin(&sp->seq);
+    snprintf(sp->state, sizeof(sp->state), "%s", port_state_names[a->state]);
+    sp->link_up = a->was_linkup;
+    sp->hub_up = a->was_hubup;
+    sp->damped = a->damped;
+    sp->speed = a->was_linkup ? a->lnksta & PCI_EXP_LNKSTA_SPEED : 0;
+    sp->width = a->was_linkup ? (a->lnksta & PCI_EXP_LNKSTA_WIDTH) >> 4 : 0;
+    sp->state_since = a->state_since;
+    sp->sampled_at = a->sampled_at;
+    sp->link_up_cnt = a->link_up_cnt;
+    sp->link_down_cnt = a->link_down_cnt;
+    sp->bounce_cnt = a->bounce_cnt;
+    sp->flap_cnt = a->flap_cnt;
+    sp->recover_cnt = 0;
+    for (i = ADNA_ACT_RESCAN; i <= ADNA_ACT_RESET; i++)
+      sp->recover_cnt += a->recover_cnt[i];
+    sp->fail_cnt = a->fail_cnt;
+    sp->io_err_cnt = a->io_err_cnt;
+    status_write_end(&sp->seq);
+  }
+}
+
+/*! @brief Creates the status page and fills in what does not change after discovery */
+static void status_start(void)
+{
+  struct adna_adapter *ad;
+  struct adna_device *a;
+  unsigned int nadapters = 0, nports = 0;
+
+  if ((status_page = status_create()) == NULL) {
+    adna_log(LOG_WARNING, "No shared status page (%s)", strerror(errno));
+    return;
+  }
+  for (ad = first_adapter; ad; ad = ad->next)
+    if (ad->id < STATUS_MAX_ADAPTERS) {
+      if (ad->us)
+        snprintf(status_page->adapters[ad->id].bdf, sizeof(status_page->adapters[0].bdf),
+                 "%04x:%02x:%02x.%d", ad->us->domain, ad->us->bus, ad->us->slot, ad->us->func);
+      else // Ports without an upstream switch port, see get_adapter()
+        strcpy(status_page->adapters[ad->id].bdf, "-");
+      if ((unsigned int)ad->id >= nadapters)
+        nadapters = ad->id + 1;
+    }
+  for (a = first_adna; a; a = a->next) {
+    if (!a->adapter || a->adapter->id >= STATUS_MAX_ADAPTERS || nports >= STATUS_MAX_PORTS)
+      continue;
+    a->status = &status_page->ports[nports++];
+    snprintf(a->status->bdf, sizeof(a->status->bdf), "%04x:%02x:%02x.%d",
+             a->this->domain, a->this->bus, a->this->slot, a->this->func);
+    a->status->adapter = a->adapter->id;
+    a->status->cap_speed = a->lnkcap & PCI_EXP_LNKCAP_SPEED;
+    a->status->cap_width = (a->lnkcap & PCI_EXP_LNKCAP_WIDTH) >> 4;
+    snprintf(a->status->state, sizeof(a->status->state), "%s",
+             a->bIsD3 ? "Skipped" : port_state_names[a->state]);
+    status_page->adapters[a->adapter->id].nports++;
+  }
+  status_write_begin(&status_page->seq);
+  status_page->nadapters = nadapters;
+  status_page->nports = nports;
+  status_write_end(&status_page->seq);
+}
+
+/*! @brief Samples one downstream port and recovers it if needed
+ *
+ * The sample decides the port's state:
+ * - Recovering while a job for it is in flight, Damped while its flap
+ *   penalty is high; nothing is started in either.
+ * - Up when the link is up and devices are enumerated behind it.
+ * - Training when the link is up but the devices are missing or stale;
+ *   once the link has stayed up for ADNA_TRAIN_MS they are (re)scanned.
+ * - Down otherwise; stale devices are removed, and a port down for
+ *   ADNA_DOWN_RESET_MS is disabled/enabled in the switch, if its BAR0
+ *   can be used for that.
+ *
+ * Returns true if the port's link or enumeration state changed since the
+ * previous sample. Only changes are reported, as an adapter in a burst is
+ * sampled every few milliseconds.
+ */
+static bool adna_check_port(struct adna_device *a)
+{
   struct device *d;
-  int status;
+  bool is_linkup, is_hubup, changed, bounced = false, flapped;
+  enum port_state st;
+  int link_state;
+  uint16_t lnksta, latched;
+  uint64_t now = ev_now();
   char bdf[10];
-  static bool is_linkup = false;
-  static bool is_hubup = false;
-  static int link_state;
-  first_dev = NULL;
 
-  status = adna_pci_process(); // Rescan all PCIe, add Adnacom device to the new lspci device list.
-  if (status != EXIT_SUCCESS)
-    exit(status);
+  if (a->bIsD3 || (d = a->dev) == NULL || a->unmonitored)
+    return false;
+  snprintf(bdf, sizeof(bdf), "%02x:%02x.%d", a->this->bus, a->this->slot, a->this->func);
+
+  lnksta = a->lnksta = port_read_lnksta(a);
+  is_linkup = (lnksta & PCI_EXP_LNKSTA_DL_ACT) == PCI_EXP_LNKSTA_DL_ACT;
+  link_state = link_quality(a->lnkcap, lnksta);
+  latched = port_read_latches(a);
+  is_hubup = a->children > 0;
+
+  changed = !a->seen || is_linkup != a->was_linkup || is_hubup != a->was_hubup ||
+            link_state != a->was_quality;
+  /* Latches left over from before we started say nothing about this run */
+  if (latched && a->seen) {
+    /* Up now and Up at the last sample, yet the link changed in between */
+    bounced = is_linkup && a->was_linkup;
+    if (bounced)
+      a->bounce_cnt++;
+    adna_log_port(bounced ? LOG_WARNING : LOG_DEBUG, bdf,
+                  "link %s since the last sample (SLTSTA 0x%04x, %d DLL / %d presence changes)",
+                  bounced ? "bounced" : "changed", latched, a->dllsc_cnt, a->pdc_cnt);
+    changed = true;
+  }
+  if (changed) {
+    adna_log_port(LOG_NOTICE, bdf, "downstream port link is %s%s", is_linkup ? "Up" : "Down",
+                  !a->seen ? "" : is_linkup != a->was_linkup ?
+                  (is_linkup ? ", was Down previously" : ", was Up previously") : "");
+    if (a->seen && a->was_linkup && !is_linkup)
+      a->link_down_cnt++;
+    if (a->seen && !a->was_linkup && is_linkup)
+      a->link_up_cnt++;
+    if (a->seen && a->was_hubup && !is_hubup)
+      a->hub_down_cnt++;
+    if (is_linkup && link_state != IDEAL && (link_state != a->was_quality || !a->was_linkup))
+      a->degraded_cnt++;
+    if (a->seen)
+      hdr_record(&detect_hist, now - a->sampled_at);
+  }
+  flapped = bounced || (a->seen && a->was_linkup && !is_linkup);
+  a->seen = true;
+  a->was_linkup = is_linkup;
+  a->was_hubup = is_hubup;
+  a->was_quality = link_state;
+  a->sampled_at = now;
+
+  if (is_linkup || is_hubup)
+    a->down_since = 0;
+  /* Whatever was behind a bounced link has lost its configuration */
+  if (bounced && is_hubup)
+    a->need_reenum = true;
+  if (!is_hubup)
+    a->need_reenum = false;
+  port_update_damping(a, flapped, now, bdf);
+
+  if (a->busy)
+    st = PORT_ST_RECOVERING;
+  else if (a->damped)
+    st = PORT_ST_DAMPED;
+  else if (is_linkup && is_hubup && !a->need_reenum)
+    st = PORT_ST_UP;
+  else if (is_linkup)
+    st = PORT_ST_TRAINING;
+  else
+    st = PORT_ST_DOWN;
+  if (bounced)
+    a->state_since = 0; /* Training starts over */
+  port_set_state(a, st, now, bdf);
+
+  if (st == PORT_ST_RECOVERING || st == PORT_ST_DAMPED || st == PORT_ST_UP)
+    return changed;
+  if (a->retry_at && now < a->retry_at)
+    return changed; /* The last attempt failed, back off */
+
+  if (st == PORT_ST_TRAINING) {
+    if (now - a->state_since >= ADNA_TRAIN_MS * NSEC_PER_MSEC) {
+      port_queue(a, is_hubup ? ADNA_ACT_REENUM : ADNA_ACT_RESCAN, now);
+      a->need_reenum = false;
+      changed = true;
+    }
+  } else if (is_hubup) {
+    port_queue(a, ADNA_ACT_RESTORE, now);
+    changed = true;
+  } else if (!a->down_since) {
+    a->down_since = now;
+  } else if (!a->no_reset && now - a->down_since >= ADNA_DOWN_RESET_MS * NSEC_PER_MSEC) {
+    adna_log_port(LOG_NOTICE, bdf, "has been Down for %ums, disabling/enabling port", ADNA_DOWN_RESET_MS);
+    a->down_since = 0;
+    adna_reset_port(a);
+    changed = true;
+  }
+  return changed;
+}
+
+/*! @brief Reads the link registers of all config-space sampled ports at once
+ *
+ * Ports whose link registers are mirrored in BAR0 are skipped. For the rest,
+ * LNKSTA (and SLTSTA if the port has a slot) come from a single read per
+ * port, and all reads of the tick go to libpci as one batch.
+ */
+static void adna_sample_ports(struct adna_adapter *ad)
+{
+  static struct pci_read_req *reqs;
+  static int reqs_size;
+  struct adna_device *a;
+  int n = 0, i;
 
-  for (a = first_adna; a; a=a->next) { // This is the list of all Adnacom downstream devices (listed during init)
-    snprintf(bdf, sizeof(bdf), "%02x:%02x.%d", a->this->bus, a->this->slot, a->this->func);
-    if (a->bIsD3) {
-      printf("%s is not Hotplug capable. Skipping device.\n", bdf);
+  for (a = first_adna; a; a = a->next) {
+    a->sampled = false;
+    if (a->adapter != ad || a->bIsD3 || !a->dev || !a->exp_cap || a->mmio_lnk)
       continue;
+    if (a->ecam) {
+      /* Plain loads, nothing to batch */
+      a->sampled = pci_read_block(a->ecam, a->exp_cap + PCI_EXP_LNKCTL, a->sample,
+                                  a->has_slot ? (int)sizeof(a->sample) : PCI_EXP_LNKSTA + 2 - PCI_EXP_LNKCTL);
+      continue;
+    }
+    if (n == reqs_size) {
+      reqs_size = reqs_size ? 2 * reqs_size : 8;
+      reqs = xrealloc(reqs, reqs_size * sizeof(*reqs));
     }
+    reqs[n].dev = a->dev->dev;
+    reqs[n].pos = a->exp_cap + PCI_EXP_LNKCTL;
+    reqs[n].len = a->has_slot ? (int)sizeof(a->sample) : PCI_EXP_LNKSTA + 2 - PCI_EXP_LNKCTL;
+    reqs[n].buf = a->sample;
+    n++;
+  }
+  if (!n)
+    return;
 
-    for (d = first_dev; d; d = d->next) {
-      if (pci_filter_match(a->this, d->dev)) {
-        refresh_device_cache(d->dev);
-        is_linkup = pci_dl_active(d->dev);
-        is_hubup = pci_is_hub_alive(d);
-        printf("%s downstream port link is %s", bdf, is_linkup ? "Up" : "Down");
+  pci_read_batch(pacc, reqs, n);
+  for (i = 0, a = first_adna; a; a = a->next)
+    if (i < n && reqs[i].buf == a->sample && !a->ecam)
+      a->sampled = reqs[i++].result > 0;
+}
 
-        if (!is_linkup) {
-          a->link_down_cnt++;
-        }
+/*! @brief One monitoring pass over the downstream ports of one adapter */
+static void adna_monitor_tick(struct ev_timer *t, void *data)
+{
+  struct adna_adapter *ad = data;
+  struct adna_device *a;
+  bool changed = false;
+  uint64_t start = ev_now();
+  int status;
+  (void)(t);
 
-        if (!is_hubup) {
-          a->hub_down_cnt++;
-        }
+  /* Workers still use the current forest and BAR mappings */
+  if (!jobs_inflight) {
+    status = adna_pci_refresh(); // Re-enumerate only if the topology changed
+    if (status != EXIT_SUCCESS)
+      exit(status);
+  }
+
+  adna_sample_ports(ad);
+  for (a = first_adna; a; a = a->next) { // This is the list of all Adnacom downstream devices (listed during init)
+    if (a->adapter == ad && adna_check_port(a))
+      changed = true;
+    a->sampled = false;
+  }
+  if (changed)
+    topology_check = true;
+  adapter_flush(ad, ev_now());
+
+  adapter_schedule(ad, changed);
+  status_publish(ad);
+  fflush(stdout);
+  hdr_record(&tick_hist, ev_now() - start);
+}
 
-        link_state = pci_check_link_cap(d->dev);
-        (void)(link_state);
-
-        if (is_linkup && !is_hubup) {
-          printf(", was Down previously\n");
-          stoptimer();
-          rescan_pci();
-          sleep(1);
-          settimer100ms();
-          show_verbose(d);
-        } else if (!is_linkup && is_hubup) {
-          printf(", was Up previously\n");
-          stoptimer();
-          remove_downstream(a);
-          rescan_pci();
-          sleep(1);
-          settimer100ms();
-        } else if (!is_linkup && !is_hubup) {
-          if ((10 <= a->link_down_cnt) ||
-              (10 <= a->hub_down_cnt)) {
-            printf(" and has been Down for 1s\n");
-            printf("%s disabling/enabling port", bdf);
-            a->link_down_cnt = 0;
-            a->hub_down_cnt = 0;
-            disable_port(a);
-            for (int noop = 0; noop < 100; noop++) { }
-            enable_port(a);
-          }
-        } else {
-          ;//
+/*! @brief Applies kernel add/remove/bind/unbind events to the monitored ports */
+static void adna_uevent_handler(int fd, uint32_t events, void *data)
+{
+  char buf[UEVENT_BUFSIZE];
+  struct adna_device *a;
+  struct uevent ev;
+  int res;
+  (void)(events);
+  (void)(data);
+
+  while ((res = uevent_recv(fd, buf, sizeof(buf), &ev)) != -EAGAIN) {
+    if (res == -ENOBUFS) {
+      /* Events were dropped; recount everything on the next refresh */
+      topology_stale = true;
+      continue;
+    }
+    if (res < 0)
+      break;
+    if (res == 0 || ev.action == UEVENT_OTHER)
+      continue;
+
+    for (a = first_adna; a; a = a->next) {
+      if (ev.domain == (unsigned)a->this->domain && ev.bus == (unsigned)a->this->bus &&
+          ev.dev == (unsigned)a->this->slot && ev.func == (unsigned)a->this->func) {
+        /* The port itself came or went */
+        if (ev.action == UEVENT_ADD || ev.action == UEVENT_REMOVE)
+          topology_stale = true;
+      } else if (port_owns_bus(a, ev.domain, ev.bus)) {
+        if (ev.action == UEVENT_ADD) {
+          a->children++;
+          topology_stale = true;
+        } else if (ev.action == UEVENT_REMOVE) {
+          if (a->children > 0)
+            a->children--;
+          topology_stale = true;
         }
-        printf("\n");
+        adapter_schedule(a->adapter, true);
+        adna_log(LOG_DEBUG, "uevent: %04x:%02x:%02x.%d %s, %d function(s) behind %02x:%02x.%d",
+                 ev.domain, ev.bus, ev.dev, ev.func,
+                 ev.action == UEVENT_ADD ? "added" : ev.action == UEVENT_REMOVE ? "removed" :
+                 ev.action == UEVENT_BIND ? "bound" : "unbound",
+                 a->children, a->this->bus, a->this->slot, a->this->func);
       }
     }
   }
-  adna_pacc_cleanup();
+}
+
+/*! @brief Logs how many ports are in each state and what happened since the last summary
+ *
+ * Individual transitions are logged as they happen; this is the
+ * heartbeat that says the monitor is alive while nothing changes.
+ */
+static void adna_log_summary(struct ev_timer *t, void *data)
+{
+  int cnt[PORT_ST_DAMPED + 1] = { 0 };
+  struct adna_device *a;
+  (void)(t);
+  (void)(data);
+
+  for (a = first_adna; a; a = a->next)
+    if (!a->bIsD3)
+      cnt[a->state]++;
+  adna_log(LOG_INFO, "Summary: %d %s, %d %s, %d %s, %d %s, %d %s; "
+           "%u flaps, %u recoveries, %u failed in the last %us",
+           cnt[PORT_ST_UP], port_state_names[PORT_ST_UP],
+           cnt[PORT_ST_TRAINING], port_state_names[PORT_ST_TRAINING],
+           cnt[PORT_ST_RECOVERING], port_state_names[PORT_ST_RECOVERING],
+           cnt[PORT_ST_DAMPED], port_state_names[PORT_ST_DAMPED],
+           cnt[PORT_ST_DOWN], port_state_names[PORT_ST_DOWN],
+           summary.flaps, summary.recoveries, summary.failures, ADNA_SUMMARY_MS / 1000);
+  summary.flaps = summary.recoveries = summary.failures = 0;
+}
+
+/*! @brief Undoes what adna_monitor_start() set up outside the loop's own fds */
+void adna_monitor_stop(struct ev_loop *loop)
+{
+  struct adna_device *a;
+
+  metrics_stop(loop);
+  for (a = first_adna; a; a = a->next)
+    a->status = NULL;
+  status_destroy(status_page);
+  status_page = NULL;
+}
+
+/*! @brief Hooks the port monitor into the daemon's event loop */
+int adna_monitor_start(struct ev_loop *loop)
+{
+  struct adna_adapter *ad;
+  struct adna_device *a;
+  int fd, err;
+
+  if (AdnaOptions.SysfsRoot[0]) {
+    /* A simulated tree gets no kernel uevents; changes are seen by polling it */
+    adna_log(LOG_INFO, "Polling simulated sysfs at %s for topology changes", AdnaOptions.SysfsRoot);
+  } else {
+    if ((fd = uevent_open()) >= 0 &&
+        (err = ev_add_fd(loop, fd, EPOLLIN, adna_uevent_handler, NULL)) < 0) {
+      close(fd);
+      fd = err;
+    }
+    if (fd < 0)
+      adna_log(LOG_WARNING, "No kernel uevents (%s), polling sysfs for topology changes",
+               strerror(-fd));
+    else
+      uevent_fd = fd;
+  }
+
+  if ((err = wq_pool_start(&recovery, AdnaOptions.Workers ? AdnaOptions.Workers : ADNA_WORKERS,
+                           ADNA_WORKER_DEPTH, adna_job_run, adna_worker_init,
+                           adna_worker_fini)) == 0 &&
+      (err = ev_add_fd(loop, recovery.done_fd, EPOLLIN, adna_recovery_handler, NULL)) < 0)
+    wq_pool_stop(&recovery);
+  if (err < 0)
+    adna_log(LOG_WARNING, "No recovery workers (%s), recovering ports inline", strerror(-err));
+  else
+    recovery_running = true;
+
+  if (AdnaOptions.bEcam)
+    ecam_open();
+
+  status_start();
+
+  if ((AdnaOptions.MetricsFile[0] || AdnaOptions.MetricsSocket[0]) &&
+      (err = metrics_start(loop, AdnaOptions.MetricsFile[0] ? AdnaOptions.MetricsFile : NULL,
+                           AdnaOptions.MetricsIntervalS ? AdnaOptions.MetricsIntervalS : METRICS_INTERVAL_S,
+                           AdnaOptions.MetricsSocket[0] ? AdnaOptions.MetricsSocket : NULL,
+                           adna_metrics_render)) < 0)
+    adna_log(LOG_ERR, "Unable to export metrics (%s)", strerror(-err));
+
+  if ((err = ev_timer_start(loop, &summary.timer, ADNA_SUMMARY_MS * NSEC_PER_MSEC,
+                            ADNA_SUMMARY_MS * NSEC_PER_MSEC, adna_log_summary, NULL)) < 0)
+    return err;
+
+  for (a = first_adna; a; a = a->next)
+    if (a->bIsD3)
+      adna_log(LOG_NOTICE, "%02x:%02x.%d is not Hotplug capable. Skipping device.",
+               a->this->bus, a->this->slot, a->this->func);
+
+  /* Adapters are sampled independently so that one in a burst does not
+   * drag the others along */
+  for (ad = first_adapter; ad; ad = ad->next) {
+    ad->interval = opt_ms(AdnaOptions.TickMs, ADNA_TICK_MS);
+    if ((err = ev_timer_start(loop, &ad->tick, ADNA_FIRST_TICK_MS * NSEC_PER_MSEC,
+                              ad->interval, adna_monitor_tick, ad)) < 0)
+      return err;
+  }
+  return 0;
 }
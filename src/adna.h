@@ -50,19 +50,13 @@
 #define alloca xmalloc
 #endif
 
-#define PRINT_ERROR \
-    do { \
-        fprintf(stderr, "Error at line %d, file %s (%d) [%s]\n", \
-        __LINE__, __FILE__, errno, strerror(errno)); exit(1); \
-    } while(0)
-
 /*** Options ***/
 
 extern int verbose;
 extern struct pci_filter filter;
 extern char *opt_pcimap;
 extern struct device *first_dev;
-extern struct pci_access *pacc;
+extern __thread struct pci_access *pacc;
 
 struct device *scan_device(struct pci_dev *p);
 void show_device(struct device *d);
@@ -98,6 +92,7 @@ struct device {
   byte *config;				/* Cached configuration space data */
   byte *present;			/* Maps which configuration bytes are present */
   int NumDevice;
+  struct arena *arena;			/* Owner of this and the buffers, NULL for the heap */
 };
 
 /*** PCI devices and access to their config space ***/
@@ -139,6 +134,24 @@ struct adna_options {
   u16     ExtraBytes;
   bool bListOnly;
   bool bSerialNumber;
+  /* Port sampling, in ms; 0 selects the built-in default */
+  unsigned int TickMs;        /* Base interval */
+  unsigned int SlowMs;        /* Longest interval for a stable adapter */
+  unsigned int BurstMs;       /* Interval right after a change */
+  unsigned int BurstWindowMs; /* Duration of the burst */
+  unsigned int Workers;       /* Recovery threads, 0 selects the default */
+  /* Flap damping and rescan budget; 0 selects the built-in default */
+  unsigned int FlapHalfLifeMs;
+  unsigned int FlapSuppress;
+  unsigned int FlapReuse;
+  unsigned int RescanBurst;
+  unsigned int RescanPerMin;
+  bool bEcam;                 /* Sample link registers through ECAM */
+  char EcamPath[255];         /* File standing in for the ECAM region, "" for MCFG */
+  char MetricsFile[255];      /* Prometheus textfile, "" for none */
+  char MetricsSocket[108];    /* Unix socket serving the same, "" for none */
+  unsigned int MetricsIntervalS; /* Textfile period, 0 selects the default */
+  char SysfsRoot[128];        /* Simulated sysfs tree, "" for /sys */
 };
 
 /* ls-vpd.c */
@@ -164,6 +177,7 @@ void show_kernel_cleanup(void);
 extern struct bridge host_bridge;
 
 void grow_tree(void);
+void free_tree(void);
 void show_forest(struct pci_filter *filter);
 
 /* ls-map.c */
@@ -172,8 +186,15 @@ void map_the_bus(void);
 void adna_set_d3_flag(int devnum);
 
 int adna_pci_process(void);
+int adna_pci_refresh(void);
+unsigned int adna_scan_generation(void);
+void *topo_alloc(size_t size);
+void adna_print_stats(void);
 void adna_set_init_flag(bool value);
-void adna_timer_callback(int signum);
+int adna_check_intervals(void);
+struct ev_loop;
+int adna_monitor_start(struct ev_loop *loop);
+void adna_monitor_stop(struct ev_loop *loop);
 int adna_delete_list(void);
 int adna_get_errors(void);
 
@@ -0,0 +1,142 @@
+/** @file: arena.c
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * Region allocator for data that lives exactly as long as one topology
+ * scan: everything is released at once by arena_reset()
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN     16
+
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t size;                /* Usable bytes in data[] */
+  size_t used;
+  unsigned char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+static size_t arena_round(size_t size)
+{
+  return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+void arena_init(struct arena *a, size_t chunk_size)
+{
+  memset(a, 0, sizeof(*a));
+  a->chunk_size = chunk_size;
+}
+
+static struct arena_chunk *arena_new_chunk(struct arena *a, size_t size)
+{
+  struct arena_chunk *c;
+
+  if (size < a->chunk_size)
+    size = a->chunk_size;
+  if ((c = malloc(sizeof(*c) + size)) == NULL)
+    return NULL;
+  c->size = size;
+  c->used = 0;
+  c->next = a->chunk;
+  a->chunk = c;
+  a->reserved += size;
+  a->chunk_allocs++;
+  return c;
+}
+
+/*! @brief Returns @size bytes aligned to 16, or NULL if out of memory */
+void *arena_alloc(struct arena *a, size_t size)
+{
+  struct arena_chunk *c = a->chunk;
+  void *p;
+
+  size = arena_round(size ? size : 1);
+  if (!c || c->size - c->used < size) {
+    /* Grow geometrically so a large scan needs few chunks */
+    if ((c = arena_new_chunk(a, size > a->reserved ? size : a->reserved)) == NULL)
+      return NULL;
+  }
+  p = c->data + c->used;
+  c->used += size;
+  a->used += size;
+  a->allocs++;
+  a->total_allocs++;
+  return p;
+}
+
+/*! @brief Grows an allocation; extends it in place if it was the last one */
+void *arena_realloc(struct arena *a, void *old, size_t old_size, size_t size)
+{
+  struct arena_chunk *c = a->chunk;
+  void *p;
+
+  if (!old)
+    return arena_alloc(a, size);
+  old_size = arena_round(old_size);
+  size = arena_round(size);
+  if (size <= old_size)
+    return old;
+  if (c && (unsigned char *)old + old_size == c->data + c->used &&
+      c->size - c->used >= size - old_size) {
+    c->used += size - old_size;
+    a->used += size - old_size;
+    return old;
+  }
+  if ((p = arena_alloc(a, size)) != NULL)
+    memcpy(p, old, old_size);
+  return p;
+}
+
+/*! @brief Releases everything allocated from @a at once
+ *
+ * Memory is kept for the next round: if the round just finished needed more
+ * than one chunk, they are replaced by a single chunk that fits all of it,
+ * so a steady topology settles on one chunk and no malloc() per scan.
+ */
+void arena_reset(struct arena *a)
+{
+  struct arena_chunk *c, *next;
+
+  if (a->used > a->peak)
+    a->peak = a->used;
+  if (a->chunk && a->chunk->next) {
+    for (c = a->chunk; c; c = next) {
+      next = c->next;
+      free(c);
+    }
+    a->chunk = NULL;
+    a->reserved = 0;
+    arena_new_chunk(a, a->peak);
+  }
+  if (a->chunk)
+    a->chunk->used = 0;
+  a->used = 0;
+  a->allocs = 0;
+  a->resets++;
+}
+
+void arena_free(struct arena *a)
+{
+  struct arena_chunk *c, *next;
+
+  for (c = a->chunk; c; c = next) {
+    next = c->next;
+    free(c);
+  }
+  a->chunk = NULL;
+  a->reserved = 0;
+  a->used = 0;
+  a->allocs = 0;
+}
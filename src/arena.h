@@ -0,0 +1,42 @@
+/** @file: arena.h
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * Region allocator for data that lives exactly as long as one topology
+ * scan: everything is released at once by arena_reset()
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+struct arena_chunk;
+
+struct arena {
+  struct arena_chunk *chunk;  /* Chunk being carved, older ones follow */
+  size_t chunk_size;          /* Minimum size of a new chunk */
+  /* Statistics */
+  size_t used;                /* Bytes handed out since the last reset */
+  size_t peak;                /* Largest value of used seen at a reset */
+  size_t reserved;            /* Bytes held in chunks */
+  unsigned long allocs;       /* Allocations since the last reset */
+  unsigned long total_allocs;
+  unsigned long chunk_allocs; /* Calls to malloc(), the number to keep flat */
+  unsigned long resets;
+};
+
+void arena_init(struct arena *a, size_t chunk_size);
+void *arena_alloc(struct arena *a, size_t size);
+void *arena_realloc(struct arena *a, void *old, size_t old_size, size_t size);
+void arena_reset(struct arena *a);
+void arena_free(struct arena *a);
+
+#endif // __ARENA_H__
@@ -0,0 +1,133 @@
+/** @file: devindex.c
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * Open-addressing index of PCI functions keyed by domain/bus/devfn,
+ * rebuilt once per scan
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "adna.h"
+#include "devindex.h"
+
+static unsigned int dev_index_hash(uint64_t key, unsigned int mask)
+{
+  return (unsigned int)((key * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+}
+
+static struct dev_index_entry *dev_index_slot(const struct dev_index *ix, uint64_t key)
+{
+  unsigned int i = dev_index_hash(key, ix->mask);
+
+  /* Linear probing; the table is at most half full */
+  while (ix->slots[i].pdev && ix->slots[i].key != key)
+    i = (i + 1) & ix->mask;
+  return &ix->slots[i];
+}
+
+static void dev_index_note_domain(struct dev_index *ix, int domain)
+{
+  int i;
+
+  if (ix->ndomains < 0)
+    return;
+  for (i = 0; i < ix->ndomains; i++)
+    if (ix->domains[i] == domain)
+      return;
+  if (ix->ndomains == DEV_INDEX_MAX_DOMAINS)
+    ix->ndomains = -1;
+  else
+    ix->domains[ix->ndomains++] = domain;
+}
+
+/*! @brief Indexes all libpci @devices and links in the forest nodes from @first
+ *
+ * The table is carved from @arena and so becomes invalid when the arena is
+ * reset; call dev_index_clear() at the same time.
+ */
+int dev_index_build(struct dev_index *ix, struct arena *arena,
+                    struct pci_dev *devices, struct device *first)
+{
+  struct dev_index_entry *e;
+  struct pci_dev *p;
+  struct device *d;
+  unsigned int n = 0, size = 16;
+
+  dev_index_clear(ix);
+  for (p = devices; p; p = p->next)
+    n++;
+  while (size < 2 * n)
+    size <<= 1;
+  if ((ix->slots = arena_alloc(arena, size * sizeof(*ix->slots))) == NULL)
+    return -ENOMEM;
+  memset(ix->slots, 0, size * sizeof(*ix->slots));
+  ix->mask = size - 1;
+
+  for (p = devices; p; p = p->next) {
+    e = dev_index_slot(ix, dev_index_key(p->domain, p->bus, p->dev, p->func));
+    if (!e->pdev) {
+      e->key = dev_index_key(p->domain, p->bus, p->dev, p->func);
+      e->pdev = p;
+      ix->count++;
+      dev_index_note_domain(ix, p->domain);
+    }
+  }
+  for (d = first; d; d = d->next) {
+    e = dev_index_slot(ix, dev_index_key(d->dev->domain, d->dev->bus, d->dev->dev, d->dev->func));
+    if (e->pdev)
+      e->dev = d;
+  }
+  return 0;
+}
+
+void dev_index_clear(struct dev_index *ix)
+{
+  ix->slots = NULL;
+  ix->mask = 0;
+  ix->count = 0;
+  ix->ndomains = 0;
+}
+
+/*! @brief Returns the entry for @key, or NULL */
+struct dev_index_entry *dev_index_find(const struct dev_index *ix, uint64_t key)
+{
+  struct dev_index_entry *e;
+
+  if (!ix->slots)
+    return NULL;
+  e = dev_index_slot(ix, key);
+  return e->pdev ? e : NULL;
+}
+
+/*! @brief Tells whether @f names a single slot the index can resolve
+ *
+ * A filter without a domain qualifies only if the machine has just one,
+ * as it would otherwise match that slot in every domain.
+ */
+int dev_index_covers(const struct dev_index *ix, struct pci_filter *f)
+{
+  return ix->slots && f->bus >= 0 && f->slot >= 0 && f->func >= 0 &&
+         (f->domain >= 0 || ix->ndomains == 1);
+}
+
+/*! @brief Looks up the function named by @f, which must pass dev_index_covers()
+ *
+ * The remaining filter criteria (IDs, class) are checked on the result.
+ */
+struct dev_index_entry *dev_index_find_filter(const struct dev_index *ix, struct pci_filter *f)
+{
+  int domain = f->domain >= 0 ? f->domain : ix->domains[0];
+  struct dev_index_entry *e;
+
+  e = dev_index_find(ix, dev_index_key(domain, f->bus, f->slot, f->func));
+  return e && pci_filter_match(f, e->pdev) ? e : NULL;
+}
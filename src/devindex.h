@@ -0,0 +1,55 @@
+/** @file: devindex.h
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * Open-addressing index of PCI functions keyed by domain/bus/devfn,
+ * rebuilt once per scan
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#ifndef __DEVINDEX_H__
+#define __DEVINDEX_H__
+
+#include <stdint.h>
+
+#include "pciutils.h"
+#include "arena.h"
+
+#define DEV_INDEX_MAX_DOMAINS   8
+
+struct device;
+
+struct dev_index_entry {
+  uint64_t key;               /* See dev_index_key() */
+  struct pci_dev *pdev;       /* NULL marks an empty slot */
+  struct device *dev;         /* Node in the device forest, if the function has one */
+};
+
+struct dev_index {
+  struct dev_index_entry *slots;  /* Lives in the arena passed to dev_index_build() */
+  unsigned int mask;          /* Capacity - 1 */
+  unsigned int count;
+  /* Domains present, to resolve filters that leave the domain out */
+  int domains[DEV_INDEX_MAX_DOMAINS];
+  int ndomains;               /* -1 if there were too many to list */
+};
+
+static inline uint64_t dev_index_key(int domain, int bus, int slot, int func)
+{
+  return (uint64_t)(unsigned int)domain << 16 | (bus & 0xff) << 8 | (slot & 0x1f) << 3 | (func & 7);
+}
+
+int dev_index_build(struct dev_index *ix, struct arena *arena,
+                    struct pci_dev *devices, struct device *first);
+void dev_index_clear(struct dev_index *ix);
+struct dev_index_entry *dev_index_find(const struct dev_index *ix, uint64_t key);
+int dev_index_covers(const struct dev_index *ix, struct pci_filter *f);
+struct dev_index_entry *dev_index_find_filter(const struct dev_index *ix, struct pci_filter *f);
+
+#endif // __DEVINDEX_H__
@@ -0,0 +1,236 @@
+/** @file: evloop.c
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * epoll based event loop with timerfd timers on absolute
+ * CLOCK_MONOTONIC deadlines
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "evloop.h"
+
+#define EV_MAX_EVENTS   16
+
+struct ev_signals {
+  void (*fn)(int signo, void *data);
+  void *data;
+};
+
+uint64_t ev_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+int ev_loop_init(struct ev_loop *loop)
+{
+  loop->stop = false;
+  loop->sources = NULL;
+  loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+  return loop->epfd < 0 ? -errno : 0;
+}
+
+void ev_loop_close(struct ev_loop *loop)
+{
+  struct ev_source *s, *next;
+
+  for (s = loop->sources; s; s = next) {
+    next = s->next;
+    free(s);
+  }
+  loop->sources = NULL;
+  if (loop->epfd >= 0)
+    close(loop->epfd);
+  loop->epfd = -1;
+}
+
+int ev_add_fd(struct ev_loop *loop, int fd, uint32_t events, ev_handler fn, void *data)
+{
+  struct epoll_event ev;
+  struct ev_source *s;
+
+  if ((s = malloc(sizeof(*s))) == NULL)
+    return -ENOMEM;
+  s->fd = fd;
+  s->fn = fn;
+  s->data = data;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = s;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    int err = -errno;
+    free(s);
+    return err;
+  }
+  s->next = loop->sources;
+  loop->sources = s;
+  return 0;
+}
+
+void ev_del_fd(struct ev_loop *loop, int fd)
+{
+  struct ev_source **ps, *s;
+
+  epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+  for (ps = &loop->sources; (s = *ps) != NULL; ps = &s->next) {
+    if (s->fd == fd) {
+      *ps = s->next;
+      free(s);
+      return;
+    }
+  }
+}
+
+int ev_loop_run(struct ev_loop *loop)
+{
+  struct epoll_event events[EV_MAX_EVENTS];
+  int i, n;
+
+  while (!loop->stop) {
+    n = epoll_wait(loop->epfd, events, EV_MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    for (i = 0; i < n && !loop->stop; i++) {
+      struct ev_source *s = events[i].data.ptr;
+      struct ev_source *p;
+
+      /* Events for a source removed earlier in this batch may still be pending */
+      for (p = loop->sources; p && p != s; p = p->next)
+        ;
+      if (p && p->fn)
+        p->fn(p->fd, events[i].events, p->data);
+    }
+  }
+  return 0;
+}
+
+void ev_loop_stop(struct ev_loop *loop)
+{
+  loop->stop = true;
+}
+
+static int ev_timer_arm(struct ev_timer *t)
+{
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = t->deadline / NSEC_PER_SEC;
+  its.it_value.tv_nsec = t->deadline % NSEC_PER_SEC;
+  return timerfd_settime(t->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0 ? -errno : 0;
+}
+
+static void ev_timer_fire(int fd, uint32_t events, void *data)
+{
+  struct ev_timer *t = data;
+  uint64_t expirations, now;
+  (void)(events);
+
+  if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    return;
+
+  /* Stay on the start + k * interval grid, skipping deadlines we overran */
+  now = ev_now();
+  t->deadline += t->interval;
+  while (t->deadline <= now) {
+    t->deadline += t->interval;
+    t->missed++;
+  }
+  ev_timer_arm(t);
+  t->fn(t, t->data);
+}
+
+int ev_timer_start(struct ev_loop *loop, struct ev_timer *t, uint64_t delay,
+                   uint64_t interval, ev_timer_handler fn, void *data)
+{
+  int err;
+
+  t->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (t->fd < 0)
+    return -errno;
+  t->interval = interval;
+  t->deadline = ev_now() + delay;
+  t->missed = 0;
+  t->fn = fn;
+  t->data = data;
+  if ((err = ev_timer_arm(t)) < 0 ||
+      (err = ev_add_fd(loop, t->fd, EPOLLIN, ev_timer_fire, t)) < 0) {
+    close(t->fd);
+    t->fd = -1;
+  }
+  return err;
+}
+
+/*! @brief Changes the period; a shorter one also pulls in the next deadline */
+int ev_timer_set_interval(struct ev_timer *t, uint64_t interval)
+{
+  uint64_t soonest = ev_now() + interval;
+
+  t->interval = interval;
+  if (t->deadline <= soonest)
+    return 0;
+  t->deadline = soonest;
+  return ev_timer_arm(t);
+}
+
+void ev_timer_stop(struct ev_loop *loop, struct ev_timer *t)
+{
+  if (t->fd < 0)
+    return;
+  ev_del_fd(loop, t->fd);
+  close(t->fd);
+  t->fd = -1;
+}
+
+static void ev_signal_fire(int fd, uint32_t events, void *data)
+{
+  struct ev_signals *sig = data;
+  struct signalfd_siginfo si;
+  (void)(events);
+
+  while (read(fd, &si, sizeof(si)) == sizeof(si))
+    sig->fn(si.ssi_signo, sig->data);
+}
+
+/*! @brief Blocks @signals and delivers them through the loop instead */
+int ev_signals_start(struct ev_loop *loop, const int *signals, int count,
+                     void (*fn)(int signo, void *data), void *data)
+{
+  static struct ev_signals sig;
+  sigset_t mask;
+  int fd, i, err;
+
+  sigemptyset(&mask);
+  for (i = 0; i < count; i++)
+    sigaddset(&mask, signals[i]);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
+    return -errno;
+  if ((fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+    return -errno;
+
+  sig.fn = fn;
+  sig.data = data;
+  if ((err = ev_add_fd(loop, fd, EPOLLIN, ev_signal_fire, &sig)) < 0)
+    close(fd);
+  return err;
+}
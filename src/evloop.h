@@ -0,0 +1,72 @@
+/** @file: evloop.h
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * epoll based event loop with timerfd timers on absolute
+ * CLOCK_MONOTONIC deadlines
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#ifndef __EVLOOP_H__
+#define __EVLOOP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define NSEC_PER_MSEC   1000000ULL
+#define NSEC_PER_SEC    1000000000ULL
+
+typedef void (*ev_handler)(int fd, uint32_t events, void *data);
+
+struct ev_source {
+  struct ev_source *next;
+  int fd;
+  ev_handler fn;
+  void *data;
+};
+
+struct ev_loop {
+  int epfd;
+  bool stop;
+  struct ev_source *sources;
+};
+
+struct ev_timer;
+typedef void (*ev_timer_handler)(struct ev_timer *t, void *data);
+
+/* Periodic timer. Deadlines are start + k * interval, so time spent in the
+ * handler never shifts later ticks; overrun ticks are skipped and counted. */
+struct ev_timer {
+  int fd;
+  uint64_t deadline;          /* Next expiry, CLOCK_MONOTONIC ns */
+  uint64_t interval;          /* Period in ns */
+  uint64_t missed;            /* Deadlines skipped because we overran them */
+  ev_timer_handler fn;
+  void *data;
+};
+
+uint64_t ev_now(void);
+
+int ev_loop_init(struct ev_loop *loop);
+void ev_loop_close(struct ev_loop *loop);
+int ev_add_fd(struct ev_loop *loop, int fd, uint32_t events, ev_handler fn, void *data);
+void ev_del_fd(struct ev_loop *loop, int fd);
+int ev_loop_run(struct ev_loop *loop);
+void ev_loop_stop(struct ev_loop *loop);
+
+int ev_timer_start(struct ev_loop *loop, struct ev_timer *t, uint64_t delay,
+                   uint64_t interval, ev_timer_handler fn, void *data);
+int ev_timer_set_interval(struct ev_timer *t, uint64_t interval);
+void ev_timer_stop(struct ev_loop *loop, struct ev_timer *t);
+
+int ev_signals_start(struct ev_loop *loop, const int *signals, int count,
+                     void (*fn)(int signo, void *data), void *data);
+
+#endif // __EVLOOP_H__
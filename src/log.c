@@ -0,0 +1,275 @@
+/** @file: log.c
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * Leveled logging: callers format into a lock-free ring, and a writer
+ * thread drains it to stdout or natively to journald
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "log.h"
+
+#define JOURNAL_SOCKET  "/run/systemd/journal/socket"
+#define LOG_IDENTIFIER  "adnacom-hp"
+
+/*
+ * Bounded multi-producer ring: a producer claims a slot by advancing tail,
+ * and publishes it by setting the slot's seq to its position + 1. The
+ * writer frees it again by setting seq to position + LOG_RING_SIZE.
+ */
+struct log_rec {
+  unsigned int seq;
+  int prio;
+  char port[16];
+  char msg[LOG_MSG_MAX];
+};
+
+static struct log_rec ring[LOG_RING_SIZE];
+static unsigned int ring_tail;      /* Next slot to claim, shared by producers */
+static unsigned int ring_head;      /* Next slot to drain, writer only */
+static unsigned long dropped;       /* Records lost to a full ring */
+
+static int log_level = LOG_INFO;
+static bool running, stopping;
+static int wake_fd = -1;
+static int journal_fd = -1;
+static bool level_prefix;           /* stdout is a journal stream, see sd-daemon(3) */
+static pthread_t writer;
+
+static const char * const level_names[] = {
+  "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug",
+};
+
+/*! @brief Returns the syslog priority called @name, or -1 */
+int log_parse_level(const char *name)
+{
+  unsigned int i;
+
+  for (i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++)
+    if (!strcmp(name, level_names[i]))
+      return i;
+  return -1;
+}
+
+bool log_enabled(int prio)
+{
+  return prio <= log_level;
+}
+
+/* Locked as one piece, recovery workers print port dumps to stdout too */
+static void emit_stdout(int prio, const char *port, const char *msg)
+{
+  flockfile(stdout);
+  if (level_prefix)
+    printf("<%d>", prio);
+  if (port[0])
+    printf("%s ", port);
+  printf("%s\n", msg);
+  funlockfile(stdout);
+}
+
+/*! @brief Sends one record with the native journal protocol; returns 0 or -errno */
+static int emit_journal(int prio, const char *port, const char *msg)
+{
+  static const struct sockaddr_un sa = { AF_UNIX, JOURNAL_SOCKET };
+  char head[64], tag[24], field[32];
+  struct iovec iov[5];
+  struct msghdr mh;
+  int n = 0;
+
+  snprintf(head, sizeof(head), "PRIORITY=%d\nSYSLOG_IDENTIFIER=" LOG_IDENTIFIER "\nMESSAGE=", prio);
+  iov[n].iov_base = head;
+  iov[n++].iov_len = strlen(head);
+  if (port[0]) {
+    snprintf(tag, sizeof(tag), "%s ", port);
+    iov[n].iov_base = tag;
+    iov[n++].iov_len = strlen(tag);
+  }
+  iov[n].iov_base = (void *)msg;
+  iov[n++].iov_len = strlen(msg);
+  iov[n].iov_base = "\n";
+  iov[n++].iov_len = 1;
+  if (port[0]) {
+    snprintf(field, sizeof(field), "ADNA_PORT=%s\n", port);
+    iov[n].iov_base = field;
+    iov[n++].iov_len = strlen(field);
+  }
+
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_name = (void *)&sa;
+  mh.msg_namelen = sizeof(sa);
+  mh.msg_iov = iov;
+  mh.msg_iovlen = n;
+  return sendmsg(journal_fd, &mh, MSG_NOSIGNAL) < 0 ? -errno : 0;
+}
+
+static void emit(int prio, const char *port, const char *msg)
+{
+  if (journal_fd < 0 || emit_journal(prio, port, msg) < 0)
+    emit_stdout(prio, port, msg);
+}
+
+/*! @brief Writes out everything published so far */
+static void drain(void)
+{
+  static unsigned long reported;
+  unsigned long lost;
+  struct log_rec *rec;
+  char note[64];
+
+  for (;;) {
+    rec = &ring[ring_head & (LOG_RING_SIZE - 1)];
+    if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != ring_head + 1)
+      break;
+    emit(rec->prio, rec->port, rec->msg);
+    __atomic_store_n(&rec->seq, ring_head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+    ring_head++;
+  }
+  lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+  if (lost != reported) {
+    snprintf(note, sizeof(note), "%lu log message(s) dropped, ring full", lost - reported);
+    emit(LOG_WARNING, "", note);
+    reported = lost;
+  }
+  fflush(stdout);
+}
+
+static void *writer_main(void *arg)
+{
+  eventfd_t cnt;
+  sigset_t all;
+  (void)(arg);
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+  while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+    eventfd_read(wake_fd, &cnt);
+    drain();
+  }
+  drain();
+  return NULL;
+}
+
+/*! @brief Starts the writer thread; until then, and if this fails, records are written inline
+ *
+ * Records above @level are discarded at the call site. With @journal set
+ * they go to journald as structured entries, falling back to stdout if
+ * its socket is not there.
+ */
+int log_start(int level, bool journal)
+{
+  unsigned int i;
+  int err;
+
+  log_level = level;
+  stopping = false;
+  level_prefix = getenv("JOURNAL_STREAM") != NULL;
+  if (journal && (journal_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+    fprintf(stderr, "adna: No journald socket (%s), logging to stdout\n", strerror(errno));
+
+  /* Nothing is in flight between log_stop() and here, so start over */
+  ring_tail = ring_head = 0;
+  for (i = 0; i < LOG_RING_SIZE; i++)
+    ring[i].seq = i;
+  if ((wake_fd = eventfd(0, EFD_CLOEXEC)) < 0)
+    return -errno;
+  if ((err = pthread_create(&writer, NULL, writer_main, NULL)) != 0) {
+    close(wake_fd);
+    wake_fd = -1;
+    return -err;
+  }
+  running = true;
+  atexit(log_stop);
+  return 0;
+}
+
+/*! @brief Writes out what is left and joins the writer */
+void log_stop(void)
+{
+  if (!running || pthread_equal(pthread_self(), writer))
+    return;
+  running = false;
+  __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+  eventfd_write(wake_fd, 1);
+  pthread_join(writer, NULL);
+  close(wake_fd);
+  wake_fd = -1;
+  if (journal_fd >= 0)
+    close(journal_fd);
+  journal_fd = -1;
+}
+
+void adna_vlog(int prio, const char *port, const char *fmt, va_list args)
+{
+  struct log_rec *rec;
+  unsigned int pos, seq;
+  char msg[LOG_MSG_MAX];
+
+  if (prio > log_level)
+    return;
+  if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    emit(prio, port ? port : "", msg);
+    fflush(stdout);
+    return;
+  }
+
+  pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+  for (;;) {
+    rec = &ring[pos & (LOG_RING_SIZE - 1)];
+    seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+    if (seq == pos) {
+      if (__atomic_compare_exchange_n(&ring_tail, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if ((int)(seq - pos) < 0) {
+      /* The writer is a whole ring behind; never block the sampler */
+      __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+    }
+  }
+  rec->prio = prio;
+  snprintf(rec->port, sizeof(rec->port), "%s", port ? port : "");
+  vsnprintf(rec->msg, sizeof(rec->msg), fmt, args);
+  __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+  eventfd_write(wake_fd, 1);
+}
+
+void adna_log(int prio, const char *fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  adna_vlog(prio, NULL, fmt, args);
+  va_end(args);
+}
+
+void adna_log_port(int prio, const char *port, const char *fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  adna_vlog(prio, port, fmt, args);
+  va_end(args);
+}
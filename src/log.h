@@ -0,0 +1,36 @@
+/** @file: log.h
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * Leveled logging: callers format into a lock-free ring, and a writer
+ * thread drains it to stdout or natively to journald
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <syslog.h>     /* LOG_ERR ... LOG_DEBUG */
+
+#define LOG_RING_SIZE   256     /* Records in flight, a power of two */
+#define LOG_MSG_MAX     240
+
+int log_parse_level(const char *name);
+int log_start(int level, bool journal);
+void log_stop(void);
+bool log_enabled(int prio);
+
+void adna_vlog(int prio, const char *port, const char *fmt, va_list args);
+void adna_log(int prio, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+/* As adna_log(), tagged with the port's B:D.F in the text and in ADNA_PORT= */
+void adna_log_port(int prio, const char *port, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+#endif // __LOG_H__
@@ -8,6 +8,7 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "adna.h"
@@ -28,7 +29,7 @@ find_bus(struct bridge *b, unsigned int domain, unsigned int n)
 static struct bus *
 new_bus(struct bridge *b, unsigned int domain, unsigned int n)
 {
-  struct bus *bus = xmalloc(sizeof(struct bus));
+  struct bus *bus = topo_alloc(sizeof(struct bus));
   bus->domain = domain;
   bus->number = n;
   bus->sibling = b->first_bus;
@@ -83,7 +84,7 @@ grow_tree(void)
     if ((class >> 8) == PCI_BASE_CLASS_BRIDGE &&
         (ht == PCI_HEADER_TYPE_BRIDGE || ht == PCI_HEADER_TYPE_CARDBUS))
     {
-      b = xmalloc(sizeof(struct bridge));
+      b = topo_alloc(sizeof(struct bridge));
       b->domain = dd->domain;
       if (ht == PCI_HEADER_TYPE_BRIDGE)
       {
@@ -277,3 +278,11 @@ show_forest(struct pci_filter *filter)
         }
     }
 }
+
+/* Bridges and buses live in the topology arena, which the caller resets */
+void
+free_tree(void)
+{
+  host_bridge.chain = host_bridge.next = host_bridge.child = NULL;
+  host_bridge.first_bus = NULL;
+}
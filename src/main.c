@@ -1,7 +1,9 @@
 #include "main.h"
+#include "evloop.h"
+#include "log.h"
+#include "status.h"
 #include <errno.h>
-#include <time.h>
-#include <sys/time.h>
+#include <getopt.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <stdio.h>
@@ -9,28 +11,229 @@
 
 extern struct adna_options AdnaOptions;
 
+enum {
+  OPT_VERSION = 0x100,
+  OPT_TICK_MS,
+  OPT_SLOW_MS,
+  OPT_BURST_MS,
+  OPT_BURST_WINDOW_MS,
+  OPT_WORKERS,
+  OPT_ECAM,
+  OPT_FLAP_HALF_LIFE_MS,
+  OPT_FLAP_SUPPRESS,
+  OPT_FLAP_REUSE,
+  OPT_RESCAN_BURST,
+  OPT_RESCAN_PER_MIN,
+  OPT_LOG_LEVEL,
+  OPT_JOURNAL,
+  OPT_METRICS_FILE,
+  OPT_METRICS_SOCKET,
+  OPT_METRICS_INTERVAL,
+  OPT_STATUS,
+  OPT_SYSFS,
+};
+
+static const struct option long_options[] = {
+  { "version",          no_argument,       NULL, OPT_VERSION },
+  { "verbose",          no_argument,       NULL, 'v' },
+  { "help",             no_argument,       NULL, 'h' },
+  { "tick-ms",          required_argument, NULL, OPT_TICK_MS },
+  { "slow-ms",          required_argument, NULL, OPT_SLOW_MS },
+  { "burst-ms",         required_argument, NULL, OPT_BURST_MS },
+  { "burst-window-ms",  required_argument, NULL, OPT_BURST_WINDOW_MS },
+  { "workers",          required_argument, NULL, OPT_WORKERS },
+  { "ecam",             optional_argument, NULL, OPT_ECAM },
+  { "flap-half-life-ms", required_argument, NULL, OPT_FLAP_HALF_LIFE_MS },
+  { "flap-suppress",    required_argument, NULL, OPT_FLAP_SUPPRESS },
+  { "flap-reuse",       required_argument, NULL, OPT_FLAP_REUSE },
+  { "rescan-burst",     required_argument, NULL, OPT_RESCAN_BURST },
+  { "rescan-per-min",   required_argument, NULL, OPT_RESCAN_PER_MIN },
+  { "log-level",        required_argument, NULL, OPT_LOG_LEVEL },
+  { "journal",          no_argument,       NULL, OPT_JOURNAL },
+  { "metrics-file",     required_argument, NULL, OPT_METRICS_FILE },
+  { "metrics-socket",   required_argument, NULL, OPT_METRICS_SOCKET },
+  { "metrics-interval", required_argument, NULL, OPT_METRICS_INTERVAL },
+  { "status",           no_argument,       NULL, OPT_STATUS },
+  { "sysfs",            required_argument, NULL, OPT_SYSFS },
+  { NULL, 0, NULL, 0 }
+};
+
+static void usage(FILE *f)
+{
+  fprintf(f,
+          "Usage: adnacom-hp [options]\n"
+          "  -v, --verbose            Print details of every recovery step (--log-level=debug)\n"
+          "      --log-level=LEVEL    err, warning, notice, info (default) or debug\n"
+          "      --journal            Log to journald with structured fields\n"
+          "      --tick-ms=N          Base port sampling interval (default 100)\n"
+          "      --slow-ms=N          Interval a stable adapter backs off to (default 1000)\n"
+          "      --burst-ms=N         Interval right after a link change (default 2)\n"
+          "      --burst-window-ms=N  How long to sample at the burst rate (default 500)\n"
+          "      --workers=N          Threads running port recovery (default 2)\n"
+          "      --ecam[=FILE]        Read link status through memory-mapped config space,\n"
+          "                           from the MCFG windows or from FILE (bus 0 at offset 0)\n"
+          "      --flap-half-life-ms=N  Half-life of a port's flap penalty (default 10000)\n"
+          "      --flap-suppress=N    Penalty above which a flapping port is left alone;\n"
+          "                           every flap adds 1000 (default 3000)\n"
+          "      --flap-reuse=N       Penalty below which it is recovered again (default 750)\n"
+          "      --rescan-burst=N     Rescans allowed back to back (default 4)\n"
+          "      --rescan-per-min=N   Sustained rescans per minute, over all ports (default 60)\n"
+          "      --metrics-file=PATH  Write Prometheus metrics to PATH, replacing it atomically\n"
+          "      --metrics-interval=N Seconds between rewrites of that file (default 15)\n"
+          "      --metrics-socket=PATH  Serve the same metrics on a unix socket\n"
+          "      --sysfs=DIR          Monitor the sysfs tree under DIR instead of /sys,\n"
+          "                           e.g. one made by adnacom-sim\n"
+          "      --status             Show the running daemon's port status and exit\n"
+          "      --version            Show version and supported adapters\n"
+          "  -h, --help               Show this help\n"
+          "Send SIGUSR1 to print memory and scan statistics.\n");
+}
+
+static unsigned int parse_ms(const char *name, const char *arg)
+{
+  char *end;
+  unsigned long v;
+
+  errno = 0;
+  v = strtoul(arg, &end, 10);
+  if (errno || end == arg || *end || v == 0 || v > 60000) {
+    fprintf(stderr, "adnacom-hp: --%s expects 1..60000 ms, got '%s'\n", name, arg);
+    exit(1);
+  }
+  return v;
+}
+
+static unsigned int parse_count(const char *name, const char *arg, unsigned long max)
+{
+  char *end;
+  unsigned long v;
+
+  errno = 0;
+  v = strtoul(arg, &end, 10);
+  if (errno || end == arg || *end || v == 0 || v > max) {
+    fprintf(stderr, "adnacom-hp: --%s expects 1..%lu, got '%s'\n", name, max, arg);
+    exit(1);
+  }
+  return v;
+}
+
+static void on_signal(int signo, void *data)
+{
+  struct ev_loop *loop = data;
+
+  if (signo == SIGUSR1)
+    adna_print_stats();
+  else
+    ev_loop_stop(loop);
+}
+
 /* Main */
 int main(int argc, char **argv)
 {
   verbose = 2; // flag used by pci process
   int status = EXIT_SUCCESS;
-  uint8_t remaining = 3; // arbitrary delay before first run
-
-  struct itimerval new_timer;
-  struct itimerval old_timer;
-
-  new_timer.it_value.tv_sec = 1;
-  new_timer.it_value.tv_usec = 0;
-  new_timer.it_interval.tv_sec = 0;
-  new_timer.it_interval.tv_usec = 100 * 1000;
-
-  if (argc == 2 && !strcmp(argv[1], "--version")) {
-    puts("Adnacom Hotplug Tool version " ADNATOOL_VERSION);
-    puts("Supports: H1A (PEX8608), H18/H3/H12 (PEX8718)");
-    return 0;
-  } else if ((argc == 2 && !strcmp(argv[1], "-v"))) {
-    AdnaOptions.bVerbose = true;
+  static const int signals[] = { SIGINT, SIGTERM, SIGHUP, SIGUSR1 };
+  struct ev_loop loop;
+  int opt, level = LOG_INFO;
+  bool journal = false;
+
+  while ((opt = getopt_long(argc, argv, "vh", long_options, NULL)) != -1) {
+    switch (opt) {
+    case OPT_VERSION:
+      puts("Adnacom Hotplug Tool version " ADNATOOL_VERSION);
+      puts("Supports: H1A (PEX8608), H18/H3/H12 (PEX8718)");
+      return 0;
+    case OPT_SYSFS:
+      if (strlen(optarg) >= sizeof(AdnaOptions.SysfsRoot)) {
+        fprintf(stderr, "adnacom-hp: --sysfs path is too long\n");
+        return 1;
+      }
+      strcpy(AdnaOptions.SysfsRoot, optarg);
+      break;
+    case OPT_STATUS:
+      return status_show() < 0 ? 1 : 0;
+    case 'v':
+      AdnaOptions.bVerbose = true;
+      level = LOG_DEBUG;
+      break;
+    case OPT_LOG_LEVEL:
+      if ((level = log_parse_level(optarg)) < 0) {
+        fprintf(stderr, "adnacom-hp: --log-level expects err, warning, notice, info or debug, got '%s'\n",
+                optarg);
+        return 1;
+      }
+      break;
+    case OPT_JOURNAL:
+      journal = true;
+      break;
+    case OPT_METRICS_FILE:
+      snprintf(AdnaOptions.MetricsFile, sizeof(AdnaOptions.MetricsFile), "%s", optarg);
+      break;
+    case OPT_METRICS_SOCKET:
+      if (strlen(optarg) >= sizeof(AdnaOptions.MetricsSocket)) {
+        fprintf(stderr, "adnacom-hp: --metrics-socket path is too long\n");
+        return 1;
+      }
+      strcpy(AdnaOptions.MetricsSocket, optarg);
+      break;
+    case OPT_METRICS_INTERVAL:
+      AdnaOptions.MetricsIntervalS = parse_count("metrics-interval", optarg, 3600);
+      break;
+    case OPT_TICK_MS:
+      AdnaOptions.TickMs = parse_ms("tick-ms", optarg);
+      break;
+    case OPT_SLOW_MS:
+      AdnaOptions.SlowMs = parse_ms("slow-ms", optarg);
+      break;
+    case OPT_BURST_MS:
+      AdnaOptions.BurstMs = parse_ms("burst-ms", optarg);
+      break;
+    case OPT_BURST_WINDOW_MS:
+      AdnaOptions.BurstWindowMs = parse_ms("burst-window-ms", optarg);
+      break;
+    case OPT_WORKERS:
+      AdnaOptions.Workers = atoi(optarg);
+      if (AdnaOptions.Workers < 1 || AdnaOptions.Workers > 16) {
+        fprintf(stderr, "adnacom-hp: --workers expects 1..16, got '%s'\n", optarg);
+        return 1;
+      }
+      break;
+    case OPT_ECAM:
+      AdnaOptions.bEcam = true;
+      if (optarg)
+        snprintf(AdnaOptions.EcamPath, sizeof(AdnaOptions.EcamPath), "%s", optarg);
+      break;
+    case OPT_FLAP_HALF_LIFE_MS:
+      AdnaOptions.FlapHalfLifeMs = parse_ms("flap-half-life-ms", optarg);
+      break;
+    case OPT_FLAP_SUPPRESS:
+      AdnaOptions.FlapSuppress = parse_count("flap-suppress", optarg, 100000);
+      break;
+    case OPT_FLAP_REUSE:
+      AdnaOptions.FlapReuse = parse_count("flap-reuse", optarg, 100000);
+      break;
+    case OPT_RESCAN_BURST:
+      AdnaOptions.RescanBurst = parse_count("rescan-burst", optarg, 100);
+      break;
+    case OPT_RESCAN_PER_MIN:
+      AdnaOptions.RescanPerMin = parse_count("rescan-per-min", optarg, 6000);
+      break;
+    case 'h':
+      usage(stdout);
+      return 0;
+    default:
+      usage(stderr);
+      return 1;
+    }
+  }
+  if (optind < argc) {
+    usage(stderr);
+    return 1;
   }
+  if (adna_check_intervals() < 0)
+    return 1;
+  if ((status = log_start(level, journal)) < 0)
+    fprintf(stderr, "adnacom-hp: No log writer thread (%s), logging inline\n", strerror(-status));
 
   status = adna_pci_process();
   if (status != EXIT_SUCCESS)
@@ -38,20 +241,21 @@ int main(int argc, char **argv)
   else
     adna_set_init_flag(true);
 
-  setitimer(ITIMER_REAL, &new_timer, &old_timer);
-  signal(SIGALRM, adna_timer_callback);
-
-  while (sleep(remaining) != 0) {
-    if (errno == EINTR) {
-      ;// PRINTF("Timer Interrupt ");
-    } else {
-      printf("Sleep error %s\n", strerror(errno));
-    }
+  if ((status = ev_loop_init(&loop)) < 0 ||
+      (status = ev_signals_start(&loop, signals, 4, on_signal, &loop)) < 0 ||
+      (status = adna_monitor_start(&loop)) < 0) {
+    adna_log(LOG_ERR, "Event loop setup failed: %s", strerror(-status));
+    exit(1);
   }
 
+  if ((status = ev_loop_run(&loop)) < 0)
+    adna_log(LOG_ERR, "Event loop error %s", strerror(-status));
+  adna_monitor_stop(&loop);
+  ev_loop_close(&loop);
+
   status = adna_delete_list();
   if (status != EXIT_SUCCESS)
     exit(1);
 
   return (adna_get_errors() ? 2 : 0);
-}
\ No newline at end of file
+}
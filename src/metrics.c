@@ -0,0 +1,257 @@
+/** @file: metrics.c
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * Latency histograms and the Prometheus text exposition of the daemon's
+ * counters, written periodically to a file and/or served on a unix socket
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#define _GNU_SOURCE     /* accept4() */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+#include "log.h"
+
+#define HDR_SUB         (1U << HDR_SUB_BITS)
+/* Histogram buckets exported: every power of two from 2^10 ns (~1us) to 2^40 ns (~18 min) */
+#define HDR_LE_FIRST    10
+#define HDR_LE_LAST     40
+
+static struct {
+  struct ev_timer timer;
+  char file[PATH_MAX];
+  char socket_path[PATH_MAX];
+  int listen_fd;
+  void (*render)(FILE *f);
+} mx = { .listen_fd = -1 };
+
+static unsigned int hdr_index(uint64_t v)
+{
+  unsigned int msb, octave;
+
+  if (v < HDR_SUB)
+    return v;
+  msb = 63 - __builtin_clzll(v);
+  octave = msb - HDR_SUB_BITS + 1;
+  if (octave > HDR_OCTAVES)
+    return HDR_BUCKETS - 1;
+  return (octave << HDR_SUB_BITS) + (unsigned int)(v >> (msb - HDR_SUB_BITS)) - HDR_SUB;
+}
+
+/*! @brief Returns the first value above bucket @i */
+static uint64_t hdr_upper(unsigned int i)
+{
+  unsigned int octave = i >> HDR_SUB_BITS, sub = i & (HDR_SUB - 1);
+
+  if (!octave)
+    return sub + 1;
+  return (uint64_t)(HDR_SUB + sub + 1) << (octave - 1);
+}
+
+void hdr_record(struct hdr_hist *h, uint64_t ns)
+{
+  h->buckets[hdr_index(ns)]++;
+  h->count++;
+  h->sum += ns;
+  if (ns > h->max)
+    h->max = ns;
+}
+
+/*! @brief Returns the value below which a fraction @q of the recorded values lie */
+uint64_t hdr_quantile(const struct hdr_hist *h, double q)
+{
+  uint64_t rank, seen = 0, v;
+  unsigned int i;
+
+  if (!h->count)
+    return 0;
+  rank = (uint64_t)(q * h->count + 0.5);
+  if (rank < 1)
+    rank = 1;
+  for (i = 0; i < HDR_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank)
+      break;
+  }
+  v = hdr_upper(i) - 1;
+  return v < h->max ? v : h->max;
+}
+
+void metrics_family(FILE *f, const char *name, const char *type, const char *help)
+{
+  fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*! @brief Writes @h as a histogram in seconds, plus its median, p99 and maximum as gauges */
+void metrics_hist(FILE *f, const char *name, const char *help, const struct hdr_hist *h)
+{
+  static const double quantiles[] = { 0.5, 0.9, 0.99, 1.0 };
+  uint64_t cum = 0;
+  unsigned int i = 0, k;
+
+  metrics_family(f, name, "histogram", help);
+  for (k = HDR_LE_FIRST; k <= HDR_LE_LAST; k++) {
+    /* Octave boundaries line up with bucket boundaries, so these are exact */
+    for (; i < HDR_BUCKETS && hdr_upper(i) <= (1ULL << k); i++)
+      cum += h->buckets[i];
+    fprintf(f, "%s_bucket{le=\"%.9g\"} %llu\n", name, (double)(1ULL << k) / NSEC_PER_SEC,
+            (unsigned long long)cum);
+  }
+  fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)h->count);
+  fprintf(f, "%s_sum %.9f\n", name, (double)h->sum / NSEC_PER_SEC);
+  fprintf(f, "%s_count %llu\n", name, (unsigned long long)h->count);
+
+  fprintf(f, "# HELP %s_quantile %s, by quantile since start\n# TYPE %s_quantile gauge\n",
+          name, help, name);
+  for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+    fprintf(f, "%s_quantile{quantile=\"%g\"} %.9f\n", name, quantiles[i],
+            (double)hdr_quantile(h, quantiles[i]) / NSEC_PER_SEC);
+}
+
+/*! @brief Renders the exposition into a malloc'd buffer */
+static char *metrics_render(size_t *len)
+{
+  char *buf = NULL;
+  FILE *f;
+
+  if ((f = open_memstream(&buf, len)) == NULL)
+    return NULL;
+  mx.render(f);
+  if (fclose(f) != 0) {
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+/*! @brief Replaces the textfile, so a collector never sees it half written */
+static void metrics_write_file(struct ev_timer *t, void *data)
+{
+  char tmp[PATH_MAX + 8], *buf;
+  size_t len, off = 0;
+  ssize_t res;
+  int fd;
+  (void)(t);
+  (void)(data);
+
+  if ((buf = metrics_render(&len)) == NULL)
+    return;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", mx.file);
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+    adna_log(LOG_DEBUG, "%s: %s", tmp, strerror(errno));
+    free(buf);
+    return;
+  }
+  while (off < len && (res = write(fd, buf + off, len - off)) > 0)
+    off += res;
+  if (close(fd) < 0 || off < len || rename(tmp, mx.file) < 0) {
+    adna_log(LOG_DEBUG, "%s: %s", mx.file, off < len ? "short write" : strerror(errno));
+    unlink(tmp);
+  }
+  free(buf);
+}
+
+/*! @brief Sends the exposition to every waiting client and hangs up
+ *
+ * Clients just read until EOF. The send never blocks the event loop; a
+ * client that has not made room for the whole page gets a truncated one.
+ */
+static void metrics_accept(int fd, uint32_t events, void *data)
+{
+  char *buf;
+  size_t len;
+  int c;
+  (void)(events);
+  (void)(data);
+
+  while ((c = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+    if ((buf = metrics_render(&len)) != NULL) {
+      send(c, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+      free(buf);
+    }
+    close(c);
+  }
+}
+
+static int metrics_listen(struct ev_loop *loop, const char *path)
+{
+  struct sockaddr_un sa = { .sun_family = AF_UNIX };
+  int fd, err;
+
+  if (strlen(path) >= sizeof(sa.sun_path))
+    return -ENAMETOOLONG;
+  strcpy(sa.sun_path, path);
+  if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0)
+    return -errno;
+  unlink(path); /* Left over from a previous run */
+  if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(fd, 8) < 0) {
+    err = -errno;
+    close(fd);
+    return err;
+  }
+  if ((err = ev_add_fd(loop, fd, EPOLLIN, metrics_accept, NULL)) < 0) {
+    close(fd);
+    unlink(path);
+    return err;
+  }
+  return fd;
+}
+
+/*! @brief Starts exporting what @render writes
+ *
+ * With @file set, it is rewritten every @interval_s seconds (for the node
+ * exporter's textfile collector); with @socket_path set, every connection
+ * to that unix socket is answered with a fresh copy. Either may be NULL.
+ */
+int metrics_start(struct ev_loop *loop, const char *file, unsigned int interval_s,
+                  const char *socket_path, void (*render)(FILE *f))
+{
+  int err;
+
+  mx.render = render;
+  if (socket_path) {
+    if ((mx.listen_fd = metrics_listen(loop, socket_path)) < 0)
+      return mx.listen_fd;
+    snprintf(mx.socket_path, sizeof(mx.socket_path), "%s", socket_path);
+  }
+  if (file) {
+    snprintf(mx.file, sizeof(mx.file), "%s", file);
+    if ((err = ev_timer_start(loop, &mx.timer, (uint64_t)interval_s * NSEC_PER_SEC,
+                              (uint64_t)interval_s * NSEC_PER_SEC, metrics_write_file, NULL)) < 0) {
+      metrics_stop(loop);
+      return err;
+    }
+  }
+  return 0;
+}
+
+/*! @brief Writes the textfile a last time and closes the socket */
+void metrics_stop(struct ev_loop *loop)
+{
+  if (mx.file[0]) {
+    ev_timer_stop(loop, &mx.timer);
+    metrics_write_file(NULL, NULL);
+    mx.file[0] = '\0';
+  }
+  if (mx.listen_fd >= 0) {
+    ev_del_fd(loop, mx.listen_fd);
+    close(mx.listen_fd);
+    unlink(mx.socket_path);
+    mx.listen_fd = -1;
+  }
+}
@@ -0,0 +1,53 @@
+/** @file: metrics.h
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * Latency histograms and the Prometheus text exposition of the daemon's
+ * counters, written periodically to a file and/or served on a unix socket
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "evloop.h"
+
+/*
+ * Log-linear histogram of nanosecond values, as in HdrHistogram: each power
+ * of two is split into 2^HDR_SUB_BITS buckets, so a recorded value is known
+ * to within 1/2^HDR_SUB_BITS of itself whatever its magnitude.
+ */
+#define HDR_SUB_BITS    3
+#define HDR_OCTAVES     42      /* Values below 2^45 ns (~9.7 hours); larger ones are clamped */
+#define HDR_BUCKETS     ((HDR_OCTAVES + 1) << HDR_SUB_BITS)
+
+struct hdr_hist {
+  uint64_t count;
+  uint64_t sum;               /* ns */
+  uint64_t max;               /* ns */
+  uint64_t buckets[HDR_BUCKETS];
+};
+
+void hdr_record(struct hdr_hist *h, uint64_t ns);
+uint64_t hdr_quantile(const struct hdr_hist *h, double q);
+
+/* Exposition helpers, for the render callback */
+void metrics_family(FILE *f, const char *name, const char *type, const char *help);
+void metrics_hist(FILE *f, const char *name, const char *help, const struct hdr_hist *h);
+
+#define METRICS_INTERVAL_S  15  /* Default period of the textfile */
+
+int metrics_start(struct ev_loop *loop, const char *file, unsigned int interval_s,
+                  const char *socket_path, void (*render)(FILE *f));
+void metrics_stop(struct ev_loop *loop);
+
+#endif // __METRICS_H__
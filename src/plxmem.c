@@ -0,0 +1,75 @@
+/** @file: plxmem.c
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * Long-lived BAR0 mappings of the PLX switch register space
+ *
+ * Based on pcimem.c code
+ * Copyright (C) 2010, Bill Farrow (bfarrow@beyondelectronics.us)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "plxmem.h"
+
+void plx_bar_init(struct plx_bar *bar)
+{
+  bar->fd = -1;
+  bar->base = NULL;
+  bar->size = 0;
+  bar->phys = 0;
+}
+
+/*! @brief Maps the whole of a resource0 file; returns 0 or -errno */
+int plx_bar_map(struct plx_bar *bar, const char *path, uint64_t phys)
+{
+  struct stat st;
+  void *map_base;
+  int fd, err;
+
+  plx_bar_unmap(bar);
+  if ((fd = open(path, O_RDWR | O_SYNC)) == -1)
+    return -errno;
+  if (fstat(fd, &st) == -1) {
+    err = -errno;
+    close(fd);
+    return err;
+  }
+  if (st.st_size <= 0) {
+    /* Not every sysfs flavour reports the resource length */
+    st.st_size = sysconf(_SC_PAGE_SIZE);
+  }
+
+  map_base = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map_base == MAP_FAILED) {
+    err = -errno;
+    close(fd);
+    return err;
+  }
+
+  bar->fd = fd;
+  bar->base = map_base;
+  bar->size = st.st_size;
+  bar->phys = phys;
+  return 0;
+}
+
+void plx_bar_unmap(struct plx_bar *bar)
+{
+  if (bar->base)
+    munmap((void *)bar->base, bar->size);
+  if (bar->fd >= 0)
+    close(bar->fd);
+  plx_bar_init(bar);
+}
@@ -0,0 +1,63 @@
+/** @file: plxmem.h
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * Long-lived BAR0 mappings of the PLX switch register space
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#ifndef __PLXMEM_H__
+#define __PLXMEM_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct plx_bar {
+  int fd;                     /* resource0 of the upstream port, -1 if unmapped */
+  volatile uint32_t *base;    /* Start of the mapping */
+  size_t size;                /* Length of the mapping in bytes */
+  uint64_t phys;              /* BAR0 address the mapping was made for */
+};
+
+void plx_bar_init(struct plx_bar *bar);
+int plx_bar_map(struct plx_bar *bar, const char *path, uint64_t phys);
+void plx_bar_unmap(struct plx_bar *bar);
+
+static inline bool plx_bar_mapped(const struct plx_bar *bar)
+{
+  return bar->base != NULL;
+}
+
+static inline bool plx_bar_valid(const struct plx_bar *bar, uint32_t reg)
+{
+  return bar->base != NULL && !(reg & 3) && reg + 4 <= bar->size;
+}
+
+/* Register accessors; callers check plx_bar_valid() first */
+
+static inline uint32_t plx_bar_read32(struct plx_bar *bar, uint32_t reg)
+{
+  return bar->base[reg >> 2];
+}
+
+static inline void plx_bar_write32(struct plx_bar *bar, uint32_t reg, uint32_t val)
+{
+  bar->base[reg >> 2] = val;
+}
+
+/*! @brief Read-modify-write; returns the value written */
+static inline uint32_t plx_bar_rmw32(struct plx_bar *bar, uint32_t reg, uint32_t clear, uint32_t set)
+{
+  uint32_t val = (bar->base[reg >> 2] & ~clear) | set;
+  bar->base[reg >> 2] = val;
+  return val;
+}
+
+#endif // __PLXMEM_H__
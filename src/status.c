@@ -0,0 +1,218 @@
+/** @file: status.c
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * Status page: the daemon publishes every adapter's and port's current
+ * state in a POSIX shared memory segment, which other processes map
+ * read-only and read without system calls or locks
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "status.h"
+
+#define STATUS_READ_TRIES   1000    /* Give up on a record whose writer died mid-update */
+
+/*! @brief Creates (or takes over) the segment and maps it for writing */
+struct status_page *status_create(void)
+{
+  struct status_page *sp;
+  struct timespec ts;
+  int fd;
+
+  if ((fd = shm_open(STATUS_SHM_NAME, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+    return NULL;
+  fchmod(fd, 0644); /* Readable by unprivileged agents whatever our umask */
+  if (ftruncate(fd, sizeof(*sp)) < 0) {
+    close(fd);
+    shm_unlink(STATUS_SHM_NAME);
+    return NULL;
+  }
+  sp = mmap(NULL, sizeof(*sp), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (sp == MAP_FAILED) {
+    shm_unlink(STATUS_SHM_NAME);
+    return NULL;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  sp->version = STATUS_VERSION;
+  sp->pid = getpid();
+  sp->started_at = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  /* Readers check the magic first, so it goes in last */
+  __atomic_store_n(&sp->magic, STATUS_MAGIC, __ATOMIC_RELEASE);
+  return sp;
+}
+
+void status_destroy(struct status_page *sp)
+{
+  if (!sp)
+    return;
+  __atomic_store_n(&sp->magic, 0, __ATOMIC_RELEASE);
+  munmap(sp, sizeof(*sp));
+  shm_unlink(STATUS_SHM_NAME);
+}
+
+/*! @brief Marks the record guarded by @seq as being updated */
+void status_write_begin(uint32_t *seq)
+{
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+  /* The odd count must be visible before any of the new contents */
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/*! @brief Publishes the record guarded by @seq */
+void status_write_end(uint32_t *seq)
+{
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/*! @brief Copies @size bytes of a record from @src once its @seq shows no update in progress */
+static bool status_read(const uint32_t *seq, void *dst, const void *src, size_t size)
+{
+  uint32_t s1, s2;
+  int tries;
+
+  for (tries = 0; tries < STATUS_READ_TRIES; tries++) {
+    s1 = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+    if (s1 & 1)
+      continue;
+    memcpy(dst, src, size);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    s2 = __atomic_load_n(seq, __ATOMIC_RELAXED);
+    if (s1 == s2)
+      return true;
+  }
+  return false;
+}
+
+/*! @brief Maps the daemon's status page read-only; NULL with errno set if there is none */
+const struct status_page *status_open(void)
+{
+  const struct status_page *sp;
+  struct stat st;
+  int fd;
+
+  if ((fd = shm_open(STATUS_SHM_NAME, O_RDONLY | O_CLOEXEC, 0)) < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*sp)) {
+    close(fd);
+    errno = EPROTO;
+    return NULL;
+  }
+  sp = mmap(NULL, sizeof(*sp), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (sp == MAP_FAILED)
+    return NULL;
+  if (__atomic_load_n(&sp->magic, __ATOMIC_ACQUIRE) != STATUS_MAGIC ||
+      sp->version != STATUS_VERSION) {
+    munmap((void *)sp, sizeof(*sp));
+    errno = EPROTO;
+    return NULL;
+  }
+  return sp;
+}
+
+void status_close(const struct status_page *sp)
+{
+  if (sp)
+    munmap((void *)sp, sizeof(*sp));
+}
+
+/*! @brief Takes a consistent copy of adapter @i; false if there is no such adapter */
+bool status_read_adapter(const struct status_page *sp, unsigned int i, struct status_adapter *out)
+{
+  uint32_t n;
+
+  if (!status_read(&sp->seq, &n, &sp->nadapters, sizeof(n)) || i >= n || i >= STATUS_MAX_ADAPTERS)
+    return false;
+  return status_read(&sp->adapters[i].seq, out, &sp->adapters[i], sizeof(*out));
+}
+
+/*! @brief Takes a consistent copy of port @i; false if there is no such port */
+bool status_read_port(const struct status_page *sp, unsigned int i, struct status_port *out)
+{
+  uint32_t n;
+
+  if (!status_read(&sp->seq, &n, &sp->nports, sizeof(n)) || i >= n || i >= STATUS_MAX_PORTS)
+    return false;
+  return status_read(&sp->ports[i].seq, out, &sp->ports[i], sizeof(*out));
+}
+
+static void status_ago(char *buf, size_t size, uint64_t now, uint64_t then)
+{
+  uint64_t ms;
+
+  if (!then) {
+    snprintf(buf, size, "-");
+    return;
+  }
+  ms = now > then ? (now - then) / 1000000 : 0;
+  if (ms < 10000)
+    snprintf(buf, size, "%llums", (unsigned long long)ms);
+  else
+    snprintf(buf, size, "%llus", (unsigned long long)(ms / 1000));
+}
+
+static void status_link(char *buf, size_t size, unsigned int speed, unsigned int width)
+{
+  if (speed)
+    snprintf(buf, size, "Gen%u x%u", speed, width);
+  else
+    snprintf(buf, size, "-");
+}
+
+/*! @brief Prints the running daemon's status page, for --status */
+int status_show(void)
+{
+  const struct status_page *sp;
+  struct status_adapter ad;
+  struct status_port p;
+  struct timespec ts;
+  char cur[16], cap[16], since[16], seen[16];
+  unsigned int i, j;
+  uint64_t now;
+
+  if ((sp = status_open()) == NULL) {
+    fprintf(stderr, "adnacom-hp: No status page (%s), is the daemon running?\n", strerror(errno));
+    return -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts); /* vDSO, no system call */
+  now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+  printf("Daemon pid %d, up %llus\n", sp->pid,
+         (unsigned long long)((now - sp->started_at) / 1000000000ULL));
+  for (i = 0; status_read_adapter(sp, i, &ad); i++) {
+    printf("Adapter %s: %u port(s), sampled every %uus\n", ad.bdf, ad.nports, ad.interval_us);
+    printf("  %-13s %-10s %-9s %-9s %-3s %-7s %-8s %-5s %-5s %-5s %s\n", "Port", "State",
+           "Link", "LnkCap", "Hub", "Since", "Sampled", "Downs", "Bnc", "Rcv", "Fail");
+    for (j = 0; status_read_port(sp, j, &p); j++) {
+      if (p.adapter != i)
+        continue;
+      status_link(cur, sizeof(cur), p.speed, p.width);
+      status_link(cap, sizeof(cap), p.cap_speed, p.cap_width);
+      status_ago(since, sizeof(since), now, p.state_since);
+      status_ago(seen, sizeof(seen), now, p.sampled_at);
+      printf("  %-13s %-10s %-9s %-9s %-3s %-7s %-8s %-5llu %-5llu %-5llu %llu\n",
+             p.bdf, p.state, p.link_up ? cur : "Down", cap, p.hub_up ? "yes" : "no",
+             since, seen, (unsigned long long)p.link_down_cnt, (unsigned long long)p.bounce_cnt,
+             (unsigned long long)p.recover_cnt, (unsigned long long)p.fail_cnt);
+    }
+  }
+  status_close(sp);
+  return 0;
+}
@@ -0,0 +1,80 @@
+/** @file: status.h
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * Status page: the daemon publishes every adapter's and port's current
+ * state in a POSIX shared memory segment, which other processes map
+ * read-only and read without system calls or locks
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#ifndef __STATUS_H__
+#define __STATUS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define STATUS_SHM_NAME     "/adnacom-hp"
+#define STATUS_MAGIC        0x41444e41  /* "ADNA" */
+#define STATUS_VERSION      1
+#define STATUS_MAX_ADAPTERS 16
+#define STATUS_MAX_PORTS    64
+
+/*
+ * Every record is guarded by its own sequence count, written only by the
+ * daemon: odd while the record is being updated, bumped again when done.
+ * A reader copies the record and retries if the count was odd or moved.
+ * Times are CLOCK_MONOTONIC nanoseconds, comparable across processes.
+ */
+struct status_adapter {
+  uint32_t seq;
+  char bdf[16];               /* Upstream port */
+  uint32_t interval_us;       /* Current sampling interval */
+  uint32_t nports;
+};
+
+struct status_port {
+  uint32_t seq;
+  char bdf[16];
+  char state[12];             /* Down, Training, Up, Recovering, Damped or Skipped */
+  uint8_t adapter;            /* Index into the adapter table */
+  uint8_t link_up, hub_up, damped;
+  uint8_t speed, width;       /* Current link, 0 if unknown */
+  uint8_t cap_speed, cap_width; /* From LNKCAP, 0 if unknown */
+  uint64_t state_since;       /* Last FSM transition */
+  uint64_t sampled_at;        /* Last sample */
+  uint64_t link_up_cnt, link_down_cnt, bounce_cnt, flap_cnt;
+  uint64_t recover_cnt, fail_cnt, io_err_cnt;
+};
+
+struct status_page {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seq;               /* Guards the counts below */
+  int32_t pid;                /* Publishing daemon */
+  uint64_t started_at;
+  uint32_t nadapters, nports;
+  struct status_adapter adapters[STATUS_MAX_ADAPTERS];
+  struct status_port ports[STATUS_MAX_PORTS];
+};
+
+/* Daemon side */
+struct status_page *status_create(void);
+void status_destroy(struct status_page *sp);
+void status_write_begin(uint32_t *seq);
+void status_write_end(uint32_t *seq);
+
+/* Client side: after status_open() a snapshot is a few loads, no syscalls */
+const struct status_page *status_open(void);
+void status_close(const struct status_page *sp);
+bool status_read_adapter(const struct status_page *sp, unsigned int i, struct status_adapter *out);
+bool status_read_port(const struct status_page *sp, unsigned int i, struct status_port *out);
+int status_show(void);
+
+#endif // __STATUS_H__
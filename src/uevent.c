@@ -0,0 +1,119 @@
+/** @file: uevent.c
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * Kernel uevent (NETLINK_KOBJECT_UEVENT) listener for PCI devices
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "uevent.h"
+
+#define UEVENT_KERNEL_GROUP   1
+#define UEVENT_RCVBUF         (1024 * 1024)
+
+/*! @brief Opens a non-blocking socket on the kernel uevent multicast group */
+int uevent_open(void)
+{
+  struct sockaddr_nl addr;
+  int fd, size = UEVENT_RCVBUF;
+
+  fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+  if (fd < 0)
+    return -errno;
+
+  /* Event storms during a rescan must not overflow the socket */
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = UEVENT_KERNEL_GROUP;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    int err = -errno;
+    close(fd);
+    return err;
+  }
+  return fd;
+}
+
+static enum uevent_action uevent_parse_action(const char *s)
+{
+  if (!strcmp(s, "add"))
+    return UEVENT_ADD;
+  if (!strcmp(s, "remove"))
+    return UEVENT_REMOVE;
+  if (!strcmp(s, "bind"))
+    return UEVENT_BIND;
+  if (!strcmp(s, "unbind"))
+    return UEVENT_UNBIND;
+  return UEVENT_OTHER;
+}
+
+/*! @brief Parses the @n bytes of one message in @buf, which must have room for a terminating NUL
+ *
+ * Returns 1 for a PCI device event, 0 for anything else.
+ */
+int uevent_parse(char *buf, size_t n, struct uevent *ev)
+{
+  const char *key, *end, *name;
+  int is_pci = 0, has_slot = 0;
+
+  /* "action@devpath\0KEY=value\0KEY=value\0..." */
+  buf[n] = 0;
+  end = buf + n;
+  if (!strchr(buf, '@'))
+    return 0;
+
+  memset(ev, 0, sizeof(*ev));
+  for (key = buf + strlen(buf) + 1; key < end; key += strlen(key) + 1) {
+    if (!strncmp(key, "ACTION=", 7))
+      ev->action = uevent_parse_action(key + 7);
+    else if (!strcmp(key, "SUBSYSTEM=pci"))
+      is_pci = 1;
+    else if (!strncmp(key, "PCI_SLOT_NAME=", 14))
+      has_slot = sscanf(key + 14, "%x:%x:%x.%x",
+                        &ev->domain, &ev->bus, &ev->dev, &ev->func) == 4;
+  }
+  if (is_pci && !has_slot && (name = strrchr(buf, '/')) != NULL)
+    has_slot = sscanf(name + 1, "%x:%x:%x.%x",
+                      &ev->domain, &ev->bus, &ev->dev, &ev->func) == 4;
+  return is_pci && has_slot;
+}
+
+/*! @brief Receives one message
+ *
+ * Returns 1 for a PCI device event, 0 for anything else (other subsystems,
+ * messages not sent by the kernel), -EAGAIN when drained and -ENOBUFS when
+ * events were lost and the caller has to resynchronise.
+ */
+int uevent_recv(int fd, char *buf, size_t len, struct uevent *ev)
+{
+  struct sockaddr_nl addr;
+  struct iovec iov = { buf, len - 1 };
+  struct msghdr msg;
+  ssize_t n;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &addr;
+  msg.msg_namelen = sizeof(addr);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if ((n = recvmsg(fd, &msg, 0)) < 0)
+    return -errno;
+  if (addr.nl_pid != 0 || (msg.msg_flags & MSG_TRUNC))
+    return 0;
+  return uevent_parse(buf, n, ev);
+}
@@ -0,0 +1,39 @@
+/** @file: uevent.h
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * Kernel uevent (NETLINK_KOBJECT_UEVENT) listener for PCI devices
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#ifndef __UEVENT_H__
+#define __UEVENT_H__
+
+#include <stddef.h>
+
+#define UEVENT_BUFSIZE  8192
+
+enum uevent_action {
+  UEVENT_OTHER,
+  UEVENT_ADD,
+  UEVENT_REMOVE,
+  UEVENT_BIND,
+  UEVENT_UNBIND
+};
+
+struct uevent {
+  enum uevent_action action;
+  unsigned int domain, bus, dev, func;  /* From PCI_SLOT_NAME */
+};
+
+int uevent_open(void);
+int uevent_parse(char *buf, size_t n, struct uevent *ev);
+int uevent_recv(int fd, char *buf, size_t len, struct uevent *ev);
+
+#endif // __UEVENT_H__
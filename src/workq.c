@@ -0,0 +1,242 @@
+/** @file: workq.c
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * Worker pool fed through lock-free queues: one SPSC ring per worker
+ * carries jobs from the submitting thread, and a shared MPSC stack brings
+ * finished jobs back, signalled on an eventfd
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "workq.h"
+
+int wq_spsc_init(struct wq_spsc *q, unsigned int capacity)
+{
+  unsigned int size = 1;
+
+  while (size < capacity)
+    size <<= 1;
+  q->slots = calloc(size, sizeof(void *));
+  if (!q->slots)
+    return -ENOMEM;
+  q->mask = size - 1;
+  q->head = q->tail = 0;
+  return 0;
+}
+
+void wq_spsc_free(struct wq_spsc *q)
+{
+  free(q->slots);
+  q->slots = NULL;
+}
+
+/*! @brief Producer side; returns false if the ring is full */
+bool wq_spsc_push(struct wq_spsc *q, void *item)
+{
+  unsigned int tail = q->tail;
+
+  if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) > q->mask)
+    return false;
+  q->slots[tail & q->mask] = item;
+  __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+/*! @brief Consumer side; returns NULL if the ring is empty */
+void *wq_spsc_pop(struct wq_spsc *q)
+{
+  unsigned int head = q->head;
+  void *item;
+
+  if (head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  item = q->slots[head & q->mask];
+  __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+  return item;
+}
+
+void wq_mpsc_push(struct wq_mpsc *q, struct wq_job *job)
+{
+  struct wq_job *top = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+
+  do {
+    job->next = top;
+  } while (!__atomic_compare_exchange_n(&q->top, &top, job, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*! @brief Takes everything pushed so far, oldest first */
+struct wq_job *wq_mpsc_take(struct wq_mpsc *q)
+{
+  struct wq_job *job = __atomic_exchange_n(&q->top, NULL, __ATOMIC_ACQUIRE);
+  struct wq_job *fifo = NULL, *next;
+
+  for (; job; job = next) {
+    next = job->next;
+    job->next = fifo;
+    fifo = job;
+  }
+  return fifo;
+}
+
+static void *wq_worker_main(void *arg)
+{
+  struct wq_worker *w = arg;
+  struct wq_pool *pool = w->pool;
+  struct wq_job *job;
+  eventfd_t cnt;
+  sigset_t all;
+
+  /* Signals are for the submitting thread's event loop */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+  if (pool->thread_init)
+    pool->thread_init(w->id);
+  for (;;) {
+    while ((job = wq_spsc_pop(&w->jobs)) != NULL) {
+      if (__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)) {
+        job->status = -ECANCELED;
+      } else {
+        pool->run(job);
+        job->status = 0;
+      }
+      wq_mpsc_push(&pool->done, job);
+      eventfd_write(pool->done_fd, 1);
+    }
+    if (__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE))
+      break;
+    eventfd_read(w->wake_fd, &cnt);
+  }
+  if (pool->thread_fini)
+    pool->thread_fini(w->id);
+  return NULL;
+}
+
+/*! @brief Starts @count workers, each accepting up to @depth queued jobs
+ *
+ * @run is called on a worker thread for every submitted job. @thread_init
+ * and @thread_fini, if set, run on each worker as it starts and exits.
+ */
+int wq_pool_start(struct wq_pool *pool, int count, unsigned int depth,
+                  void (*run)(struct wq_job *job),
+                  void (*thread_init)(int id), void (*thread_fini)(int id))
+{
+  struct wq_worker *w;
+  int i, err;
+
+  memset(pool, 0, sizeof(*pool));
+  pool->run = run;
+  pool->thread_init = thread_init;
+  pool->thread_fini = thread_fini;
+  if ((pool->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    return -errno;
+  if ((pool->workers = calloc(count, sizeof(*pool->workers))) == NULL) {
+    close(pool->done_fd);
+    pool->done_fd = -1;
+    return -ENOMEM;
+  }
+
+  for (i = 0; i < count; i++) {
+    w = &pool->workers[i];
+    w->pool = pool;
+    w->id = i;
+    w->wake_fd = -1;
+    pool->count++;
+    if ((err = wq_spsc_init(&w->jobs, depth)) < 0)
+      goto fail;
+    if ((w->wake_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+      err = -errno;
+      goto fail;
+    }
+    if ((err = pthread_create(&w->thread, NULL, wq_worker_main, w)) != 0) {
+      err = -err;
+      goto fail;
+    }
+    w->started = true;
+  }
+  return 0;
+
+fail:
+  wq_pool_stop(pool);
+  return err;
+}
+
+/*! @brief Stops and joins all workers
+ *
+ * Returns every job not yet reaped, oldest first. Jobs that were still
+ * queued have not run and carry status -ECANCELED.
+ */
+struct wq_job *wq_pool_stop(struct wq_pool *pool)
+{
+  struct wq_job *left;
+  struct wq_worker *w;
+  int i;
+
+  __atomic_store_n(&pool->stop, true, __ATOMIC_RELEASE);
+  for (i = 0; i < pool->count; i++) {
+    w = &pool->workers[i];
+    if (w->started) {
+      eventfd_write(w->wake_fd, 1);
+      pthread_join(w->thread, NULL);
+      w->started = false;
+    }
+    if (w->wake_fd >= 0)
+      close(w->wake_fd);
+    w->wake_fd = -1;
+    wq_spsc_free(&w->jobs);
+  }
+  free(pool->workers);
+  pool->workers = NULL;
+  pool->count = 0;
+
+  left = wq_mpsc_take(&pool->done);
+  if (pool->done_fd >= 0)
+    close(pool->done_fd);
+  pool->done_fd = -1;
+  return left;
+}
+
+/*! @brief Queues @job on the worker selected by @key
+ *
+ * Jobs with the same key always run on the same worker, in submission
+ * order. Must only be called from one thread. Returns -EAGAIN if that
+ * worker's queue is full.
+ */
+int wq_submit(struct wq_pool *pool, struct wq_job *job, unsigned int key)
+{
+  struct wq_worker *w;
+
+  if (pool->stop || !pool->count)
+    return -ESHUTDOWN;
+  w = &pool->workers[key % pool->count];
+  job->next = NULL;
+  job->status = 0;
+  if (!wq_spsc_push(&w->jobs, job))
+    return -EAGAIN;
+  eventfd_write(w->wake_fd, 1);
+  return 0;
+}
+
+/*! @brief Returns the jobs finished since the last call, oldest first */
+struct wq_job *wq_reap(struct wq_pool *pool)
+{
+  eventfd_t cnt;
+
+  if (pool->done_fd >= 0)
+    eventfd_read(pool->done_fd, &cnt);
+  return wq_mpsc_take(&pool->done);
+}
@@ -0,0 +1,79 @@
+/** @file: workq.h
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * Worker pool fed through lock-free queues: one SPSC ring per worker
+ * carries jobs from the submitting thread, and a shared MPSC stack brings
+ * finished jobs back, signalled on an eventfd
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#ifndef __WORKQ_H__
+#define __WORKQ_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/* Single producer, single consumer ring of pointers */
+struct wq_spsc {
+  void **slots;
+  unsigned int mask;          /* Capacity - 1, capacity is a power of two */
+  unsigned int head;          /* Next slot to pop, written by the consumer */
+  unsigned int tail;          /* Next slot to push, written by the producer */
+};
+
+int wq_spsc_init(struct wq_spsc *q, unsigned int capacity);
+void wq_spsc_free(struct wq_spsc *q);
+bool wq_spsc_push(struct wq_spsc *q, void *item);
+void *wq_spsc_pop(struct wq_spsc *q);
+
+/* Embedded in the caller's job structure */
+struct wq_job {
+  struct wq_job *next;        /* Link on the completion stack */
+  int status;                 /* 0 once run, -ECANCELED if dropped at shutdown */
+};
+
+/* Multiple producer, single consumer stack of finished jobs */
+struct wq_mpsc {
+  struct wq_job *top;
+};
+
+void wq_mpsc_push(struct wq_mpsc *q, struct wq_job *job);
+struct wq_job *wq_mpsc_take(struct wq_mpsc *q);
+
+struct wq_pool;
+
+struct wq_worker {
+  pthread_t thread;
+  struct wq_pool *pool;
+  struct wq_spsc jobs;
+  int wake_fd;                /* eventfd, kicked on every submit */
+  int id;
+  bool started;
+};
+
+struct wq_pool {
+  struct wq_worker *workers;
+  int count;
+  int done_fd;                /* eventfd, readable when jobs have finished */
+  struct wq_mpsc done;
+  bool stop;
+  void (*run)(struct wq_job *job);
+  void (*thread_init)(int id);
+  void (*thread_fini)(int id);
+};
+
+int wq_pool_start(struct wq_pool *pool, int count, unsigned int depth,
+                  void (*run)(struct wq_job *job),
+                  void (*thread_init)(int id), void (*thread_fini)(int id));
+struct wq_job *wq_pool_stop(struct wq_pool *pool);
+int wq_submit(struct wq_pool *pool, struct wq_job *job, unsigned int key);
+struct wq_job *wq_reap(struct wq_pool *pool);
+
+#endif // __WORKQ_H__
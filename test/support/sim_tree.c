@@ -0,0 +1,188 @@
+/** @file: sim_tree.c
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * Test fixtures: simulated sysfs trees from adnacom-sim, and files
+ * standing in for an ECAM region
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "sim_tree.h"
+
+#define SIM_TREE_TEMPLATE   "/tmp/adnacom-test.XXXXXX"
+#define SIM_TREE_START_MS   5000
+
+/*! @brief Whether the simulator has been built; tests that need it are skipped otherwise */
+bool sim_tree_available(void)
+{
+  return access(SIM_TREE_EXEC, X_OK) == 0;
+}
+
+static int sim_tree_mkdtemp(char *dir, size_t size)
+{
+  if (size < sizeof(SIM_TREE_TEMPLATE))
+    return -1;
+  strcpy(dir, SIM_TREE_TEMPLATE);
+  return mkdtemp(dir) ? 0 : -1;
+}
+
+/*! @brief Builds a tree with `adnacom-sim -g @args` in a new directory, returned in @dir */
+int sim_tree_create(char *dir, size_t size, const char *args)
+{
+  char cmd[512];
+
+  if (sim_tree_mkdtemp(dir, size) < 0)
+    return -1;
+  snprintf(cmd, sizeof(cmd), "%s -g %s %s >/dev/null 2>&1", SIM_TREE_EXEC, args, dir);
+  return system(cmd) == 0 ? 0 : -1;
+}
+
+/*! @brief Starts the simulator on a new tree, playing @script
+ *
+ * Returns once the tree is in place, or -1. The simulator's messages go
+ * to <dir>.log.
+ */
+pid_t sim_tree_start(char *dir, size_t size, const char *args, const char *script)
+{
+  char path[PATH_MAX], log[PATH_MAX], cmd[3 * PATH_MAX];
+  struct timespec ts = { 0, 10 * 1000000 };
+  struct stat st;
+  FILE *f;
+  pid_t pid;
+  int i;
+
+  if (sim_tree_mkdtemp(dir, size) < 0)
+    return -1;
+  snprintf(path, sizeof(path), "%s.script", dir);
+  snprintf(log, sizeof(log), "%s.log", dir);
+  if ((f = fopen(path, "w")) == NULL)
+    return -1;
+  fputs(script, f);
+  fclose(f);
+  snprintf(cmd, sizeof(cmd), "exec %s %s -s %s %s >%s 2>&1", SIM_TREE_EXEC, args, path, dir, log);
+
+  if ((pid = fork()) < 0)
+    return -1;
+  if (pid == 0) {
+    execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+    _exit(127);
+  }
+  /* The first line of the log says the tree is complete */
+  for (i = 0; i < SIM_TREE_START_MS / 10; i++) {
+    if (stat(log, &st) == 0 && st.st_size > 0)
+      return pid;
+    if (waitpid(pid, NULL, WNOHANG) == pid)
+      return -1;
+    nanosleep(&ts, NULL);
+  }
+  sim_tree_stop(pid);
+  return -1;
+}
+
+void sim_tree_stop(pid_t pid)
+{
+  if (pid <= 0)
+    return;
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+}
+
+static int sim_tree_unlink(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+  (void)(st);
+  (void)(flag);
+  (void)(ftw);
+  remove(path);
+  return 0;
+}
+
+void sim_tree_remove(const char *dir)
+{
+  char path[PATH_MAX];
+
+  if (!dir[0])
+    return;
+  nftw(dir, sim_tree_unlink, 16, FTW_DEPTH | FTW_PHYS);
+  snprintf(path, sizeof(path), "%s.script", dir);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s.log", dir);
+  unlink(path);
+}
+
+/*! @brief Counts the files below @dir this process has open */
+int sim_tree_count_fds(const char *dir)
+{
+  char link[PATH_MAX], target[PATH_MAX];
+  struct dirent *entry;
+  DIR *d;
+  ssize_t n;
+  int cnt = 0;
+
+  if ((d = opendir("/proc/self/fd")) == NULL)
+    return -1;
+  while ((entry = readdir(d)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+    snprintf(link, sizeof(link), "/proc/self/fd/%s", entry->d_name);
+    if ((n = readlink(link, target, sizeof(target) - 1)) <= 0)
+      continue;
+    target[n] = 0;
+    if (!strncmp(target, dir, strlen(dir)) && target[strlen(dir)] == '/')
+      cnt++;
+  }
+  closedir(d);
+  return cnt;
+}
+
+/*! @brief Creates a file standing in for the ECAM region of @buses buses, all zeros */
+int ecam_file_create(char *path, size_t size, int buses)
+{
+  int fd;
+
+  if (size < sizeof("/tmp/adnacom-ecam.XXXXXX"))
+    return -1;
+  strcpy(path, "/tmp/adnacom-ecam.XXXXXX");
+  if ((fd = mkstemp(path)) < 0)
+    return -1;
+  if (ftruncate(fd, (off_t)buses << 20) < 0) {
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+/*! @brief Writes the first @len bytes of the config space of @bus:@dev.@func */
+int ecam_file_put(const char *path, int bus, int dev, int func, const uint8_t *conf, size_t len)
+{
+  off_t pos = (off_t)bus << 20 | dev << 15 | func << 12;
+  int fd;
+  ssize_t n;
+
+  if ((fd = open(path, O_WRONLY)) < 0)
+    return -1;
+  n = pwrite(fd, conf, len, pos);
+  close(fd);
+  return n == (ssize_t)len ? 0 : -1;
+}
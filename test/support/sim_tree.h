@@ -0,0 +1,37 @@
+/** @file: sim_tree.h
+ *
+ * Adnacom PCIe Hotplug Tool
+ * Copyright (C) 2022-2023, Adnacom Inc
+ *
+ * Test fixtures: simulated sysfs trees from adnacom-sim, and files
+ * standing in for an ECAM region
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#ifndef __SIM_TREE_H__
+#define __SIM_TREE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SIM_TREE_EXEC   "./adnacom-sim"
+#define SIM_TREE_HP     "./adnacom-hp"
+
+bool sim_tree_available(void);
+int sim_tree_create(char *dir, size_t size, const char *args);
+pid_t sim_tree_start(char *dir, size_t size, const char *args, const char *script);
+void sim_tree_stop(pid_t pid);
+void sim_tree_remove(const char *dir);
+int sim_tree_count_fds(const char *dir);
+
+int ecam_file_create(char *path, size_t size, int buses);
+int ecam_file_put(const char *path, int bus, int dev, int func, const uint8_t *conf, size_t len);
+
+#endif // __SIM_TREE_H__
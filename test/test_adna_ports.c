@@ -0,0 +1,331 @@
+#ifdef TEST
+
+/*
+ * The port logic is static in adna.c, so it is built into the test, as
+ * for adnacom-bench. ev_now() is mocked and serves as the clock.
+ */
+#include "adna.c"
+
+#include "unity.h"
+
+#include "mock_evloop.h"
+#include "common.h"
+#include "setpci.h"
+#include "ls-caps.h"
+#include "plxmem.h"
+#include "uevent.h"
+#include "workq.h"
+#include "arena.h"
+#include "devindex.h"
+#include "log.h"
+#include "metrics.h"
+#include "status.h"
+
+TEST_FILE("ls-ecaps.c")
+TEST_FILE("ls-caps-vendor.c")
+TEST_FILE("ls-kernel.c")
+TEST_FILE("ls-map.c")
+TEST_FILE("ls-tree.c")
+TEST_FILE("ls-vpd.c")
+
+#define MS(x)       ((uint64_t)(x) * NSEC_PER_MSEC)
+#define T0          MS(1000)    /* ev_now() is never 0 for the daemon */
+#define EXP_CAP     0x40
+#define LNK_GEN3_X4 (3 | 4 << 4)
+
+static struct adna_adapter adapter;
+static struct adna_device port;
+static struct device dev;
+static struct pci_filter port_filter;
+
+void setUp(void)
+{
+    memset(&adapter, 0, sizeof(adapter));
+    memset(&port, 0, sizeof(port));
+    memset(&port_filter, 0, sizeof(port_filter));
+    port_filter.bus = 2;
+    port_filter.slot = 1;
+    port.adapter = &adapter;
+    port.this = &port_filter;
+    port.dev = &dev;
+    port.exp_cap = EXP_CAP;
+    port.lnkcap = LNK_GEN3_X4;
+    port.sampled = true;
+    first_adna = &port;
+    rescan_credit = rescan_credit_at = 0;
+    memset(&AdnaOptions, 0, sizeof(AdnaOptions));
+}
+
+void tearDown(void)
+{
+    first_adna = NULL;
+}
+
+/*! @brief Puts a sample of the port's link in place, as adna_sample_ports() would */
+static void set_link(bool up, int children)
+{
+    uint16_t lnksta = up ? PCI_EXP_LNKSTA_DL_ACT | LNK_GEN3_X4 : 0;
+    int pos = PCI_EXP_LNKSTA - PCI_EXP_LNKCTL;
+
+    port.sample[pos] = lnksta & 0xff;
+    port.sample[pos + 1] = lnksta >> 8;
+    port.children = children;
+}
+
+static void check_at(uint64_t now)
+{
+    ev_now_IgnoreAndReturn(now);
+    adna_check_port(&port);
+}
+
+void test_adna_PenaltyHalvesEveryHalfLife(void)
+{
+    port_update_damping(&port, true, T0, "02:01.0");
+    TEST_ASSERT_EQUAL(ADNA_FLAP_PENALTY, port.penalty);
+
+    port_decay_penalty(&port, T0 + MS(ADNA_FLAP_HALF_LIFE_MS));
+    TEST_ASSERT_EQUAL(ADNA_FLAP_PENALTY / 2, port.penalty);
+    port_decay_penalty(&port, T0 + MS(ADNA_FLAP_HALF_LIFE_MS * 3 / 2));
+    TEST_ASSERT_UINT_WITHIN(1, ADNA_FLAP_PENALTY * 707 / 2000, port.penalty);
+    port_decay_penalty(&port, T0 + MS(ADNA_FLAP_HALF_LIFE_MS * 40));
+    TEST_ASSERT_EQUAL(0, port.penalty);
+}
+
+/* Damping starts above the suppress threshold and only ends below the reuse one */
+void test_adna_DampingSuppressesAndReuses(void)
+{
+    int i;
+
+    for (i = 0; i < 3; i++)
+        port_update_damping(&port, true, T0, "02:01.0");
+    TEST_ASSERT_FALSE(port.damped);
+    port_update_damping(&port, true, T0, "02:01.0");
+    TEST_ASSERT_TRUE(port.damped);
+    TEST_ASSERT_EQUAL(4, port.flap_cnt);
+
+    /* 1000 after two half-lives: below suppress, still above reuse */
+    port_update_damping(&port, false, T0 + MS(2 * ADNA_FLAP_HALF_LIFE_MS), "02:01.0");
+    TEST_ASSERT_EQUAL(1000, port.penalty);
+    TEST_ASSERT_TRUE(port.damped);
+
+    port_update_damping(&port, false, T0 + MS(5 * ADNA_FLAP_HALF_LIFE_MS / 2), "02:01.0");
+    TEST_ASSERT_LESS_THAN(ADNA_FLAP_REUSE, port.penalty);
+    TEST_ASSERT_FALSE(port.damped);
+}
+
+void test_adna_PenaltyIsCapped(void)
+{
+    int i;
+
+    for (i = 0; i < 100; i++)
+        port_update_damping(&port, true, T0, "02:01.0");
+    TEST_ASSERT_EQUAL(ADNA_FLAP_REUSE << ADNA_FLAP_MAX_HALVINGS, port.penalty);
+
+    /* So damping ends about MAX_HALVINGS half-lives after the last flap */
+    port_update_damping(&port, false, T0 + MS(ADNA_FLAP_MAX_HALVINGS * ADNA_FLAP_HALF_LIFE_MS), "02:01.0");
+    TEST_ASSERT_EQUAL(ADNA_FLAP_REUSE, port.penalty);
+    TEST_ASSERT_TRUE(port.damped);
+    port_update_damping(&port, false, T0 + MS(ADNA_FLAP_MAX_HALVINGS * ADNA_FLAP_HALF_LIFE_MS +
+                                              ADNA_FLAP_HALF_LIFE_MS / 8), "02:01.0");
+    TEST_ASSERT_FALSE(port.damped);
+}
+
+void test_adna_RescanBucketRefills(void)
+{
+    uint64_t period = MS(60000 / ADNA_RESCAN_PER_MIN);
+    int i;
+
+    ev_now_IgnoreAndReturn(T0);
+    for (i = 0; i < ADNA_RESCAN_BURST; i++)
+        TEST_ASSERT_TRUE(rescan_token_take());
+    TEST_ASSERT_FALSE(rescan_token_take());
+
+    ev_now_IgnoreAndReturn(T0 + period - 1);
+    TEST_ASSERT_FALSE(rescan_token_take());
+    ev_now_IgnoreAndReturn(T0 + period);
+    TEST_ASSERT_TRUE(rescan_token_take());
+    TEST_ASSERT_FALSE(rescan_token_take());
+    rescan_token_return();
+    TEST_ASSERT_TRUE(rescan_token_take());
+
+    /* A long quiet spell buys no more than a burst */
+    ev_now_IgnoreAndReturn(T0 + 3600 * period);
+    for (i = 0; i < ADNA_RESCAN_BURST; i++)
+        TEST_ASSERT_TRUE(rescan_token_take());
+    TEST_ASSERT_FALSE(rescan_token_take());
+}
+
+void test_adna_RescanBucketFollowsOptions(void)
+{
+    AdnaOptions.RescanBurst = 1;
+    AdnaOptions.RescanPerMin = 600;
+
+    ev_now_IgnoreAndReturn(T0);
+    TEST_ASSERT_TRUE(rescan_token_take());
+    TEST_ASSERT_FALSE(rescan_token_take());
+    ev_now_IgnoreAndReturn(T0 + MS(100));
+    TEST_ASSERT_TRUE(rescan_token_take());
+}
+
+void test_adna_PortWithDevicesIsUp(void)
+{
+    set_link(true, 1);
+    check_at(T0);
+    TEST_ASSERT_EQUAL(PORT_ST_UP, port.state);
+    TEST_ASSERT_FALSE(port.queued);
+}
+
+/* Without a PCIe capability there is no link to read, so nothing is decided */
+void test_adna_PortWithoutPcieCapIsLeftAlone(void)
+{
+    port.exp_cap = 0;
+    port.unmonitored = true;
+    set_link(false, 0);
+    check_at(T0);
+    check_at(T0 + MS(ADNA_DOWN_RESET_MS + 1));
+    TEST_ASSERT_FALSE(port.seen);
+    TEST_ASSERT_FALSE(port.queued);
+    TEST_ASSERT_EQUAL(0, port.link_down_cnt);
+}
+
+/* Without the switch's registers a long outage is waited out, not failed over and over */
+void test_adna_PortThatCannotBeResetStaysDown(void)
+{
+    port.no_reset = true;
+    set_link(false, 0);
+    check_at(T0);
+    check_at(T0 + MS(100));
+    check_at(T0 + MS(100 + ADNA_DOWN_RESET_MS));
+    check_at(T0 + MS(100 + 10 * ADNA_DOWN_RESET_MS));
+    TEST_ASSERT_EQUAL(PORT_ST_DOWN, port.state);
+    TEST_ASSERT_FALSE(port.busy);
+    TEST_ASSERT_EQUAL(0, port.fail_cnt);
+    TEST_ASSERT_EQUAL(0, port.retry_at);
+}
+
+/* A link that comes up is left to train for ADNA_TRAIN_MS, then rescanned */
+void test_adna_PortTrainsBeforeItIsQueued(void)
+{
+    set_link(false, 0);
+    check_at(T0);
+    TEST_ASSERT_EQUAL(PORT_ST_DOWN, port.state);
+
+    set_link(true, 0);
+    check_at(T0 + MS(100));
+    TEST_ASSERT_EQUAL(PORT_ST_TRAINING, port.state);
+    TEST_ASSERT_EQUAL(1, port.link_up_cnt);
+    check_at(T0 + MS(100 + ADNA_TRAIN_MS - 1));
+    TEST_ASSERT_FALSE(port.queued);
+
+    check_at(T0 + MS(100 + ADNA_TRAIN_MS));
+    TEST_ASSERT_TRUE(port.queued);
+    TEST_ASSERT_TRUE(port.busy);
+    TEST_ASSERT_EQUAL(ADNA_ACT_RESCAN, port.queued_action);
+    TEST_ASSERT_EQUAL(T0 + MS(100 + ADNA_TRAIN_MS + ADNA_SETTLE_MS), adapter.settle_until);
+
+    check_at(T0 + MS(100 + ADNA_TRAIN_MS + 1));
+    TEST_ASSERT_EQUAL(PORT_ST_RECOVERING, port.state);
+}
+
+void test_adna_StaleDevicesBehindADownLinkAreRestored(void)
+{
+    set_link(true, 1);
+    check_at(T0);
+    set_link(false, 1);
+    check_at(T0 + MS(10));
+
+    TEST_ASSERT_EQUAL(PORT_ST_DOWN, port.state);
+    TEST_ASSERT_EQUAL(1, port.link_down_cnt);
+    TEST_ASSERT_TRUE(port.queued);
+    TEST_ASSERT_EQUAL(ADNA_ACT_RESTORE, port.queued_action);
+}
+
+void test_adna_FlappingPortIsDamped(void)
+{
+    uint64_t t = T0;
+    int i;
+
+    set_link(false, 0);
+    check_at(t);
+    for (i = 0; i < 4; i++) {
+        set_link(true, 0);
+        check_at(t += MS(10));
+        set_link(false, 0);
+        check_at(t += MS(10));
+    }
+    TEST_ASSERT_EQUAL(4, port.flap_cnt);
+    TEST_ASSERT_EQUAL(PORT_ST_DAMPED, port.state);
+
+    /* Even a link that stays up is left alone */
+    set_link(true, 0);
+    check_at(t += MS(10 * ADNA_TRAIN_MS));
+    TEST_ASSERT_EQUAL(PORT_ST_DAMPED, port.state);
+    TEST_ASSERT_FALSE(port.queued);
+}
+
+/* Without a token the port waits in the queue; the flush is tried again on later ticks */
+void test_adna_ExhaustedBucketKeepsThePortQueued(void)
+{
+    uint64_t t = T0 + MS(100 + ADNA_TRAIN_MS);
+
+    set_link(true, 0);
+    check_at(T0 + MS(100));
+    check_at(t);
+    TEST_ASSERT_TRUE(port.queued);
+
+    rescan_credit_at = t;
+    rescan_credit = 0;
+    ev_now_IgnoreAndReturn(adapter.settle_until);
+    adapter_flush(&adapter, adapter.settle_until);
+    TEST_ASSERT_TRUE(port.queued);
+    TEST_ASSERT_NOT_EQUAL(0, adapter.settle_until);
+    TEST_ASSERT_EQUAL(1, port.throttled_cnt);
+}
+
+/* A port whose link dropped while it waited is not rescanned, and its token is given back */
+void test_adna_QueuedPortIsDecidedAgainOnFlush(void)
+{
+    uint64_t t = T0 + MS(100 + ADNA_TRAIN_MS);
+    uint64_t cap = MS(60000 / ADNA_RESCAN_PER_MIN) * ADNA_RESCAN_BURST;
+
+    set_link(true, 0);
+    check_at(T0 + MS(100));
+    check_at(t);
+    TEST_ASSERT_TRUE(port.queued);
+
+    set_link(false, 0);
+    t = adapter.settle_until;
+    ev_now_IgnoreAndReturn(t);
+    adapter_flush(&adapter, t);
+    TEST_ASSERT_FALSE(port.queued);
+    TEST_ASSERT_FALSE(port.busy);
+    TEST_ASSERT_EQUAL(0, adapter.settle_until);
+    TEST_ASSERT_EQUAL(cap, rescan_credit);
+    TEST_ASSERT_EQUAL(0, rescans_total);
+
+    check_at(t + MS(1));
+    TEST_ASSERT_EQUAL(PORT_ST_DOWN, port.state);
+}
+
+/* A re-enumeration may lose a queued port; it must not be read from then */
+void test_adna_QueuedPortThatWentAwayIsDropped(void)
+{
+    uint64_t cap = MS(60000 / ADNA_RESCAN_PER_MIN) * ADNA_RESCAN_BURST;
+    uint64_t t;
+
+    set_link(true, 0);
+    check_at(T0 + MS(100));
+    check_at(T0 + MS(100 + ADNA_TRAIN_MS));
+    TEST_ASSERT_TRUE(port.queued);
+
+    port.dev = NULL;
+    port.exp_cap = 0;
+    t = adapter.settle_until;
+    ev_now_IgnoreAndReturn(t);
+    adapter_flush(&adapter, t);
+    TEST_ASSERT_FALSE(port.queued);
+    TEST_ASSERT_FALSE(port.busy);
+    TEST_ASSERT_EQUAL(cap, rescan_credit);
+}
+
+#endif // TEST
@@ -0,0 +1,102 @@
+#ifdef TEST
+
+#include <stdint.h>
+#include <string.h>
+
+#include "unity.h"
+
+#include "arena.h"
+
+static struct arena arena;
+
+void setUp(void)
+{
+    arena_init(&arena, 256);
+}
+
+void tearDown(void)
+{
+    arena_free(&arena);
+}
+
+void test_arena_AllocationsAreAlignedAndDistinct(void)
+{
+    unsigned char *p = arena_alloc(&arena, 1);
+    unsigned char *q = arena_alloc(&arena, 24);
+    unsigned char *r = arena_alloc(&arena, 0);
+
+    TEST_ASSERT_NOT_NULL(p);
+    TEST_ASSERT_NOT_NULL(q);
+    TEST_ASSERT_NOT_NULL(r);
+    TEST_ASSERT_EQUAL(0, (uintptr_t)p % 16);
+    TEST_ASSERT_EQUAL(0, (uintptr_t)q % 16);
+    TEST_ASSERT_EQUAL(0, (uintptr_t)r % 16);
+    TEST_ASSERT_GREATER_OR_EQUAL(p + 16, q);
+    TEST_ASSERT_GREATER_OR_EQUAL(q + 32, r);
+    TEST_ASSERT_EQUAL(3, arena.allocs);
+    TEST_ASSERT_EQUAL(16 + 32 + 16, arena.used);
+}
+
+void test_arena_LargeAllocationGetsItsOwnChunk(void)
+{
+    unsigned char *p = arena_alloc(&arena, 4000);
+
+    TEST_ASSERT_NOT_NULL(p);
+    memset(p, 0xa5, 4000);
+    TEST_ASSERT_GREATER_OR_EQUAL(4000, arena.reserved);
+    TEST_ASSERT_EQUAL(1, arena.chunk_allocs);
+}
+
+void test_arena_ReallocExtendsTheLastAllocationInPlace(void)
+{
+    unsigned char *p = arena_alloc(&arena, 32);
+    unsigned char *q;
+
+    memset(p, 0x11, 32);
+    q = arena_realloc(&arena, p, 32, 64);
+    TEST_ASSERT_EQUAL_PTR(p, q);
+    TEST_ASSERT_EQUAL(64, arena.used);
+}
+
+void test_arena_ReallocCopiesWhenNotLast(void)
+{
+    unsigned char *p = arena_alloc(&arena, 32);
+    unsigned char *q;
+    int i;
+
+    for (i = 0; i < 32; i++)
+        p[i] = i;
+    arena_alloc(&arena, 16);
+    q = arena_realloc(&arena, p, 32, 128);
+    TEST_ASSERT_NOT_NULL(q);
+    TEST_ASSERT_TRUE(q != p);
+    for (i = 0; i < 32; i++)
+        TEST_ASSERT_EQUAL(i, q[i]);
+}
+
+void test_arena_ResetSettlesOnOneChunk(void)
+{
+    unsigned long chunks;
+    int round, i;
+
+    /* The first round outgrows the first chunk several times */
+    for (i = 0; i < 100; i++)
+        TEST_ASSERT_NOT_NULL(arena_alloc(&arena, 100));
+    TEST_ASSERT_GREATER_THAN(1, arena.chunk_allocs);
+    arena_reset(&arena);
+    TEST_ASSERT_EQUAL(0, arena.used);
+    TEST_ASSERT_GREATER_OR_EQUAL(100 * 112, arena.peak);
+
+    /* The same rounds again fit in what was kept, with no malloc() */
+    chunks = arena.chunk_allocs;
+    for (round = 0; round < 5; round++) {
+        for (i = 0; i < 100; i++)
+            TEST_ASSERT_NOT_NULL(arena_alloc(&arena, 100));
+        arena_reset(&arena);
+    }
+    TEST_ASSERT_EQUAL(chunks, arena.chunk_allocs);
+    TEST_ASSERT_EQUAL(6, arena.resets);
+    TEST_ASSERT_EQUAL(600, arena.total_allocs);
+}
+
+#endif // TEST
@@ -0,0 +1,142 @@
+#ifdef TEST
+
+#include <string.h>
+#include <unistd.h>
+
+#include "unity.h"
+
+#include "pciutils.h"
+#include "sim_tree.h"
+
+#define EXT_CAP_ID_UNLISTED 0x50    /* Beyond the lookup table */
+
+static char path[64];
+static struct pci_access *pacc;
+static struct pci_dev *dev;
+static uint8_t conf[4096];
+
+static void put_cap(int where, int id, int next)
+{
+    conf[where + PCI_CAP_LIST_ID] = id;
+    conf[where + PCI_CAP_LIST_NEXT] = next;
+}
+
+static void put_ext_cap(int where, int id, int next)
+{
+    uint32_t header = id | 1 << 16 | next << 20;
+
+    memcpy(conf + where, &header, 4);
+}
+
+/* A PCIe function with PM, Express, MSI and two vendor-specific capabilities */
+static void build_conf(void)
+{
+    memset(conf, 0, sizeof(conf));
+    conf[PCI_VENDOR_ID] = 0xb5;
+    conf[PCI_VENDOR_ID + 1] = 0x10;
+    conf[PCI_STATUS] = PCI_STATUS_CAP_LIST;
+    conf[PCI_CAPABILITY_LIST] = 0x40;
+    put_cap(0x40, PCI_CAP_ID_PM, 0x50);
+    put_cap(0x50, PCI_CAP_ID_EXP, 0x70);
+    put_cap(0x70, PCI_CAP_ID_MSI, 0x90);
+    put_cap(0x90, PCI_CAP_ID_VNDR, 0xa0);
+    put_cap(0xa0, PCI_CAP_ID_VNDR, 0);
+    put_ext_cap(0x100, PCI_EXT_CAP_ID_AER, 0x140);
+    put_ext_cap(0x140, PCI_EXT_CAP_ID_DSN, 0x160);
+    put_ext_cap(0x160, EXT_CAP_ID_UNLISTED, 0);
+}
+
+static void open_dev(void)
+{
+    TEST_ASSERT_EQUAL(0, ecam_file_put(path, 0, 0, 0, conf, sizeof(conf)));
+    pacc = pci_alloc();
+    pacc->method = PCI_ACCESS_ECAM;
+    pci_set_param(pacc, "ecam.mcfg", "");
+    pci_set_param(pacc, "ecam.path", path);
+    pci_init(pacc);
+    dev = pci_get_dev(pacc, 0, 0, 0, 0);
+}
+
+void setUp(void)
+{
+    pacc = NULL;
+    dev = NULL;
+    TEST_ASSERT_EQUAL(0, ecam_file_create(path, sizeof(path), 1));
+    build_conf();
+}
+
+void tearDown(void)
+{
+    if (dev)
+        pci_free_dev(dev);
+    if (pacc)
+        pci_cleanup(pacc);
+    unlink(path);
+}
+
+void test_caps_FindsEachCapability(void)
+{
+    open_dev();
+    pci_fill_info(dev, PCI_FILL_CAPS | PCI_FILL_EXT_CAPS);
+    TEST_ASSERT_EQUAL_HEX16(0x40, pci_find_cap(dev, PCI_CAP_ID_PM, PCI_CAP_NORMAL)->addr);
+    TEST_ASSERT_EQUAL_HEX16(0x50, pci_find_cap(dev, PCI_CAP_ID_EXP, PCI_CAP_NORMAL)->addr);
+    TEST_ASSERT_EQUAL_HEX16(0x70, pci_find_cap(dev, PCI_CAP_ID_MSI, PCI_CAP_NORMAL)->addr);
+    TEST_ASSERT_EQUAL_HEX16(0x100, pci_find_cap(dev, PCI_EXT_CAP_ID_AER, PCI_CAP_EXTENDED)->addr);
+    TEST_ASSERT_EQUAL_HEX16(0x140, pci_find_cap(dev, PCI_EXT_CAP_ID_DSN, PCI_CAP_EXTENDED)->addr);
+    TEST_ASSERT_NULL(pci_find_cap(dev, PCI_CAP_ID_MSIX, PCI_CAP_NORMAL));
+    TEST_ASSERT_NULL(pci_find_cap(dev, PCI_EXT_CAP_ID_VC, PCI_CAP_EXTENDED));
+}
+
+void test_caps_TableHoldsTheFirstOfEachId(void)
+{
+    unsigned int n = 1;
+
+    open_dev();
+    pci_fill_info(dev, PCI_FILL_CAPS);
+    TEST_ASSERT_EQUAL_HEX16(0x90, pci_find_cap(dev, PCI_CAP_ID_VNDR, PCI_CAP_NORMAL)->addr);
+    /* The others are still there by number */
+    TEST_ASSERT_EQUAL_HEX16(0xa0, pci_find_cap_nr(dev, PCI_CAP_ID_VNDR, PCI_CAP_NORMAL, &n)->addr);
+    TEST_ASSERT_EQUAL(2, n);
+}
+
+void test_caps_IdsBeyondTheTableAreFoundByWalking(void)
+{
+    open_dev();
+    pci_fill_info(dev, PCI_FILL_EXT_CAPS);
+    TEST_ASSERT_EQUAL_HEX16(0x160, pci_find_cap(dev, EXT_CAP_ID_UNLISTED, PCI_CAP_EXTENDED)->addr);
+}
+
+void test_caps_ExtendedCapsNeedTheExpressCap(void)
+{
+    put_cap(0x40, PCI_CAP_ID_PM, 0);
+    open_dev();
+    pci_fill_info(dev, PCI_FILL_CAPS | PCI_FILL_EXT_CAPS);
+    TEST_ASSERT_NOT_NULL(pci_find_cap(dev, PCI_CAP_ID_PM, PCI_CAP_NORMAL));
+    TEST_ASSERT_NULL(pci_find_cap(dev, PCI_EXT_CAP_ID_AER, PCI_CAP_EXTENDED));
+}
+
+void test_caps_LoopInTheChainEnds(void)
+{
+    put_cap(0xa0, PCI_CAP_ID_VNDR, 0x40);
+    put_ext_cap(0x160, EXT_CAP_ID_UNLISTED, 0x100);
+    open_dev();
+    pci_fill_info(dev, PCI_FILL_CAPS | PCI_FILL_EXT_CAPS);
+    TEST_ASSERT_EQUAL_HEX16(0x40, pci_find_cap(dev, PCI_CAP_ID_PM, PCI_CAP_NORMAL)->addr);
+    TEST_ASSERT_EQUAL_HEX16(0x100, pci_find_cap(dev, PCI_EXT_CAP_ID_AER, PCI_CAP_EXTENDED)->addr);
+}
+
+void test_caps_RescanReplacesTheTable(void)
+{
+    open_dev();
+    pci_fill_info(dev, PCI_FILL_CAPS);
+    TEST_ASSERT_NOT_NULL(pci_find_cap(dev, PCI_CAP_ID_MSI, PCI_CAP_NORMAL));
+
+    /* MSI is gone from the chain */
+    put_cap(0x50, PCI_CAP_ID_EXP, 0x90);
+    TEST_ASSERT_EQUAL(0, ecam_file_put(path, 0, 0, 0, conf, 256));
+    pci_fill_info(dev, PCI_FILL_RESCAN | PCI_FILL_CAPS);
+    TEST_ASSERT_NULL(pci_find_cap(dev, PCI_CAP_ID_MSI, PCI_CAP_NORMAL));
+    TEST_ASSERT_EQUAL_HEX16(0x90, pci_find_cap(dev, PCI_CAP_ID_VNDR, PCI_CAP_NORMAL)->addr);
+}
+
+#endif // TEST
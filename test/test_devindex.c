@@ -0,0 +1,133 @@
+#ifdef TEST
+
+#include <string.h>
+
+#include "unity.h"
+
+#include "pciutils.h"
+#include "arena.h"
+#include "devindex.h"
+
+#define NDEVS   40
+
+static struct arena arena;
+static struct dev_index ix;
+static struct pci_dev devs[NDEVS];
+
+static void link_devs(int n, int domains)
+{
+    int i;
+
+    memset(devs, 0, sizeof(devs));
+    for (i = 0; i < n; i++) {
+        devs[i].domain = i % domains;
+        devs[i].bus = i / 8;
+        devs[i].dev = i % 8;
+        devs[i].func = i % 3;
+        devs[i].vendor_id = 0x10b5;
+        devs[i].device_id = 0x8600 + i;
+        devs[i].known_fields = PCI_FILL_IDENT | PCI_FILL_CLASS;
+        devs[i].next = i + 1 < n ? &devs[i + 1] : NULL;
+    }
+}
+
+static void slot_filter(struct pci_filter *f, int domain, int bus, int slot, int func)
+{
+    pci_filter_init(NULL, f);
+    f->domain = domain;
+    f->bus = bus;
+    f->slot = slot;
+    f->func = func;
+}
+
+void setUp(void)
+{
+    arena_init(&arena, 4096);
+}
+
+void tearDown(void)
+{
+    dev_index_clear(&ix);
+    arena_free(&arena);
+}
+
+void test_devindex_FindsEveryFunction(void)
+{
+    struct dev_index_entry *e;
+    int i;
+
+    link_devs(NDEVS, 1);
+    TEST_ASSERT_EQUAL(0, dev_index_build(&ix, &arena, devs, NULL));
+    TEST_ASSERT_EQUAL(NDEVS, ix.count);
+    /* At most half full */
+    TEST_ASSERT_GREATER_OR_EQUAL(2 * NDEVS, ix.mask + 1);
+    for (i = 0; i < NDEVS; i++) {
+        e = dev_index_find(&ix, dev_index_key(devs[i].domain, devs[i].bus, devs[i].dev, devs[i].func));
+        TEST_ASSERT_NOT_NULL(e);
+        TEST_ASSERT_EQUAL_PTR(&devs[i], e->pdev);
+        TEST_ASSERT_NULL(e->dev);
+    }
+    TEST_ASSERT_NULL(dev_index_find(&ix, dev_index_key(0, 0xff, 0x1f, 7)));
+}
+
+void test_devindex_EmptyIndexFindsNothing(void)
+{
+    struct pci_filter f;
+
+    slot_filter(&f, 0, 0, 0, 0);
+    TEST_ASSERT_NULL(dev_index_find(&ix, dev_index_key(0, 0, 0, 0)));
+    TEST_ASSERT_FALSE(dev_index_covers(&ix, &f));
+}
+
+void test_devindex_KeySeparatesDomains(void)
+{
+    TEST_ASSERT_TRUE(dev_index_key(0, 1, 2, 3) != dev_index_key(1, 1, 2, 3));
+    TEST_ASSERT_TRUE(dev_index_key(0, 1, 2, 3) != dev_index_key(0, 1, 3, 2));
+}
+
+void test_devindex_FilterWithoutDomainNeedsASingleDomain(void)
+{
+    struct pci_filter f;
+
+    link_devs(NDEVS, 1);
+    dev_index_build(&ix, &arena, devs, NULL);
+    slot_filter(&f, -1, devs[9].bus, devs[9].dev, devs[9].func);
+    TEST_ASSERT_TRUE(dev_index_covers(&ix, &f));
+    TEST_ASSERT_EQUAL_PTR(&devs[9], dev_index_find_filter(&ix, &f)->pdev);
+
+    link_devs(NDEVS, 2);
+    dev_index_build(&ix, &arena, devs, NULL);
+    TEST_ASSERT_EQUAL(2, ix.ndomains);
+    TEST_ASSERT_FALSE(dev_index_covers(&ix, &f));
+    f.domain = devs[9].domain;
+    TEST_ASSERT_TRUE(dev_index_covers(&ix, &f));
+    TEST_ASSERT_EQUAL_PTR(&devs[9], dev_index_find_filter(&ix, &f)->pdev);
+}
+
+void test_devindex_WildcardsAreNotCovered(void)
+{
+    struct pci_filter f;
+
+    link_devs(NDEVS, 1);
+    dev_index_build(&ix, &arena, devs, NULL);
+    slot_filter(&f, 0, 1, -1, 0);
+    TEST_ASSERT_FALSE(dev_index_covers(&ix, &f));
+    slot_filter(&f, 0, 1, 2, -1);
+    TEST_ASSERT_FALSE(dev_index_covers(&ix, &f));
+}
+
+void test_devindex_FilterIdsAreCheckedOnTheResult(void)
+{
+    struct pci_filter f;
+
+    link_devs(NDEVS, 1);
+    dev_index_build(&ix, &arena, devs, NULL);
+    slot_filter(&f, 0, devs[5].bus, devs[5].dev, devs[5].func);
+    f.vendor = 0x10b5;
+    f.device = devs[5].device_id;
+    TEST_ASSERT_NOT_NULL(dev_index_find_filter(&ix, &f));
+    f.device = devs[6].device_id;
+    TEST_ASSERT_NULL(dev_index_find_filter(&ix, &f));
+}
+
+#endif // TEST
@@ -0,0 +1,176 @@
+#ifdef TEST
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "unity.h"
+
+#include "pciutils.h"
+#include "sim_tree.h"
+
+static char path[64];
+static struct pci_access *pacc;
+static int warnings;
+
+static void count_warning(char *msg, ...)
+{
+    (void)(msg);
+    warnings++;
+}
+
+static struct pci_access *ecam_open(const char *file)
+{
+    struct pci_access *a = pci_alloc();
+
+    a->method = PCI_ACCESS_ECAM;
+    a->warning = count_warning;
+    pci_set_param(a, "ecam.mcfg", "");
+    pci_set_param(a, "ecam.path", (char *)file);
+    pci_init(a);
+    return a;
+}
+
+static void put_function(int bus, int dev, int func, uint16_t vendor, uint16_t device, uint8_t hdr)
+{
+    uint8_t conf[256];
+    int i;
+
+    for (i = 0; i < 256; i++)
+        conf[i] = i;
+    conf[PCI_VENDOR_ID] = vendor & 0xff;
+    conf[PCI_VENDOR_ID + 1] = vendor >> 8;
+    conf[PCI_DEVICE_ID] = device & 0xff;
+    conf[PCI_DEVICE_ID + 1] = device >> 8;
+    conf[PCI_HEADER_TYPE] = hdr;
+    TEST_ASSERT_EQUAL(0, ecam_file_put(path, bus, dev, func, conf, sizeof(conf)));
+}
+
+static struct pci_dev *find(int bus, int dev, int func)
+{
+    struct pci_dev *p;
+
+    for (p = pacc->devices; p; p = p->next)
+        if (p->bus == bus && p->dev == dev && p->func == func)
+            return p;
+    return NULL;
+}
+
+void setUp(void)
+{
+    warnings = 0;
+    pacc = NULL;
+    TEST_ASSERT_EQUAL(0, ecam_file_create(path, sizeof(path), 2));
+    put_function(0, 0, 0, 0x8086, 0x1901, 0x01);
+    put_function(0, 3, 0, 0x10b5, 0x8608, 0x01);
+    /* Multi-function, with a hole at function 1 */
+    put_function(1, 0, 0, 0x104c, 0x8241, 0x80);
+    put_function(1, 0, 2, 0x104c, 0x8242, 0x00);
+    /* Not multi-function, so function 1 is not looked at */
+    put_function(1, 4, 0, 0x1af4, 0x1041, 0x00);
+    put_function(1, 4, 1, 0x1af4, 0x1042, 0x00);
+}
+
+void tearDown(void)
+{
+    if (pacc)
+        pci_cleanup(pacc);
+    unlink(path);
+}
+
+void test_ecam_ScanFindsTheFunctionsInTheFile(void)
+{
+    struct pci_dev *p;
+    int n = 0;
+
+    pacc = ecam_open(path);
+    pci_scan_bus(pacc);
+    for (p = pacc->devices; p; p = p->next)
+        n++;
+    TEST_ASSERT_EQUAL(5, n);
+    TEST_ASSERT_NOT_NULL(p = find(1, 0, 2));
+    TEST_ASSERT_EQUAL_HEX16(0x104c, p->vendor_id);
+    TEST_ASSERT_EQUAL_HEX16(0x8242, p->device_id);
+    TEST_ASSERT_NULL(find(1, 0, 1));
+    TEST_ASSERT_NULL(find(1, 4, 1));
+    TEST_ASSERT_EQUAL(0, warnings);
+}
+
+void test_ecam_ReadsAreLoadsFromTheFile(void)
+{
+    struct pci_dev *p;
+    u8 buf[7];
+    int i;
+
+    pacc = ecam_open(path);
+    pci_scan_bus(pacc);
+    p = find(0, 3, 0);
+    TEST_ASSERT_EQUAL_HEX16(0x10b5, pci_read_word(p, PCI_VENDOR_ID));
+    TEST_ASSERT_EQUAL_HEX32(0x860810b5, pci_read_long(p, PCI_VENDOR_ID));
+    TEST_ASSERT_EQUAL_HEX8(0x41, pci_read_byte(p, 0x41));
+    TEST_ASSERT_EQUAL_HEX32(0x4b4a4948, pci_read_long(p, 0x48));
+    /* Unaligned, so made of byte, word and dword loads */
+    TEST_ASSERT_EQUAL(1, pci_read_block(p, 0x81, buf, sizeof(buf)));
+    for (i = 0; i < (int)sizeof(buf); i++)
+        TEST_ASSERT_EQUAL_HEX8(0x81 + i, buf[i]);
+}
+
+void test_ecam_WritesToTheFileAreSeenAtOnce(void)
+{
+    struct pci_dev *p;
+    uint8_t val[2] = { 0x34, 0x12 };
+
+    pacc = ecam_open(path);
+    pci_scan_bus(pacc);
+    p = find(1, 0, 2);
+    TEST_ASSERT_EQUAL_HEX16(0x9392, pci_read_word(p, 0x92));
+    TEST_ASSERT_EQUAL(0, ecam_file_put(path, 1, 0, 2, val, sizeof(val)));
+    /* Mapped, not copied: no rescan needed */
+    TEST_ASSERT_EQUAL_HEX16(0x1234, pci_read_word(p, PCI_VENDOR_ID));
+}
+
+void test_ecam_BusesOutsideTheFileAreNotReadable(void)
+{
+    struct pci_dev *p;
+    u8 buf[4];
+
+    pacc = ecam_open(path);
+    p = pci_get_dev(pacc, 0, 2, 0, 0);
+    TEST_ASSERT_EQUAL(0, pci_read_block(p, 0, buf, sizeof(buf)));
+    pci_free_dev(p);
+}
+
+void test_ecam_IsReadOnly(void)
+{
+    struct pci_dev *p;
+
+    pacc = ecam_open(path);
+    pci_scan_bus(pacc);
+    p = find(0, 0, 0);
+    TEST_ASSERT_EQUAL(0, pci_write_word(p, PCI_COMMAND, 0));
+    TEST_ASSERT_EQUAL_HEX16(0x0504, pci_read_word(p, PCI_COMMAND));
+}
+
+void test_ecam_MissingFileIsOnlyAWarning(void)
+{
+    pacc = ecam_open("/nonexistent/adnacom-ecam");
+    pci_scan_bus(pacc);
+    TEST_ASSERT_EQUAL(1, warnings);
+    TEST_ASSERT_NULL(pacc->devices);
+}
+
+void test_ecam_MissingMcfgIsOnlyAWarning(void)
+{
+    pacc = pci_alloc();
+    pacc->method = PCI_ACCESS_ECAM;
+    pacc->warning = count_warning;
+    pci_set_param(pacc, "ecam.mcfg", "/nonexistent/MCFG");
+    pci_set_param(pacc, "ecam.path", path);
+    pci_init(pacc);
+    pci_scan_bus(pacc);
+    TEST_ASSERT_GREATER_OR_EQUAL(1, warnings);
+    TEST_ASSERT_NULL(pacc->devices);
+}
+
+#endif // TEST
@@ -0,0 +1,165 @@
+#ifdef TEST
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "unity.h"
+
+#include "log.h"
+
+#define PRODUCERS       4
+#define PER_PRODUCER    2000
+
+static char out_path[] = "/tmp/adnacom-log.XXXXXX";
+static int out_fd = -1, saved_fd = -1;
+static char *out;
+
+/* Points stdout at a scratch file so the tests can read back what was written */
+void setUp(void)
+{
+    unsetenv("JOURNAL_STREAM");
+    strcpy(out_path, "/tmp/adnacom-log.XXXXXX");
+    out_fd = mkstemp(out_path);
+    TEST_ASSERT_GREATER_OR_EQUAL(0, out_fd);
+    fflush(stdout);
+    saved_fd = dup(STDOUT_FILENO);
+    dup2(out_fd, STDOUT_FILENO);
+    out = NULL;
+}
+
+void tearDown(void)
+{
+    log_stop();
+    fflush(stdout);
+    dup2(saved_fd, STDOUT_FILENO);
+    close(saved_fd);
+    close(out_fd);
+    unlink(out_path);
+    free(out);
+}
+
+/*! @brief Stops the writer and returns everything it printed */
+static const char *captured(void)
+{
+    off_t len;
+
+    log_stop();
+    fflush(stdout);
+    len = lseek(out_fd, 0, SEEK_END);
+    out = calloc(1, len + 1);
+    TEST_ASSERT_EQUAL(len, pread(out_fd, out, len, 0));
+    return out;
+}
+
+static unsigned int count_lines(const char *s)
+{
+    unsigned int n = 0;
+
+    for (; *s; s++)
+        n += *s == '\n';
+    return n;
+}
+
+void test_log_ParseLevel(void)
+{
+    TEST_ASSERT_EQUAL(LOG_ERR, log_parse_level("err"));
+    TEST_ASSERT_EQUAL(LOG_WARNING, log_parse_level("warning"));
+    TEST_ASSERT_EQUAL(LOG_DEBUG, log_parse_level("debug"));
+    TEST_ASSERT_EQUAL(-1, log_parse_level("verbose"));
+}
+
+void test_log_WritesInlineBeforeStart(void)
+{
+    adna_log(LOG_INFO, "before %d", 1);
+    TEST_ASSERT_EQUAL_STRING("before 1\n", captured());
+}
+
+void test_log_KeepsOrderThroughTheRing(void)
+{
+    char want[32];
+    const char *s;
+    int i;
+
+    TEST_ASSERT_EQUAL(0, log_start(LOG_INFO, false));
+    for (i = 0; i < LOG_RING_SIZE / 2; i++)
+        adna_log(LOG_INFO, "msg %d", i);
+    s = captured();
+
+    TEST_ASSERT_EQUAL(LOG_RING_SIZE / 2, count_lines(s));
+    for (i = 0; i < LOG_RING_SIZE / 2; i++) {
+        snprintf(want, sizeof(want), "msg %d\n", i);
+        TEST_ASSERT_EQUAL_MEMORY(want, s, strlen(want));
+        s += strlen(want);
+    }
+}
+
+void test_log_DropsRecordsAboveTheLevel(void)
+{
+    TEST_ASSERT_EQUAL(0, log_start(LOG_WARNING, false));
+    TEST_ASSERT_TRUE(log_enabled(LOG_ERR));
+    TEST_ASSERT_FALSE(log_enabled(LOG_INFO));
+
+    adna_log(LOG_DEBUG, "debug");
+    adna_log(LOG_INFO, "info");
+    adna_log(LOG_WARNING, "warning");
+    adna_log(LOG_ERR, "err");
+    TEST_ASSERT_EQUAL_STRING("warning\nerr\n", captured());
+}
+
+void test_log_PrefixesThePortAndJournalLevel(void)
+{
+    setenv("JOURNAL_STREAM", "8:1234", 1);
+    TEST_ASSERT_EQUAL(0, log_start(LOG_INFO, false));
+    adna_log_port(LOG_NOTICE, "02:01.0", "link is %s", "Up");
+    adna_log(LOG_ERR, "plain");
+    TEST_ASSERT_EQUAL_STRING("<5>02:01.0 link is Up\n<3>plain\n", captured());
+}
+
+static void *producer(void *arg)
+{
+    long id = (long)arg;
+    int i;
+
+    for (i = 0; i < PER_PRODUCER; i++)
+        adna_log(LOG_INFO, "p%ld %d", id, i);
+    return NULL;
+}
+
+/* Records may be dropped when the ring is full, but never reordered or lost silently */
+void test_log_ConcurrentProducersLoseNothingSilently(void)
+{
+    pthread_t threads[PRODUCERS];
+    int last[PRODUCERS];
+    unsigned long records = 0, dropped = 0, n;
+    const char *s;
+    long id;
+    int i;
+
+    TEST_ASSERT_EQUAL(0, log_start(LOG_INFO, false));
+    for (id = 0; id < PRODUCERS; id++)
+        TEST_ASSERT_EQUAL(0, pthread_create(&threads[id], NULL, producer, (void *)id));
+    for (id = 0; id < PRODUCERS; id++)
+        pthread_join(threads[id], NULL);
+    s = captured();
+
+    for (id = 0; id < PRODUCERS; id++)
+        last[id] = -1;
+    for (; *s; s = strchr(s, '\n') + 1) {
+        if (sscanf(s, "p%ld %d", &id, &i) == 2) {
+            TEST_ASSERT_TRUE(id >= 0 && id < PRODUCERS);
+            TEST_ASSERT_GREATER_THAN(last[id], i);
+            last[id] = i;
+            records++;
+        } else {
+            TEST_ASSERT_EQUAL(1, sscanf(s, "%lu log message(s) dropped", &n));
+            dropped += n;
+        }
+    }
+    TEST_ASSERT_EQUAL(PRODUCERS * PER_PRODUCER, records + dropped);
+}
+
+#endif // TEST
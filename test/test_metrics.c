@@ -0,0 +1,104 @@
+#ifdef TEST
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "unity.h"
+
+#include "evloop.h"
+#include "log.h"
+#include "metrics.h"
+
+static struct hdr_hist h;
+
+/* Relative error of a bucket bound, 1 / 2^HDR_SUB_BITS */
+static void assert_close(uint64_t expected, uint64_t actual)
+{
+    TEST_ASSERT_UINT64_WITHIN(expected >> HDR_SUB_BITS, expected, actual);
+}
+
+void setUp(void)
+{
+    memset(&h, 0, sizeof(h));
+}
+
+void tearDown(void)
+{
+}
+
+void test_metrics_EmptyHistogramHasNoQuantiles(void)
+{
+    TEST_ASSERT_EQUAL_UINT64(0, hdr_quantile(&h, 0.5));
+    TEST_ASSERT_EQUAL_UINT64(0, hdr_quantile(&h, 1.0));
+}
+
+void test_metrics_SmallValuesAreExact(void)
+{
+    uint64_t v;
+
+    for (v = 0; v < 8; v++)
+        hdr_record(&h, v);
+    TEST_ASSERT_EQUAL_UINT64(8, h.count);
+    TEST_ASSERT_EQUAL_UINT64(28, h.sum);
+    TEST_ASSERT_EQUAL_UINT64(7, h.max);
+    TEST_ASSERT_EQUAL_UINT64(0, hdr_quantile(&h, 0.1));
+    TEST_ASSERT_EQUAL_UINT64(3, hdr_quantile(&h, 0.5));
+    TEST_ASSERT_EQUAL_UINT64(7, hdr_quantile(&h, 1.0));
+}
+
+void test_metrics_QuantilesAreWithinABucket(void)
+{
+    uint64_t v;
+
+    /* 1us .. 1ms */
+    for (v = 1; v <= 1000; v++)
+        hdr_record(&h, v * 1000);
+    assert_close(500000, hdr_quantile(&h, 0.5));
+    assert_close(900000, hdr_quantile(&h, 0.9));
+    assert_close(990000, hdr_quantile(&h, 0.99));
+    TEST_ASSERT_EQUAL_UINT64(1000000, hdr_quantile(&h, 1.0));
+}
+
+void test_metrics_QuantileNeverExceedsTheMaximum(void)
+{
+    hdr_record(&h, 1000);
+    hdr_record(&h, 1001);
+    TEST_ASSERT_EQUAL_UINT64(1001, hdr_quantile(&h, 0.99));
+}
+
+void test_metrics_HugeValuesAreClamped(void)
+{
+    hdr_record(&h, UINT64_MAX / 2);
+    hdr_record(&h, 5);
+    TEST_ASSERT_EQUAL_UINT64(1, h.buckets[HDR_BUCKETS - 1]);
+    TEST_ASSERT_EQUAL_UINT64(UINT64_MAX / 2, h.max);
+    TEST_ASSERT_EQUAL_UINT64(5, hdr_quantile(&h, 0.5));
+}
+
+void test_metrics_ExpositionIsCumulative(void)
+{
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f;
+
+    hdr_record(&h, 500);            /* Below the first bound, 2^10 ns */
+    hdr_record(&h, 1000);
+    hdr_record(&h, 3 * NSEC_PER_MSEC);
+    TEST_ASSERT_NOT_NULL(f = open_memstream(&buf, &len));
+    metrics_hist(f, "adna_test_seconds", "Test", &h);
+    fclose(f);
+
+    TEST_ASSERT_NOT_NULL(strstr(buf, "# TYPE adna_test_seconds histogram\n"));
+    TEST_ASSERT_NOT_NULL(strstr(buf, "adna_test_seconds_bucket{le=\"1.024e-06\"} 2\n"));
+    TEST_ASSERT_NOT_NULL(strstr(buf, "adna_test_seconds_bucket{le=\"0.002097152\"} 2\n"));
+    TEST_ASSERT_NOT_NULL(strstr(buf, "adna_test_seconds_bucket{le=\"0.004194304\"} 3\n"));
+    TEST_ASSERT_NOT_NULL(strstr(buf, "adna_test_seconds_bucket{le=\"+Inf\"} 3\n"));
+    TEST_ASSERT_NOT_NULL(strstr(buf, "adna_test_seconds_count 3\n"));
+    TEST_ASSERT_NOT_NULL(strstr(buf, "adna_test_seconds_sum 0.003001500\n"));
+    /* The maximum is exact */
+    TEST_ASSERT_NOT_NULL(strstr(buf, "adna_test_seconds_quantile{quantile=\"1\"} 0.003000000\n"));
+    free(buf);
+}
+
+#endif // TEST
@@ -0,0 +1,128 @@
+#ifdef TEST
+
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "unity.h"
+
+#include "sim_tree.h"
+
+/*
+ * End to end: adnacom-hp monitors a tree that adnacom-sim changes as
+ * scripted. Both are built by make. The daemon samples its first tick
+ * ADNA_FIRST_TICK_MS after it starts, so the script leaves it time to
+ * see the port Up first.
+ */
+#define RUN_MS      5500
+#define PORT        "02:01.0"
+
+static char dir[PATH_MAX];
+static char hp_log[PATH_MAX + 8];
+static pid_t sim_pid;
+static char *hp_out, *sim_out;
+
+void setUp(void)
+{
+    if (!sim_tree_available() || access(SIM_TREE_HP, X_OK) != 0)
+        TEST_IGNORE_MESSAGE("Run make first, adnacom-sim and adnacom-hp are needed");
+    sim_pid = 0;
+    hp_out = sim_out = NULL;
+}
+
+void tearDown(void)
+{
+    sim_tree_stop(sim_pid);
+    if (sim_pid > 0) {
+        unlink(hp_log);
+        sim_tree_remove(dir);
+    }
+    free(hp_out);
+    free(sim_out);
+}
+
+static char *read_file(const char *path)
+{
+    char *buf;
+    FILE *f;
+    long len;
+
+    TEST_ASSERT_NOT_NULL(f = fopen(path, "r"));
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    rewind(f);
+    buf = calloc(1, len + 1);
+    TEST_ASSERT_EQUAL(len, fread(buf, 1, len, f));
+    fclose(f);
+    return buf;
+}
+
+/*! @brief Runs the daemon on the tree for @ms, its output going to hp_log */
+static void run_daemon(unsigned int ms)
+{
+    char sysfs[PATH_MAX + 16];
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    pid_t pid;
+    int fd;
+
+    snprintf(sysfs, sizeof(sysfs), "--sysfs=%s", dir);
+    snprintf(hp_log, sizeof(hp_log), "%s.hp.log", dir);
+    TEST_ASSERT_TRUE((pid = fork()) >= 0);
+    if (pid == 0) {
+        if ((fd = open(hp_log, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+            _exit(127);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        execl(SIM_TREE_HP, SIM_TREE_HP, sysfs, "--tick-ms=20", (char *)NULL);
+        _exit(127);
+    }
+    nanosleep(&ts, NULL);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+static int count_lines(const char *s, const char *what)
+{
+    int n = 0;
+
+    for (; (s = strstr(s, what)) != NULL; s += strlen(what))
+        n++;
+    return n;
+}
+
+void test_sim_PortComesBackUpAfterOneRescan(void)
+{
+    char sim_log[PATH_MAX + 8];
+    const char *up, *last;
+
+    sim_pid = sim_tree_start(dir, sizeof(dir), "-a 1 -p 2", "2500 down 0 0\n3500 up 0 0\n");
+    TEST_ASSERT_GREATER_THAN(0, sim_pid);
+    run_daemon(RUN_MS);
+    hp_out = read_file(hp_log);
+    snprintf(sim_log, sizeof(sim_log), "%s.log", dir);
+    sim_out = read_file(sim_log);
+
+    TEST_ASSERT_NOT_NULL(strstr(hp_out, PORT " downstream port link is Down, was Up previously"));
+    TEST_ASSERT_NOT_NULL(up = strstr(hp_out, PORT " downstream port link is Up, was Down previously"));
+    TEST_ASSERT_EQUAL(1, count_lines(up, PORT " Training -> Recovering"));
+    TEST_ASSERT_EQUAL(1, count_lines(up, PORT " Recovering -> Up"));
+    for (last = up; strstr(last + 1, PORT " ") != NULL; last = strstr(last + 1, PORT " "))
+        ;
+    TEST_ASSERT_EQUAL_MEMORY(PORT " Recovering -> Up\n", last, strlen(PORT " Recovering -> Up\n"));
+
+    /* Only what was behind the port was removed, never the port itself */
+    TEST_ASSERT_NULL(strstr(sim_out, "] remove 0000:" PORT));
+
+    /* The simulator saw exactly one rescan once the link was back */
+    TEST_ASSERT_NOT_NULL(up = strstr(sim_out, "] up 0000:" PORT));
+    TEST_ASSERT_EQUAL(1, count_lines(up, "] rescan "));
+    TEST_ASSERT_EQUAL(1, count_lines(up, "] rescan 0000:" PORT ": 1 function(s) added"));
+}
+
+#endif // TEST
@@ -0,0 +1,113 @@
+#ifdef TEST
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "unity.h"
+
+#include "status.h"
+
+#define WRITES  200000
+
+static struct status_page *page;
+static volatile int writer_done;
+
+void setUp(void)
+{
+    page = calloc(1, sizeof(*page));
+    page->magic = STATUS_MAGIC;
+    page->version = STATUS_VERSION;
+    page->nadapters = 1;
+    page->nports = 2;
+    strcpy(page->ports[1].bdf, "0000:02:01.0");
+    page->ports[1].link_up_cnt = 3;
+    writer_done = 0;
+}
+
+void tearDown(void)
+{
+    free(page);
+}
+
+void test_status_ReadsAConsistentCopy(void)
+{
+    struct status_port sp;
+
+    TEST_ASSERT_TRUE(status_read_port(page, 1, &sp));
+    TEST_ASSERT_EQUAL_STRING("0000:02:01.0", sp.bdf);
+    TEST_ASSERT_EQUAL_UINT64(3, sp.link_up_cnt);
+}
+
+void test_status_NoSuchPort(void)
+{
+    struct status_port sp;
+    struct status_adapter sa;
+
+    TEST_ASSERT_FALSE(status_read_port(page, 2, &sp));
+    TEST_ASSERT_FALSE(status_read_port(page, STATUS_MAX_PORTS, &sp));
+    TEST_ASSERT_TRUE(status_read_adapter(page, 0, &sa));
+    TEST_ASSERT_FALSE(status_read_adapter(page, 1, &sa));
+}
+
+void test_status_WriteInProgressIsNotRead(void)
+{
+    struct status_port sp;
+
+    status_write_begin(&page->ports[1].seq);
+    TEST_ASSERT_FALSE(status_read_port(page, 1, &sp));
+    status_write_end(&page->ports[1].seq);
+    TEST_ASSERT_TRUE(status_read_port(page, 1, &sp));
+    TEST_ASSERT_EQUAL_UINT32(2, page->ports[1].seq);
+}
+
+void test_status_CountsAreGuardedToo(void)
+{
+    struct status_port sp;
+
+    /* A reader must not trust nports while the daemon changes it */
+    status_write_begin(&page->seq);
+    TEST_ASSERT_FALSE(status_read_port(page, 1, &sp));
+    status_write_end(&page->seq);
+    TEST_ASSERT_TRUE(status_read_port(page, 1, &sp));
+}
+
+/* Keeps the up and down counts of port 0 equal, outside of a write */
+static void *writer(void *arg)
+{
+    struct status_port *p = &page->ports[0];
+    uint64_t i;
+    (void)(arg);
+
+    for (i = 1; i <= WRITES; i++) {
+        status_write_begin(&p->seq);
+        __atomic_store_n(&p->link_up_cnt, i, __ATOMIC_RELAXED);
+        __atomic_store_n(&p->link_down_cnt, i, __ATOMIC_RELAXED);
+        status_write_end(&p->seq);
+    }
+    writer_done = 1;
+    return NULL;
+}
+
+void test_status_ReaderRetriesPastConcurrentWrites(void)
+{
+    struct status_port sp;
+    pthread_t t;
+    int reads = 0;
+
+    TEST_ASSERT_EQUAL(0, pthread_create(&t, NULL, writer, NULL));
+    do {
+        if (!status_read_port(page, 0, &sp))
+            continue;
+        /* Never a torn copy */
+        TEST_ASSERT_EQUAL_UINT64(sp.link_up_cnt, sp.link_down_cnt);
+        reads++;
+    } while (!writer_done || !reads);
+    pthread_join(t, NULL);
+    TEST_ASSERT_GREATER_THAN(0, reads);
+    TEST_ASSERT_TRUE(status_read_port(page, 0, &sp));
+    TEST_ASSERT_EQUAL_UINT64(WRITES, sp.link_up_cnt);
+    TEST_ASSERT_EQUAL_UINT64(WRITES, sp.link_down_cnt);
+}
+
+#endif // TEST
@@ -0,0 +1,206 @@
+#ifdef TEST
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "unity.h"
+
+#include "pciutils.h"
+#include "sim_tree.h"
+
+/* One adapter with three ports, behind them a hub each, plus background functions */
+#define SIM_ARGS        "-a 1 -p 3 -k 20"
+#define SIM_ADNA_FNS    7       /* Upstream port, 3 downstream ports, 3 hubs */
+
+static char dir[64];
+static struct pci_access *pacc;
+
+static struct pci_id_match scan_ids[] = {
+    { 0x10b5, 0x8608, PCI_CLASS_BRIDGE_PCI },
+    { 0x104c, 0x8241, PCI_CLASS_SERIAL_USB },
+    { 0, 0, 0 }
+};
+
+static struct pci_access *sysfs_open(const char *fds, const char *uring)
+{
+    struct pci_access *a = pci_alloc();
+    char path[128];
+
+    a->method = PCI_ACCESS_SYS_BUS_PCI;
+    snprintf(path, sizeof(path), "%s/bus/pci", dir);
+    pci_set_param(a, "sysfs.path", path);
+    pci_set_param(a, "sysfs.fds", (char *)fds);
+    pci_set_param(a, "sysfs.io_uring", (char *)uring);
+    pci_init(a);
+    return a;
+}
+
+static int count_devices(struct pci_access *a)
+{
+    struct pci_dev *p;
+    int n = 0;
+
+    for (p = a->devices; p; p = p->next)
+        n++;
+    return n;
+}
+
+static struct pci_dev *find(struct pci_access *a, int bus, int dev)
+{
+    struct pci_dev *p;
+
+    for (p = a->devices; p; p = p->next)
+        if (p->bus == bus && p->dev == dev && p->func == 0)
+            return p;
+    return NULL;
+}
+
+void setUp(void)
+{
+    dir[0] = 0;
+    pacc = NULL;
+    if (!sim_tree_available())
+        TEST_IGNORE_MESSAGE("Needs " SIM_TREE_EXEC ", run make first");
+    TEST_ASSERT_EQUAL(0, sim_tree_create(dir, sizeof(dir), SIM_ARGS));
+}
+
+void tearDown(void)
+{
+    if (pacc)
+        pci_cleanup(pacc);
+    sim_tree_remove(dir);
+}
+
+void test_sysfs_ScanWithoutFilterFindsEverything(void)
+{
+    pacc = sysfs_open("8", "0");
+    pci_scan_bus(pacc);
+    /* Root port and background bridge, then the adapter and the background functions */
+    TEST_ASSERT_EQUAL(2 + SIM_ADNA_FNS + 20, count_devices(pacc));
+}
+
+void test_sysfs_PrefilterKeepsMatchesAndTheirAncestors(void)
+{
+    struct pci_dev *p;
+
+    pacc = sysfs_open("8", "0");
+    pacc->scan_ids = scan_ids;
+    pci_scan_bus(pacc);
+    TEST_ASSERT_EQUAL(1 + SIM_ADNA_FNS, count_devices(pacc));
+
+    /* The root port above the adapter is kept for the topology, with its IDs */
+    TEST_ASSERT_NOT_NULL(p = find(pacc, 0, 1));
+    TEST_ASSERT_EQUAL_HEX16(0x8086, p->vendor_id);
+    TEST_ASSERT_EQUAL_HEX16(PCI_CLASS_BRIDGE_PCI, p->device_class);
+    TEST_ASSERT_NOT_NULL(p = find(pacc, 1, 0));
+    TEST_ASSERT_EQUAL_HEX16(0x10b5, p->vendor_id);
+    TEST_ASSERT_EQUAL_HEX16(0x8608, p->device_id);
+    TEST_ASSERT_TRUE(p->known_fields & PCI_FILL_IDENT);
+    TEST_ASSERT_NOT_NULL(p = find(pacc, 3, 0));
+    TEST_ASSERT_EQUAL_HEX16(0x104c, p->vendor_id);
+    TEST_ASSERT_EQUAL_HEX16(PCI_CLASS_SERIAL_USB, p->device_class);
+
+    /* Each function only once, although it is an ancestor of several */
+    for (p = pacc->devices; p; p = p->next)
+        TEST_ASSERT_EQUAL_PTR(p, find(pacc, p->bus, p->dev));
+}
+
+void test_sysfs_PrefilterFallsBackToSeparateAttributes(void)
+{
+    char cmd[160];
+
+    snprintf(cmd, sizeof(cmd), "find %s/devices -name modalias -delete", dir);
+    TEST_ASSERT_EQUAL(0, system(cmd));
+    pacc = sysfs_open("8", "0");
+    pacc->scan_ids = scan_ids;
+    pci_scan_bus(pacc);
+    TEST_ASSERT_EQUAL(1 + SIM_ADNA_FNS, count_devices(pacc));
+    TEST_ASSERT_EQUAL_HEX16(0x8241, find(pacc, 4, 0)->device_id);
+}
+
+void test_sysfs_FdCacheEvictsLeastRecentlyUsed(void)
+{
+    struct pci_dev *a, *b, *c;
+
+    pacc = sysfs_open("2", "0");
+    pacc->scan_ids = scan_ids;
+    pci_scan_bus(pacc);
+    a = find(pacc, 2, 1);
+    b = find(pacc, 2, 2);
+    c = find(pacc, 2, 3);
+
+    TEST_ASSERT_EQUAL_HEX16(0x10b5, pci_read_word(a, PCI_VENDOR_ID));
+    TEST_ASSERT_EQUAL_HEX16(0x10b5, pci_read_word(b, PCI_VENDOR_ID));
+    TEST_ASSERT_EQUAL(2, pacc->fd_stats.misses);
+    TEST_ASSERT_EQUAL(2, sim_tree_count_fds(dir));
+
+    /* a was used last, so c takes b's fd */
+    TEST_ASSERT_EQUAL_HEX16(0x8608, pci_read_word(a, PCI_DEVICE_ID));
+    TEST_ASSERT_EQUAL(1, pacc->fd_stats.hits);
+    TEST_ASSERT_EQUAL_HEX16(0x8608, pci_read_word(c, PCI_DEVICE_ID));
+    TEST_ASSERT_EQUAL(1, pacc->fd_stats.evictions);
+    TEST_ASSERT_EQUAL(2, sim_tree_count_fds(dir));
+    TEST_ASSERT_EQUAL_HEX16(0x8608, pci_read_word(a, PCI_DEVICE_ID));
+    TEST_ASSERT_EQUAL(2, pacc->fd_stats.hits);
+
+    /* b is reopened and still reads right */
+    TEST_ASSERT_EQUAL_HEX16(0x10b5, pci_read_word(b, PCI_VENDOR_ID));
+    TEST_ASSERT_EQUAL(4, pacc->fd_stats.misses);
+    TEST_ASSERT_EQUAL(2, pacc->fd_stats.evictions);
+    TEST_ASSERT_EQUAL(2, sim_tree_count_fds(dir));
+}
+
+void test_sysfs_FdsAreClosedWithTheirDevice(void)
+{
+    struct pci_dev *p;
+
+    pacc = sysfs_open("8", "0");
+    pci_scan_bus(pacc);
+    for (p = pacc->devices; p; p = p->next)
+        pci_read_byte(p, PCI_HEADER_TYPE);
+    TEST_ASSERT_EQUAL(8, sim_tree_count_fds(dir));
+    pci_cleanup(pacc);
+    pacc = NULL;
+    TEST_ASSERT_EQUAL(0, sim_tree_count_fds(dir));
+}
+
+static void check_batch(const char *uring)
+{
+    struct pci_read_req reqs[1 + SIM_ADNA_FNS];
+    u32 ids[1 + SIM_ADNA_FNS];
+    struct pci_dev *p;
+    int n = 0, i;
+
+    pacc = sysfs_open("3", uring);
+    pacc->scan_ids = scan_ids;
+    pci_scan_bus(pacc);
+    for (p = pacc->devices; p; p = p->next, n++) {
+        reqs[n].dev = p;
+        reqs[n].pos = PCI_VENDOR_ID;
+        reqs[n].len = 4;
+        reqs[n].buf = (u8 *)&ids[n];
+        ids[n] = 0;
+    }
+    TEST_ASSERT_EQUAL(1 + SIM_ADNA_FNS, n);
+    /* More requests than fds, so the batch goes in chunks */
+    TEST_ASSERT_EQUAL(n, pci_read_batch(pacc, reqs, n));
+    for (i = 0; i < n; i++) {
+        TEST_ASSERT_EQUAL(1, reqs[i].result);
+        TEST_ASSERT_EQUAL_HEX32((u32)reqs[i].dev->device_id << 16 | reqs[i].dev->vendor_id, le32_to_cpu(ids[i]));
+    }
+    TEST_ASSERT_LESS_OR_EQUAL(3, sim_tree_count_fds(dir));
+}
+
+void test_sysfs_BatchReadThroughIoUring(void)
+{
+    check_batch("1");
+}
+
+void test_sysfs_BatchReadWithoutIoUring(void)
+{
+    check_batch("0");
+}
+
+#endif // TEST
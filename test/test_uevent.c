@@ -0,0 +1,122 @@
+#ifdef TEST
+
+#include <string.h>
+
+#include "unity.h"
+
+#include "uevent.h"
+
+static char buf[UEVENT_BUFSIZE];
+static struct uevent ev;
+
+/* Lays out "header\0KEY=value\0..." as the kernel sends it; returns its length */
+static size_t message(const char *header, const char * const *keys)
+{
+    size_t n = 0;
+
+    strcpy(buf, header);
+    n += strlen(header) + 1;
+    for (; *keys; keys++) {
+        strcpy(buf + n, *keys);
+        n += strlen(*keys) + 1;
+    }
+    return n;
+}
+
+void setUp(void)
+{
+    memset(buf, 0x5a, sizeof(buf));
+    memset(&ev, 0xff, sizeof(ev));
+}
+
+void tearDown(void)
+{
+}
+
+void test_uevent_ParsesAPciAdd(void)
+{
+    static const char * const keys[] = {
+        "ACTION=add", "DEVPATH=/devices/pci0000:00/0000:00:01.0/0000:01:00.0",
+        "SUBSYSTEM=pci", "PCI_SLOT_NAME=0000:01:00.0", "SEQNUM=1234", NULL
+    };
+    size_t n = message("add@/devices/pci0000:00/0000:00:01.0/0000:01:00.0", keys);
+
+    TEST_ASSERT_EQUAL(1, uevent_parse(buf, n, &ev));
+    TEST_ASSERT_EQUAL(UEVENT_ADD, ev.action);
+    TEST_ASSERT_EQUAL(0, ev.domain);
+    TEST_ASSERT_EQUAL(1, ev.bus);
+    TEST_ASSERT_EQUAL(0, ev.dev);
+    TEST_ASSERT_EQUAL(0, ev.func);
+}
+
+void test_uevent_ParsesEachAction(void)
+{
+    static const char * const remove[] = { "ACTION=remove", "SUBSYSTEM=pci", "PCI_SLOT_NAME=0001:0a:1f.7", NULL };
+    static const char * const bind[] = { "ACTION=bind", "SUBSYSTEM=pci", "PCI_SLOT_NAME=0000:02:01.0", NULL };
+    static const char * const unbind[] = { "ACTION=unbind", "SUBSYSTEM=pci", "PCI_SLOT_NAME=0000:02:01.0", NULL };
+    static const char * const change[] = { "ACTION=change", "SUBSYSTEM=pci", "PCI_SLOT_NAME=0000:02:01.0", NULL };
+
+    TEST_ASSERT_EQUAL(1, uevent_parse(buf, message("remove@/x", remove), &ev));
+    TEST_ASSERT_EQUAL(UEVENT_REMOVE, ev.action);
+    TEST_ASSERT_EQUAL(1, ev.domain);
+    TEST_ASSERT_EQUAL(0x0a, ev.bus);
+    TEST_ASSERT_EQUAL(0x1f, ev.dev);
+    TEST_ASSERT_EQUAL(7, ev.func);
+    TEST_ASSERT_EQUAL(1, uevent_parse(buf, message("bind@/x", bind), &ev));
+    TEST_ASSERT_EQUAL(UEVENT_BIND, ev.action);
+    TEST_ASSERT_EQUAL(1, uevent_parse(buf, message("unbind@/x", unbind), &ev));
+    TEST_ASSERT_EQUAL(UEVENT_UNBIND, ev.action);
+    TEST_ASSERT_EQUAL(1, uevent_parse(buf, message("change@/x", change), &ev));
+    TEST_ASSERT_EQUAL(UEVENT_OTHER, ev.action);
+}
+
+void test_uevent_SlotFromTheDevpathWithoutPciSlotName(void)
+{
+    static const char * const keys[] = { "ACTION=remove", "SUBSYSTEM=pci", NULL };
+    size_t n = message("remove@/devices/pci0000:00/0000:00:01.0/0000:03:00.1", keys);
+
+    TEST_ASSERT_EQUAL(1, uevent_parse(buf, n, &ev));
+    TEST_ASSERT_EQUAL(3, ev.bus);
+    TEST_ASSERT_EQUAL(1, ev.func);
+}
+
+void test_uevent_IgnoresOtherSubsystems(void)
+{
+    static const char * const keys[] = {
+        "ACTION=add", "SUBSYSTEM=usb", "DEVPATH=/devices/pci0000:00/0000:00:14.0/usb1", NULL
+    };
+
+    TEST_ASSERT_EQUAL(0, uevent_parse(buf, message("add@/devices/pci0000:00/0000:00:14.0/usb1", keys), &ev));
+}
+
+void test_uevent_IgnoresMessagesWithoutHeader(void)
+{
+    /* What udev itself sends starts with "libudev" */
+    static const char * const keys[] = { "ACTION=add", "SUBSYSTEM=pci", "PCI_SLOT_NAME=0000:01:00.0", NULL };
+
+    TEST_ASSERT_EQUAL(0, uevent_parse(buf, message("libudev", keys), &ev));
+}
+
+void test_uevent_PciEventWithoutSlotIsIgnored(void)
+{
+    static const char * const keys[] = { "ACTION=add", "SUBSYSTEM=pci", NULL };
+
+    TEST_ASSERT_EQUAL(0, uevent_parse(buf, message("add@/devices/pci0000:00", keys), &ev));
+}
+
+void test_uevent_LastKeyNeedsNoNul(void)
+{
+    static const char * const keys[] = { "ACTION=add", "SUBSYSTEM=pci", "PCI_SLOT_NAME=0000:01:00.0", NULL };
+    size_t n = message("add@/x", keys);
+
+    /* Without its trailing NUL, the last key is terminated by the parser */
+    buf[n - 1] = 'x';
+    TEST_ASSERT_EQUAL(1, uevent_parse(buf, n - 1, &ev));
+    TEST_ASSERT_EQUAL(0, buf[n - 1]);
+    TEST_ASSERT_EQUAL(1, ev.bus);
+
+    /* Cut inside it, the slot is not taken */
+    TEST_ASSERT_EQUAL(0, uevent_parse(buf, n - 3, &ev));
+}
+
+#endif // TEST